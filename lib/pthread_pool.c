@@ -2,32 +2,123 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// counters are written by a single worker and read by anyone, relaxed
+// ordering is enough as long as the individual loads and stores are atomic
+#define STAT_LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STAT_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define STAT_ADD(x, v) STAT_STORE(x, STAT_LOAD(x) + (v))
 
 struct pool_queue
 {
+    void *(*fn)(void *);
     void *arg;
     char free;
+    unsigned long long enqueued_ns;
     struct pool_queue *next;
 };
 
+struct pool;
+
+struct pool_worker
+{
+    pthread_t thread;
+    struct pool *pool;
+    unsigned int index;
+    /** tasks only this worker may run, see pool_enqueue_to */
+    struct pool_queue *q;
+    struct pool_queue *end;
+    struct pool_worker_stats stats;
+};
+
 struct pool
 {
     char cancelled;
     void *(*fn)(void *);
+    int (*idle_fn)(unsigned int, void *);
+    void *idle_arg;
     unsigned int remaining;
     unsigned int nthreads;
+    unsigned int queued;
+    unsigned int max_queued;
+    unsigned long long enqueued;
     struct pool_queue *q;
     struct pool_queue *end;
     pthread_mutex_t q_mtx;
     pthread_cond_t q_cnd;
-    pthread_t threads[1];
+    struct pool_worker workers[1];
 };
 
+static __thread int worker_index = -1;
+
 static void *thread(void *arg);
 
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+static unsigned int histogram_bucket(unsigned long long ns)
+{
+    if (ns < 4)
+        return (unsigned int)ns;
+
+    // exponent of the top bit, then the next two bits pick the sub-bucket
+    unsigned int e = 63 - __builtin_clzll(ns);
+    unsigned int b = (e - 1) * 4 + (unsigned int)((ns >> (e - 2)) & 3);
+    return b < POOL_HIST_BUCKETS ? b : POOL_HIST_BUCKETS - 1;
+}
+
+static unsigned long long histogram_bucket_limit(unsigned int b)
+{
+    if (b < 4)
+        return b;
+
+    unsigned int e = b / 4 + 1;
+    unsigned long long sub = b % 4;
+    return (1ull << e) + ((sub + 1) << (e - 2)) - 1;
+}
+
+static void histogram_record(struct pool_histogram *hist, unsigned long long ns)
+{
+    STAT_ADD(hist->count, 1);
+    STAT_ADD(hist->sum_ns, ns);
+    if (ns > STAT_LOAD(hist->max_ns))
+        STAT_STORE(hist->max_ns, ns);
+    STAT_ADD(hist->buckets[histogram_bucket(ns)], 1);
+}
+
+static void histogram_sum(struct pool_histogram *into, const struct pool_histogram *from)
+{
+    int i;
+
+    into->count += STAT_LOAD(from->count);
+    into->sum_ns += STAT_LOAD(from->sum_ns);
+    unsigned long long max = STAT_LOAD(from->max_ns);
+    if (max > into->max_ns)
+        into->max_ns = max;
+    for (i = 0; i < POOL_HIST_BUCKETS; i++)
+    {
+        into->buckets[i] += STAT_LOAD(from->buckets[i]);
+    }
+}
+
+static void worker_stats_sum(struct pool_worker_stats *into, const struct pool_worker_stats *from)
+{
+    into->tasks += STAT_LOAD(from->tasks);
+    into->idle_ns += STAT_LOAD(from->idle_ns);
+    histogram_sum(&into->idle_work, &from->idle_work);
+    histogram_sum(&into->wait, &from->wait);
+    histogram_sum(&into->service, &from->service);
+}
+
 void *pool_start(void *(*thread_func)(void *), unsigned int threads)
 {
-    struct pool *p = (struct pool *)malloc(sizeof(struct pool) + (threads - 1) * sizeof(pthread_t));
+    struct pool *p = (struct pool *)calloc(1, sizeof(struct pool) + (threads - 1) * sizeof(struct pool_worker));
     int i;
 
     pthread_mutex_init(&p->q_mtx, NULL);
@@ -36,33 +127,85 @@ void *pool_start(void *(*thread_func)(void *), unsigned int threads)
     p->fn = thread_func;
     p->cancelled = 0;
     p->remaining = 0;
+    p->queued = 0;
+    p->max_queued = 0;
+    p->enqueued = 0;
     p->end = NULL;
     p->q = NULL;
 
     for (i = 0; i < threads; i++)
     {
-        pthread_create(&p->threads[i], NULL, &thread, p);
+        p->workers[i].pool = p;
+        p->workers[i].index = i;
+        pthread_create(&p->workers[i].thread, NULL, &thread, &p->workers[i]);
     }
 
     return p;
 }
 
-void pool_enqueue(void *pool, void *arg, char free)
+static void enqueue(struct pool *p, struct pool_worker *w, void *(*fn)(void *), void *arg, char free)
 {
-    struct pool *p = (struct pool *)pool;
     struct pool_queue *q = (struct pool_queue *)malloc(sizeof(struct pool_queue));
+    struct pool_queue **head = w != NULL ? &w->q : &p->q;
+    struct pool_queue **end = w != NULL ? &w->end : &p->end;
+    q->fn = fn;
     q->arg = arg;
     q->next = NULL;
     q->free = free;
+    q->enqueued_ns = now_ns();
 
     pthread_mutex_lock(&p->q_mtx);
-    if (p->end != NULL)
-        p->end->next = q;
-    if (p->q == NULL)
-        p->q = q;
-    p->end = q;
+    if (*end != NULL)
+        (*end)->next = q;
+    if (*head == NULL)
+        *head = q;
+    *end = q;
     p->remaining++;
-    pthread_cond_signal(&p->q_cnd);
+    STAT_STORE(p->queued, p->queued + 1);
+    if (p->queued > p->max_queued)
+        STAT_STORE(p->max_queued, p->queued);
+    STAT_STORE(p->enqueued, p->enqueued + 1);
+    // every worker waits on the same condition, so wake them all to be sure
+    // the one the task is for sees it
+    if (w != NULL)
+        pthread_cond_broadcast(&p->q_cnd);
+    else
+        pthread_cond_signal(&p->q_cnd);
+    pthread_mutex_unlock(&p->q_mtx);
+}
+
+void pool_enqueue(void *pool, void *arg, char free)
+{
+    enqueue((struct pool *)pool, NULL, NULL, arg, free);
+}
+
+void pool_enqueue_to(void *pool, unsigned int worker, void *(*fn)(void *), void *arg, char free)
+{
+    struct pool *p = (struct pool *)pool;
+    enqueue(p, &p->workers[worker], fn, arg, free);
+}
+
+static void free_queue(struct pool_queue *q)
+{
+    struct pool_queue *next;
+
+    while (q != NULL)
+    {
+        next = q->next;
+        if (q->free)
+            free(q->arg);
+        free(q);
+        q = next;
+    }
+}
+
+void pool_set_idle(void *pool, int (*idle_func)(unsigned int worker, void *arg), void *arg)
+{
+    struct pool *p = (struct pool *)pool;
+
+    pthread_mutex_lock(&p->q_mtx);
+    p->idle_fn = idle_func;
+    p->idle_arg = arg;
     pthread_mutex_unlock(&p->q_mtx);
 }
 
@@ -81,7 +224,6 @@ void pool_wait(void *pool)
 void pool_end(void *pool)
 {
     struct pool *p = (struct pool *)pool;
-    struct pool_queue *q;
     int i;
 
     p->cancelled = 1;
@@ -92,45 +234,139 @@ void pool_end(void *pool)
 
     for (i = 0; i < p->nthreads; i++)
     {
-        pthread_join(p->threads[i], NULL);
+        pthread_join(p->workers[i].thread, NULL);
     }
 
-    while (p->q != NULL)
+    free_queue(p->q);
+    for (i = 0; i < p->nthreads; i++)
     {
-        q = p->q;
-        p->q = q->next;
-
-        if (q->free)
-            free(q->arg);
-        free(q);
+        free_queue(p->workers[i].q);
     }
 
     free(p);
 }
 
+int pool_worker_id(void)
+{
+    return worker_index;
+}
+
+void pool_worker_stats(void *pool, unsigned int worker, struct pool_worker_stats *stats)
+{
+    struct pool *p = (struct pool *)pool;
+
+    memset(stats, 0, sizeof(*stats));
+    if (worker < p->nthreads)
+        worker_stats_sum(stats, &p->workers[worker].stats);
+}
+
+void pool_stats(void *pool, struct pool_stats *stats)
+{
+    struct pool *p = (struct pool *)pool;
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->nthreads = p->nthreads;
+    stats->queued = STAT_LOAD(p->queued);
+    stats->max_queued = STAT_LOAD(p->max_queued);
+    stats->enqueued = STAT_LOAD(p->enqueued);
+    for (i = 0; i < p->nthreads; i++)
+    {
+        worker_stats_sum(&stats->total, &p->workers[i].stats);
+    }
+}
+
+unsigned long long pool_histogram_quantile(const struct pool_histogram *hist, double q)
+{
+    unsigned long long seen = 0;
+    unsigned long long rank;
+    int i;
+
+    if (hist->count == 0)
+        return 0;
+
+    rank = (unsigned long long)(q * (double)hist->count);
+    if (rank >= hist->count)
+        rank = hist->count - 1;
+
+    for (i = 0; i < POOL_HIST_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+        if (seen > rank)
+        {
+            unsigned long long limit = histogram_bucket_limit(i);
+            return limit < hist->max_ns ? limit : hist->max_ns;
+        }
+    }
+    return hist->max_ns;
+}
+
 static void *thread(void *arg)
 {
     struct pool_queue *q;
-    struct pool *p = (struct pool *)arg;
+    struct pool_worker *w = (struct pool_worker *)arg;
+    struct pool *p = w->pool;
+    unsigned long long idle_start, idle_work, start, end;
+    int (*idle_fn)(unsigned int, void *);
+    void *idle_arg;
+
+    worker_index = (int)w->index;
 
     while (!p->cancelled)
     {
         pthread_mutex_lock(&p->q_mtx);
-        while (!p->cancelled && p->q == NULL)
+        idle_start = now_ns();
+        idle_work = 0;
+        idle_fn = p->idle_fn;
+        idle_arg = p->idle_arg;
+        while (!p->cancelled && p->q == NULL && w->q == NULL)
         {
-            pthread_cond_wait(&p->q_cnd, &p->q_mtx);
+            if (idle_fn == NULL)
+            {
+                pthread_cond_wait(&p->q_cnd, &p->q_mtx);
+                continue;
+            }
+
+            // a slice of idle work, with the queue open to others meanwhile
+            pthread_mutex_unlock(&p->q_mtx);
+            start = now_ns();
+            if (!idle_fn(w->index, idle_arg))
+                idle_fn = NULL;
+            end = now_ns();
+            histogram_record(&w->stats.idle_work, end - start);
+            idle_work += end - start;
+            pthread_mutex_lock(&p->q_mtx);
         }
         if (p->cancelled)
         {
             pthread_mutex_unlock(&p->q_mtx);
             return NULL;
         }
-        q = p->q;
-        p->q = q->next;
-        p->end = (q == p->end ? NULL : p->end);
+        // tasks for this worker first, nobody else can run them
+        if (w->q != NULL)
+        {
+            q = w->q;
+            w->q = q->next;
+            w->end = (q == w->end ? NULL : w->end);
+        }
+        else
+        {
+            q = p->q;
+            p->q = q->next;
+            p->end = (q == p->end ? NULL : p->end);
+        }
+        STAT_STORE(p->queued, p->queued - 1);
         pthread_mutex_unlock(&p->q_mtx);
 
-        p->fn(q->arg);
+        start = now_ns();
+        STAT_ADD(w->stats.idle_ns, start - idle_start - idle_work);
+        histogram_record(&w->stats.wait, start - q->enqueued_ns);
+
+        (q->fn != NULL ? q->fn : p->fn)(q->arg);
+
+        end = now_ns();
+        histogram_record(&w->stats.service, end - start);
+        STAT_ADD(w->stats.tasks, 1);
 
         if (q->free)
             free(q->arg);
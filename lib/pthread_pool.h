@@ -3,6 +3,66 @@
  */
 
 #ifndef __PTHREAD_POOL_H__
+#define __PTHREAD_POOL_H__
+
+/**
+ * Number of buckets in a pool_histogram.
+ *
+ * Values below 4ns get a bucket each, every power of two above that is split
+ * into 4 linear sub-buckets, so any recorded value is within 25% of the upper
+ * bound of its bucket. Each exponent e >= 2 takes buckets 4(e - 1) to
+ * 4(e - 1) + 3, so 160 buckets reach e = 40 and cover values below 2^41ns,
+ * about 36.6 minutes. Longer values are counted in the last bucket.
+ */
+#define POOL_HIST_BUCKETS 160
+
+/**
+ * A log-linear (HDR style) histogram of durations in nanoseconds.
+ */
+struct pool_histogram
+{
+    unsigned long long count;
+    unsigned long long sum_ns;
+    unsigned long long max_ns;
+    unsigned long long buckets[POOL_HIST_BUCKETS];
+};
+
+/**
+ * Counters kept by a single worker thread.
+ *
+ * Each worker is the only writer of its own counters, so they are updated
+ * without locks and read with relaxed atomic loads by pool_worker_stats.
+ */
+struct pool_worker_stats
+{
+    /** Tasks executed to completion. */
+    unsigned long long tasks;
+    /** Time spent blocked waiting for work. */
+    unsigned long long idle_ns;
+    /** Time spent in each call of the idle function, see pool_set_idle. */
+    struct pool_histogram idle_work;
+    /** Time from pool_enqueue until a worker picked the task up. */
+    struct pool_histogram wait;
+    /** Time spent inside the thread function for a task. */
+    struct pool_histogram service;
+};
+
+/**
+ * A snapshot of a whole pool, see pool_stats.
+ */
+struct pool_stats
+{
+    unsigned int nthreads;
+    /** Tasks currently waiting in the queue. */
+    unsigned int queued;
+    /** The largest queue depth seen since the pool started. */
+    unsigned int max_queued;
+    /** Tasks enqueued since the pool started. */
+    unsigned long long enqueued;
+    /** The sum of every worker's counters. */
+    struct pool_worker_stats total;
+};
+
 /**
  * Create a new thread pool.
  *
@@ -25,6 +85,36 @@ void *pool_start(void *(*thread_func)(void *), unsigned int threads);
  */
 void pool_enqueue(void *pool, void *arg, char free);
 
+/**
+ * Enqueue a task that only worker [worker] may run.
+ *
+ * Tasks for a worker are run before the ones queued with pool_enqueue, in the
+ * order they were enqueued, which lets callers keep state that is only ever
+ * touched by one thread.
+ *
+ * @param pool A thread pool returned by start_pool.
+ * @param worker The index of the worker, in [0, threads).
+ * @param fn The function to run instead of the pool's thread function.
+ * @param arg The argument to pass to fn.
+ * @param free If true, the argument will be freed after the task has completed.
+ */
+void pool_enqueue_to(void *pool, unsigned int worker, void *(*fn)(void *), void *arg, char free);
+
+/**
+ * Set a function for the workers to call when they run out of tasks.
+ *
+ * A worker with nothing to run calls idle_func with its index and arg before
+ * it blocks, and calls it again for as long as it returns nonzero and no task
+ * has been queued. Tasks queued meanwhile wait for the call to return, so each
+ * call should only do a short slice of work. The worker calls it again only
+ * after it has run another task.
+ *
+ * @param pool A thread pool returned by start_pool.
+ * @param idle_func The function to call, or NULL to stop calling one.
+ * @param arg The second argument to pass to idle_func.
+ */
+void pool_set_idle(void *pool, int (*idle_func)(unsigned int worker, void *arg), void *arg);
+
 /**
  * Wait for all queued tasks to be completed.
  */
@@ -39,4 +129,32 @@ void pool_wait(void *pool);
  * pool_enqueue.
  */
 void pool_end(void *pool);
+
+/**
+ * Returns the index of the calling pool worker thread, in [0, threads), or -1
+ * if the caller is not a pool worker.
+ */
+int pool_worker_id(void);
+
+/**
+ * Take a snapshot of the counters of worker [worker].
+ *
+ * This does not lock and may be called from any thread. Counters are read one
+ * at a time, so a snapshot taken while the worker is busy may be off by the
+ * task in flight.
+ */
+void pool_worker_stats(void *pool, unsigned int worker, struct pool_worker_stats *stats);
+
+/**
+ * Take a snapshot of the whole pool, summing the counters of every worker.
+ *
+ * Like pool_worker_stats this never blocks the workers.
+ */
+void pool_stats(void *pool, struct pool_stats *stats);
+
+/**
+ * Returns the upper bound, in nanoseconds, of the bucket holding the [q]th
+ * quantile (0.0 - 1.0) of [hist], or 0 if it is empty.
+ */
+unsigned long long pool_histogram_quantile(const struct pool_histogram *hist, double q);
 #endif
@@ -40,6 +40,14 @@ typedef struct WrenVM WrenVM;
 // garbage collector will not reclaim the object it references.
 typedef struct WrenHandle WrenHandle;
 
+// A module compiled once and then run in any number of VMs. See
+// [wrenCompileImage].
+typedef struct WrenCodeImage WrenCodeImage;
+
+// Receives the next [length] bytes of a serialized stream.
+typedef void (*WrenWriteBytesFn)(void* userData, const void* bytes,
+                                 size_t length);
+
 // A generic allocation function that handles all explicit memory management
 // used by Wren. It's used like so:
 //
@@ -83,11 +91,14 @@ typedef void (*WrenLoadModuleCompleteFn)(WrenVM* vm, const char* name, struct Wr
 // The result of a loadModuleFn call. 
 // [source] is the source code for the module, or NULL if the module is not found.
 // [onComplete] an optional callback that will be called once Wren is done with the result.
+// [image] optionally provides the module already compiled from [source]. It
+// is used instead of compiling when it fits the VM, and must outlive the VM.
 typedef struct WrenLoadModuleResult
 {
   const char* source;
   WrenLoadModuleCompleteFn onComplete;
   void* userData;
+  WrenCodeImage* image;
 } WrenLoadModuleResult;
 
 // Loads and returns the source code for the module [name].
@@ -266,6 +277,53 @@ typedef struct
   // If zero, defaults to 50.
   int heapGrowthPercent;
 
+  // The most bytes the VM's heap may hold. Garbage is always collected before
+  // the heap grows past this size.
+  //
+  // When a collection leaves the heap more than seven eighths full, the fiber
+  // that is running gets an "Out of memory." runtime error the next time it
+  // calls a method. The allocation that triggered the collection still
+  // succeeds, so a single large allocation can briefly take the heap over.
+  //
+  // If zero, the heap can grow without bound.
+  size_t maxHeapSize;
+
+  // The number of bytes of new objects that triggers a minor collection.
+  //
+  // New objects start out young. A minor collection only traces the young
+  // objects, taking every older one to be alive, and makes the survivors old.
+  // Old objects are only collected by the full collections triggered by the
+  // heap size, which are much rarer, so a minor collection's pause depends on
+  // how much young data is live rather than on the size of the heap.
+  //
+  // If zero, objects are only young inside regions (see [wrenBeginRegion]).
+  // Defaults to 1MB.
+  size_t nurserySize;
+
+  // The number of threads that mark the heap during a full collection, the
+  // one that triggered it included. Worth raising for heaps of hundreds of
+  // megabytes, if there are cores to spare.
+  //
+  // Ignored if Wren is built without WREN_PARALLEL_MARK. Defaults to 1.
+  int markThreads;
+
+  // The number of calls and loop iterations after which a function is compiled
+  // to machine code. The machine code takes the stack of the fiber as it finds
+  // it and hands back to the interpreter whenever it has to, so it can start
+  // and stop anywhere. Higher numbers spend less time compiling functions that
+  // are rarely run.
+  //
+  // Ignored if Wren is built without WREN_JIT. If zero, nothing is compiled.
+  // Defaults to zero.
+  int jitThreshold;
+
+  // An image of the core module from [wrenCompileCoreImage].
+  //
+  // If not `NULL`, new VMs load the core module from it instead of compiling
+  // it from source, which is most of the cost of [wrenNewVM]. It must outlive
+  // every VM created with it.
+  WrenCodeImage* coreImage;
+
   // User-defined data associated with the VM.
   void* userData;
 
@@ -296,6 +354,60 @@ typedef enum
   WREN_TYPE_UNKNOWN
 } WrenType;
 
+// The number and total size of the objects of one type.
+typedef struct
+{
+  size_t count;
+  size_t bytes;
+} WrenObjectStats;
+
+// A snapshot of a VM's heap and of the work its garbage collector has done.
+// See [wrenGetHeapStats].
+typedef struct
+{
+  // The collections run so far. Minor collections only trace young objects,
+  // see [WrenConfiguration.nurserySize].
+  size_t fullCollections;
+  size_t minorCollections;
+
+  // The time the VM was paused for collections, in seconds, in total and for
+  // the longest one. Old objects are swept lazily by the allocations that
+  // follow a full collection, which isn't counted.
+  double pauseTime;
+  double maxPauseTime;
+
+  // The bytes allocated since the VM was created, and the bytes collections
+  // found unused since.
+  size_t bytesAllocated;
+  size_t bytesFreed;
+
+  // The bytes the heap holds now, the bytes the last full collection found
+  // live, and the size at which the next full collection is triggered.
+  size_t heapSize;
+  size_t liveBytes;
+  size_t nextGC;
+
+  // The objects on the heap, by their low level type. Some of them may be
+  // garbage a collection hasn't freed yet.
+  WrenObjectStats classes;
+  WrenObjectStats closures;
+  WrenObjectStats fibers;
+  WrenObjectStats fns;
+  WrenObjectStats foreigns;
+  WrenObjectStats instances;
+  WrenObjectStats lists;
+  WrenObjectStats maps;
+  WrenObjectStats modules;
+  WrenObjectStats ranges;
+  WrenObjectStats strings;
+  WrenObjectStats upvalues;
+} WrenHeapStats;
+
+// Called by [wrenGetClassStats] for every class with instances, with the name
+// of the class and the number and total size of its instances.
+typedef void (*WrenClassStatsFn)(const char* className, size_t instances,
+                                 size_t bytes, void* userData);
+
 // An opaque internal type that can iterate a list or map
 //
 // create/release with wrenNewIterator() and wrenFreeIterator()
@@ -330,11 +442,101 @@ WREN_API void wrenFreeVM(WrenVM* vm);
 // Immediately run the garbage collector to free unused memory.
 WREN_API void wrenCollectGarbage(WrenVM* vm);
 
+// Does some of the garbage collection that allocations would otherwise do
+// later, for the host to call while [vm] is idle. Must not be called while
+// Wren code is running.
+//
+// [budget] bounds the work, as the number of bytes of heap it may visit. In
+// order of preference, it sweeps what is left of the last full collection,
+// runs a minor collection or, once the heap is more than half way to the size
+// that triggers a full collection, runs that early. The next full collection
+// is then as far off as after one triggered by an allocation. A full
+// collection can't stop part way, so it runs whatever [budget] is.
+//
+// Returns the number of bytes visited, so that the host can learn how fast
+// [vm] gets through its heap, or zero if nothing worth doing fit in [budget].
+// After a full collection this can be well over [budget], and the host should
+// count the time it took against later budgets.
+WREN_API size_t wrenCollectGarbageIdle(WrenVM* vm, size_t budget);
+
+// Fills [stats] with a snapshot of [vm]'s heap. This walks every object, so
+// it is meant for monitoring rather than for each call into the VM. Must not
+// be called while Wren code is running.
+WREN_API void wrenGetHeapStats(WrenVM* vm, WrenHeapStats* stats);
+
+// Calls [fn] with [userData] for each class of [vm] that has instances,
+// including foreign ones. Like [wrenGetHeapStats], this walks every object.
+WREN_API void wrenGetClassStats(WrenVM* vm, WrenClassStatsFn fn,
+                                void* userData);
+
+// Writes a snapshot of [vm]'s heap to [write] in a compact binary format: for
+// every object its type, class, size and the objects it refers to, along with
+// the roots of the collector and the objects held by module variables. The
+// format is described in wren_debug.c.
+//
+// Takes about as long as a full collection and must not be called while Wren
+// code is running. Returns false if it ran out of memory and the snapshot is
+// incomplete.
+WREN_API bool wrenDumpHeap(WrenVM* vm, WrenWriteBytesFn write, void* userData);
+
+// Begins a region. Objects allocated until the matching [wrenEndRegion] are
+// young, and are freed by it if nothing outside the region refers to them.
+// Young objects stored into older ones, into module variables or kept by
+// handles survive and become ordinary, old objects.
+//
+// Regions can overlap, for example for several fibers that each handle a
+// request and suspend. Without a [WrenConfiguration.nurserySize], objects are
+// only allocated young while at least one is open.
+WREN_API void wrenBeginRegion(WrenVM* vm);
+
+// Ends a region begun by [wrenBeginRegion] and runs a minor collection, which
+// only traces young objects. Must not be called while Wren code is running.
+WREN_API void wrenEndRegion(WrenVM* vm);
+
 // Runs [source], a string of Wren source code in a new fiber in [vm] in the
 // context of resolved [module].
 WREN_API WrenInterpretResult wrenInterpret(WrenVM* vm, const char* module,
                                   const char* source);
 
+// Compiles [source] as [module] without running it or registering the module
+// in [vm], and returns it as a code image, or `NULL` on a compile error.
+// [module] must not be `NULL`, see [wrenCompileCoreImage] for the core module.
+//
+// The bytecode and debug info of an image are shared read-only by every VM
+// that runs it, from any thread, so the image must outlive all of them. It is
+// only valid for VMs whose method symbols agree with [vm]'s, which is true for
+// freshly created VMs; others silently fall back to compiling the source.
+WREN_API WrenCodeImage* wrenCompileImage(WrenVM* vm, const char* module,
+                                         const char* source);
+
+// Runs the module body of [image] in a new fiber in [vm], like [wrenInterpret]
+// does for source.
+WREN_API WrenInterpretResult wrenInterpretImage(WrenVM* vm,
+                                                WrenCodeImage* image);
+
+// Compiles the core module into an image to use as the [coreImage] of new
+// VMs. Only the allocator and error callbacks of [configuration] are used, and
+// it can be `NULL`.
+WREN_API WrenCodeImage* wrenCompileCoreImage(WrenConfiguration* configuration);
+
+// Frees [image]. Every VM that ran it must have been freed first.
+WREN_API void wrenFreeCodeImage(WrenCodeImage* image);
+
+// Writes [image] to [write] in a portable binary format that can be cached on
+// disk and read back with [wrenDeserializeImage].
+WREN_API void wrenSerializeImage(WrenCodeImage* image, WrenWriteBytesFn write,
+                                 void* userData);
+
+// Reads an image of [module], or of the core module if [module] is `NULL`,
+// previously written by [wrenSerializeImage].
+//
+// Returns `NULL` if [bytes] is malformed, was written by a different version
+// of Wren or bytecode format, or was not compiled from exactly [source] as
+// [module], so a stale cache is detected without compiling anything.
+WREN_API WrenCodeImage* wrenDeserializeImage(const char* module,
+                                             const char* source,
+                                             const void* bytes, size_t size);
+
 // Creates a handle that can be used to invoke a method with [signature] on
 // using a receiver and arguments that are set up on the stack.
 //
@@ -583,6 +785,11 @@ WREN_API bool wrenHasVariable(WrenVM* vm, const char* module, const char* name);
 // Returns true if [module] has been imported/resolved before, false if not.
 WREN_API bool wrenHasModule(WrenVM* vm, const char* module);
 
+// Returns true if the object in [slot] responds to the method [signature],
+// which is written like the ones passed to [wrenMakeCallHandle]. For a class,
+// that checks its static methods.
+WREN_API bool wrenHasMethod(WrenVM* vm, int slot, const char* signature);
+
 // Sets the current fiber to be aborted, and uses the value in [slot] as the
 // runtime error object.
 WREN_API void wrenAbortFiber(WrenVM* vm, int slot);
@@ -55,6 +55,29 @@
   #define WREN_OPT_RANDOM 1
 #endif
 
+// If true, full collections can mark the heap with several threads, see
+// [WrenConfiguration.markThreads]. Needs POSIX threads.
+#ifndef WREN_PARALLEL_MARK
+  #if defined(_WIN32)
+    #define WREN_PARALLEL_MARK 0
+  #else
+    #define WREN_PARALLEL_MARK 1
+  #endif
+#endif
+
+// If true, functions that get hot are compiled to machine code, see
+// wren_jit.h and [WrenConfiguration.jitThreshold]. Needs an x86-64 CPU with
+// the System V calling convention, NaN tagging, and mmap().
+//
+// Defaults to on where those are available.
+#ifndef WREN_JIT
+  #if defined(__x86_64__) && !defined(_WIN32) && WREN_NAN_TAGGING
+    #define WREN_JIT 1
+  #else
+    #define WREN_JIT 0
+  #endif
+#endif
+
 // These flags are useful for debugging and hacking on Wren itself. They are not
 // intended to be used for production code. They default to off.
 
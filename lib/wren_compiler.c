@@ -1,10 +1,12 @@
 #include <errno.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "wren_common.h"
 #include "wren_compiler.h"
+#include "wren_image.h"
 #include "wren_vm.h"
 
 #if WREN_DEBUG_DUMP_COMPILED_CODE
@@ -405,6 +407,7 @@ typedef struct
 static void disallowAttributes(Compiler* compiler);
 static void addToAttributeGroup(Compiler* compiler, Value group, Value key, Value value);
 static void emitClassAttributes(Compiler* compiler, ClassInfo* classInfo);
+static void optimizeCode(Compiler* compiler);
 static void copyAttributes(Compiler* compiler, ObjMap* into);
 static void copyMethodAttributes(Compiler* compiler, bool isForeign, 
             bool isStatic, const char* fullSignature, int32_t length);
@@ -510,6 +513,7 @@ static int addConstant(Compiler* compiler, Value constant)
     if (IS_OBJ(constant)) wrenPushRoot(compiler->parser->vm, AS_OBJ(constant));
     wrenValueBufferWrite(compiler->parser->vm, &compiler->fn->constants,
                          constant);
+    wrenWriteBarrier(compiler->parser->vm, &compiler->fn->obj, constant);
     if (IS_OBJ(constant)) wrenPopRoot(compiler->parser->vm);
     
     if (compiler->constants == NULL)
@@ -1672,6 +1676,8 @@ static ObjFn* endCompiler(Compiler* compiler,
   // we can't rely on CODE_RETURN to tell us we're at the end.
   emitOp(compiler, CODE_END);
 
+  optimizeCode(compiler);
+
   wrenFunctionBindName(compiler->parser->vm, compiler->fn,
                        debugName, debugNameLength);
   
@@ -2580,9 +2586,31 @@ static void conditional(Compiler* compiler, bool canAssign)
   patchJump(compiler, elseJump);
 }
 
+// Returns the instruction for the infix operator [type] that computes it
+// directly on numbers, or CODE_CALL_1 if it doesn't have one.
+static Code numericInstruction(TokenType type)
+{
+  switch (type)
+  {
+    case TOKEN_PLUS:    return CODE_ADD;
+    case TOKEN_MINUS:   return CODE_SUB;
+    case TOKEN_STAR:    return CODE_MUL;
+    case TOKEN_SLASH:   return CODE_DIV;
+    case TOKEN_PERCENT: return CODE_MOD;
+    case TOKEN_LT:      return CODE_LT;
+    case TOKEN_GT:      return CODE_GT;
+    case TOKEN_LTEQ:    return CODE_LTE;
+    case TOKEN_GTEQ:    return CODE_GTE;
+    case TOKEN_EQEQ:    return CODE_EQ;
+    case TOKEN_BANGEQ:  return CODE_NEQ;
+    default:            return CODE_CALL_1;
+  }
+}
+
 void infixOp(Compiler* compiler, bool canAssign)
 {
-  GrammarRule* rule = getRule(compiler->parser->previous.type);
+  TokenType operatorType = compiler->parser->previous.type;
+  GrammarRule* rule = getRule(operatorType);
 
   // An infix operator cannot end an expression.
   ignoreNewlines(compiler);
@@ -2590,9 +2618,11 @@ void infixOp(Compiler* compiler, bool canAssign)
   // Compile the right-hand side.
   parsePrecedence(compiler, (Precedence)(rule->precedence + 1));
 
-  // Call the operator method on the left-hand side.
+  // Call the operator method on the left-hand side, unless both sides are
+  // numbers and the operator has its own instruction.
   Signature signature = { rule->name, (int)strlen(rule->name), SIG_METHOD, 1 };
-  callSignature(compiler, CODE_CALL_0, &signature);
+  emitShortArg(compiler, numericInstruction(operatorType),
+               signatureSymbol(compiler, &signature));
 }
 
 // Compiles a method signature for an infix operator.
@@ -2820,6 +2850,19 @@ static GrammarRule* getRule(TokenType type)
   return &rules[type];
 }
 
+// Compiles the infix operators after an operand for as long as they bind at
+// least as tightly as [precedence].
+static void infixOperators(Compiler* compiler, Precedence precedence,
+                           bool canAssign)
+{
+  while (precedence <= rules[compiler->parser->current.type].precedence)
+  {
+    nextToken(compiler->parser);
+    GrammarFn infix = rules[compiler->parser->previous.type].infix;
+    infix(compiler, canAssign);
+  }
+}
+
 // The main entrypoint for the top-down operator precedence parser.
 void parsePrecedence(Compiler* compiler, Precedence precedence)
 {
@@ -2842,12 +2885,7 @@ void parsePrecedence(Compiler* compiler, Precedence precedence)
   bool canAssign = precedence <= PREC_CONDITIONAL;
   prefix(compiler, canAssign);
 
-  while (precedence <= rules[compiler->parser->current.type].precedence)
-  {
-    nextToken(compiler->parser);
-    GrammarFn infix = rules[compiler->parser->previous.type].infix;
-    infix(compiler, canAssign);
-  }
+  infixOperators(compiler, precedence, canAssign);
 }
 
 // Parses an expression. Unlike statements, expressions leave a resulting value
@@ -2897,6 +2935,8 @@ static int getByteCountForArguments(const uint8_t* bytecode,
     case CODE_LOAD_FIELD:
     case CODE_STORE_FIELD:
     case CODE_CLASS:
+    case CODE_STORE_LOCAL_POP:
+    case CODE_STORE_FIELD_THIS_POP:
       return 1;
 
     case CODE_CONSTANT:
@@ -2928,8 +2968,30 @@ static int getByteCountForArguments(const uint8_t* bytecode,
     case CODE_METHOD_STATIC:
     case CODE_IMPORT_MODULE:
     case CODE_IMPORT_VARIABLE:
+    case CODE_ADD:
+    case CODE_SUB:
+    case CODE_MUL:
+    case CODE_DIV:
+    case CODE_MOD:
+    case CODE_LT:
+    case CODE_GT:
+    case CODE_LTE:
+    case CODE_GTE:
+    case CODE_EQ:
+    case CODE_NEQ:
+    case CODE_LOAD_LOCALS:
+    case CODE_LT_JUMP_IF:
+    case CODE_GT_JUMP_IF:
+    case CODE_LTE_JUMP_IF:
+    case CODE_GTE_JUMP_IF:
+    case CODE_EQ_JUMP_IF:
+    case CODE_NEQ_JUMP_IF:
       return 2;
 
+    case CODE_LOAD_LOCAL_CALL_0:
+    case CODE_LOAD_LOCAL_CALL_1:
+      return 3;
+
     case CODE_SUPER_0:
     case CODE_SUPER_1:
     case CODE_SUPER_2:
@@ -2947,6 +3009,9 @@ static int getByteCountForArguments(const uint8_t* bytecode,
     case CODE_SUPER_14:
     case CODE_SUPER_15:
     case CODE_SUPER_16:
+    case CODE_FOR_RANGE:
+    case CODE_FOR_ITERATE:
+    case CODE_FOR_ITERATOR_VALUE:
       return 4;
 
     case CODE_CLOSURE:
@@ -3022,6 +3087,52 @@ static void endLoop(Compiler* compiler)
   compiler->loop = compiler->loop->enclosing;
 }
 
+// Emits [instruction] for calling the iteration method [name] on the sequence
+// in local [seqSlot] with the iterator in local [iterSlot].
+static void emitIterate(Compiler* compiler, Code instruction, int seqSlot,
+                        int iterSlot, const char* name, int length)
+{
+  // The instruction pushes both locals to call the method on them, which then
+  // leaves one value in their place.
+  compiler->numSlots++;
+  emitByteArg(compiler, instruction, seqSlot);
+  compiler->numSlots--;
+
+  emitByte(compiler, iterSlot);
+  emitShort(compiler, methodSymbol(compiler, name, length));
+}
+
+// Compiles the sequence expression of a for loop, which starts with a number
+// followed by a range operator. If the range is the whole expression, leaves
+// its bounds on the stack instead of creating it, sets [isInclusive], and
+// returns true. Otherwise, compiles the rest of the expression as usual and
+// returns false.
+static bool rangeLiteral(Compiler* compiler, bool* isInclusive)
+{
+  nextToken(compiler->parser);
+  literal(compiler, false);
+
+  nextToken(compiler->parser);
+  *isInclusive = compiler->parser->previous.type == TOKEN_DOTDOT;
+  ignoreNewlines(compiler);
+  parsePrecedence(compiler, (Precedence)(PREC_RANGE + 1));
+
+  if (peek(compiler) == TOKEN_RIGHT_PAREN) return true;
+
+  // The range is only an operand, as in `0..count == other`.
+  if (*isInclusive)
+  {
+    callMethod(compiler, 1, "..(_)", 5);
+  }
+  else
+  {
+    callMethod(compiler, 1, "...(_)", 6);
+  }
+
+  infixOperators(compiler, PREC_LOWEST, true);
+  return false;
+}
+
 static void forStatement(Compiler* compiler)
 {
   // A for statement like:
@@ -3051,6 +3162,11 @@ static void forStatement(Compiler* compiler)
   //   it should exit the loop.
   // - The .iteratorValue() method is used to get the value at the current
   //   iterator position.
+  //
+  // Ranges are iterated without calling those methods. When the sequence is
+  // a range literal starting with a number, like `0...count`, it can only be a
+  // Range, so its bounds are kept in hidden locals and the Range is never
+  // created. Otherwise, CODE_FOR_ITERATE checks for a Range each time around.
 
   // Create a scope for the hidden local variables used for the iterator.
   pushScope(compiler);
@@ -3068,41 +3184,74 @@ static void forStatement(Compiler* compiler)
   // Evaluate the sequence expression and store it in a hidden local variable.
   // The space in the variable name ensures it won't collide with a user-defined
   // variable.
-  expression(compiler);
+  bool isRange = false;
+  bool isInclusive = false;
+  if (peek(compiler) == TOKEN_NUMBER &&
+      (peekNext(compiler) == TOKEN_DOTDOT ||
+       peekNext(compiler) == TOKEN_DOTDOTDOT))
+  {
+    isRange = rangeLiteral(compiler, &isInclusive);
+  }
+  else
+  {
+    expression(compiler);
+  }
 
   // Verify that there is space to hidden local variables.
-  // Note that we expect only two addLocal calls next to each other in the
-  // following code.
-  if (compiler->numLocals + 2 > MAX_LOCALS)
+  // Note that we expect only two (or three for a range literal) addLocal calls
+  // next to each other in the following code.
+  if (compiler->numLocals + (isRange ? 3 : 2) > MAX_LOCALS)
   {
     error(compiler, "Cannot declare more than %d variables in one scope. (Not enough space for for-loops internal variables)",
           MAX_LOCALS);
     return;
   }
-  int seqSlot = addLocal(compiler, "seq ", 4);
 
-  // Create another hidden local for the iterator object.
-  null(compiler, false);
-  int iterSlot = addLocal(compiler, "iter ", 5);
+  Loop loop;
 
-  consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after loop expression.");
+  if (isRange)
+  {
+    int fromSlot = addLocal(compiler, "from ", 5);
+    addLocal(compiler, "to ", 3);
 
-  Loop loop;
-  startLoop(compiler, &loop);
+    // Create another hidden local for the current number.
+    null(compiler, false);
+    addLocal(compiler, "iter ", 5);
 
-  // Advance the iterator by calling the ".iterate" method on the sequence.
-  loadLocal(compiler, seqSlot);
-  loadLocal(compiler, iterSlot);
+    consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after loop expression.");
 
-  // Update and test the iterator.
-  callMethod(compiler, 1, "iterate(_)", 10);
-  emitByteArg(compiler, CODE_STORE_LOCAL, iterSlot);
-  testExitLoop(compiler);
+    startLoop(compiler, &loop);
+
+    // Count to the next number and push it, or exit the loop.
+    emitByteArg(compiler, CODE_FOR_RANGE, fromSlot);
+    emitByte(compiler, isInclusive ? 1 : 0);
+    emitByte(compiler, 0xff);
+    compiler->loop->exitJump = emitByte(compiler, 0xff) - 1;
+  }
+  else
+  {
+    int seqSlot = addLocal(compiler, "seq ", 4);
+
+    // Create another hidden local for the iterator object.
+    null(compiler, false);
+    int iterSlot = addLocal(compiler, "iter ", 5);
+
+    consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after loop expression.");
+
+    startLoop(compiler, &loop);
+
+    // Advance the iterator by calling the ".iterate" method on the sequence.
+    emitIterate(compiler, CODE_FOR_ITERATE, seqSlot, iterSlot,
+                "iterate(_)", 10);
+
+    // Update and test the iterator.
+    emitByteArg(compiler, CODE_STORE_LOCAL, iterSlot);
+    testExitLoop(compiler);
 
-  // Get the current value in the sequence by calling ".iteratorValue".
-  loadLocal(compiler, seqSlot);
-  loadLocal(compiler, iterSlot);
-  callMethod(compiler, 1, "iteratorValue(_)", 16);
+    // Get the current value in the sequence by calling ".iteratorValue".
+    emitIterate(compiler, CODE_FOR_ITERATOR_VALUE, seqSlot, iterSlot,
+                "iteratorValue(_)", 16);
+  }
 
   // Bind the loop variable in its own scope. This ensures we get a fresh
   // variable each iteration so that closures for it don't all see the same one.
@@ -3759,6 +3908,423 @@ void definition(Compiler* compiler)
   }
 }
 
+// Optimization ----------------------------------------------------------------
+
+// Once a function is compiled, its bytecode is rewritten in a single pass
+// that:
+//
+// - Points jumps that land on an unconditional jump straight at its target.
+// - Folds an operator on two number constants, or negation of one, into a
+//   single constant.
+// - Resolves a JUMP_IF on a literal condition and drops jumps to the very
+//   next instruction.
+// - Fuses the instruction pairs that are most frequent when running real
+//   programs into the superinstructions at the end of wren_opcodes.h.
+//
+// Instructions are copied to a new buffer one at a time, and the rules look at
+// the instructions most recently copied. That way the result of one rule can
+// feed the next, so `1 + 2 * 3` folds all the way down. An instruction that a
+// jump lands on is never merged into the one before it.
+typedef struct
+{
+  Compiler* compiler;
+
+  // The bytecode being optimized.
+  uint8_t* code;
+  int count;
+
+  // Whether some jump lands on each offset in [code].
+  bool* isTarget;
+
+  // Where each instruction in [code] starts in [output].
+  int* offsets;
+
+  // The symbol for unary "-", or -1 if it has not been used.
+  int negate;
+
+  // The optimized bytecode and the source line of each byte of it.
+  ByteBuffer output;
+  IntBuffer lines;
+
+  // For each instruction in [output], where it starts, the offset in [code]
+  // of the first instruction it was made from, and the offset in [code] it
+  // jumps to or -1 if it isn't a jump.
+  IntBuffer starts;
+  IntBuffer origins;
+  IntBuffer targets;
+} Optimizer;
+
+// Returns the offset in [code] that the instruction at [ip], which is [length]
+// bytes long, jumps to, or -1 if it is not a jump. The jump offset is always
+// the last argument, and relative to the end of the instruction.
+static int jumpTarget(const uint8_t* code, int ip, int length)
+{
+  int end = ip + length;
+  switch ((Code)code[ip])
+  {
+    case CODE_JUMP:
+    case CODE_JUMP_IF:
+    case CODE_AND:
+    case CODE_OR:
+    case CODE_FOR_RANGE:
+      return end + ((code[end - 2] << 8) | code[end - 1]);
+
+    case CODE_LOOP:
+      return end - ((code[end - 2] << 8) | code[end - 1]);
+
+    default:
+      return -1;
+  }
+}
+
+// Sets the jump offset of the instruction ending at [end].
+static void setJumpOffset(uint8_t* code, int end, int offset)
+{
+  code[end - 2] = (offset >> 8) & 0xff;
+  code[end - 1] = offset & 0xff;
+}
+
+static int instructionLength(Optimizer* opt, int ip)
+{
+  return 1 + getByteCountForArguments(opt->code,
+                                      opt->compiler->fn->constants.data, ip);
+}
+
+// Forward jumps that land on a JUMP go on to where that one goes. Since JUMP
+// only goes forward, following a chain of them always ends.
+static void threadJumps(Optimizer* opt)
+{
+  for (int ip = 0; ip < opt->count; ip += instructionLength(opt, ip))
+  {
+    Code instruction = (Code)opt->code[ip];
+    if (instruction == CODE_LOOP) continue;
+
+    int end = ip + instructionLength(opt, ip);
+    int target = jumpTarget(opt->code, ip, end - ip);
+    if (target == -1) continue;
+
+    while (opt->code[target] == CODE_JUMP)
+    {
+      target = jumpTarget(opt->code, target, 3);
+    }
+
+    if (target - end < MAX_JUMP) setJumpOffset(opt->code, end, target - end);
+  }
+}
+
+static void beginInstruction(Optimizer* opt, int origin, int target)
+{
+  WrenVM* vm = opt->compiler->parser->vm;
+  wrenIntBufferWrite(vm, &opt->starts, opt->output.count);
+  wrenIntBufferWrite(vm, &opt->origins, origin);
+  wrenIntBufferWrite(vm, &opt->targets, target);
+}
+
+static void writeByte(Optimizer* opt, int byte, int line)
+{
+  WrenVM* vm = opt->compiler->parser->vm;
+  wrenByteBufferWrite(vm, &opt->output, (uint8_t)byte);
+  wrenIntBufferWrite(vm, &opt->lines, line);
+}
+
+// Returns the offset in the output of the [n]th most recently copied
+// instruction, counting from one.
+static int tailStart(Optimizer* opt, int n)
+{
+  return opt->starts.data[opt->starts.count - n];
+}
+
+// Returns the opcode of the [n]th most recently copied instruction, or -1 if
+// there are fewer than [n].
+static int tailOp(Optimizer* opt, int n)
+{
+  if (opt->starts.count < n) return -1;
+  return opt->output.data[tailStart(opt, n)];
+}
+
+// Returns the 16-bit argument of the [n]th most recently copied instruction.
+static int tailShort(Optimizer* opt, int n)
+{
+  uint8_t* code = &opt->output.data[tailStart(opt, n)];
+  return (code[1] << 8) | code[2];
+}
+
+// Whether the [n]th most recently copied instruction may be merged into the
+// one before it.
+static bool isFusable(Optimizer* opt, int n)
+{
+  return !opt->isTarget[opt->origins.data[opt->origins.count - n]];
+}
+
+// Returns the local slot loaded by the [n]th most recently copied instruction,
+// or -1 if it doesn't load a local.
+static int tailLocal(Optimizer* opt, int n)
+{
+  int instruction = tailOp(opt, n);
+  if (instruction >= CODE_LOAD_LOCAL_0 && instruction <= CODE_LOAD_LOCAL_8)
+  {
+    return instruction - CODE_LOAD_LOCAL_0;
+  }
+
+  if (instruction == CODE_LOAD_LOCAL)
+  {
+    return opt->output.data[tailStart(opt, n) + 1];
+  }
+
+  return -1;
+}
+
+static bool isNumberConstant(Optimizer* opt, int n)
+{
+  return tailOp(opt, n) == CODE_CONSTANT &&
+         IS_NUM(opt->compiler->fn->constants.data[tailShort(opt, n)]);
+}
+
+static double tailNumber(Optimizer* opt, int n)
+{
+  return AS_NUM(opt->compiler->fn->constants.data[tailShort(opt, n)]);
+}
+
+// Discards the [n] most recently copied instructions.
+static void dropTail(Optimizer* opt, int n)
+{
+  int start = tailStart(opt, n);
+  opt->output.count = start;
+  opt->lines.count = start;
+  opt->starts.count -= n;
+  opt->origins.count -= n;
+  opt->targets.count -= n;
+}
+
+// Replaces the [n] most recently copied instructions with [instruction] and
+// its [numArgs] argument bytes, which must not point into the output.
+//
+// The new instruction keeps the line of the first one it replaces, and its
+// arguments get the line of the last one, since the byte before the
+// instruction pointer is what a runtime error reports.
+static void replaceTail(Optimizer* opt, int n, Code instruction,
+                        const uint8_t* args, int numArgs, int target)
+{
+  int origin = opt->origins.data[opt->origins.count - n];
+  int firstLine = opt->lines.data[tailStart(opt, n)];
+  int lastLine = opt->lines.data[opt->lines.count - 1];
+
+  dropTail(opt, n);
+  beginInstruction(opt, origin, target);
+  writeByte(opt, instruction, firstLine);
+  for (int i = 0; i < numArgs; i++) writeByte(opt, args[i], lastLine);
+}
+
+// Replaces the [n] most recently copied instructions with code that loads
+// the number [value].
+static void replaceWithNumber(Optimizer* opt, int n, double value)
+{
+  // The constant table can't tell 0 from -0, and NaN is never equal to the
+  // constant it would be looked up by, so those are left unfolded.
+  if (value == 0 || isnan(value)) return;
+  if (opt->compiler->fn->constants.count == MAX_CONSTANTS) return;
+
+  int constant = addConstant(opt->compiler, NUM_VAL(value));
+  uint8_t args[] = { (constant >> 8) & 0xff, constant & 0xff };
+  replaceTail(opt, n, CODE_CONSTANT, args, 2, -1);
+}
+
+// Computes [instruction] on two numbers the same way the Num operators do.
+// Returns false if it isn't a foldable operator.
+static bool foldNumbers(Code instruction, double a, double b, Value* result)
+{
+  switch (instruction)
+  {
+    case CODE_ADD: *result = NUM_VAL(a + b); return true;
+    case CODE_SUB: *result = NUM_VAL(a - b); return true;
+    case CODE_MUL: *result = NUM_VAL(a * b); return true;
+    case CODE_DIV: *result = NUM_VAL(a / b); return true;
+    case CODE_MOD: *result = NUM_VAL(fmod(a, b)); return true;
+    case CODE_LT:  *result = BOOL_VAL(a < b); return true;
+    case CODE_GT:  *result = BOOL_VAL(a > b); return true;
+    case CODE_LTE: *result = BOOL_VAL(a <= b); return true;
+    case CODE_GTE: *result = BOOL_VAL(a >= b); return true;
+    case CODE_EQ:  *result = BOOL_VAL(a == b); return true;
+    case CODE_NEQ: *result = BOOL_VAL(a != b); return true;
+    default:       return false;
+  }
+}
+
+// Applies the first rule that matches the most recently copied instructions.
+static void optimizeTail(Optimizer* opt)
+{
+  int last = tailOp(opt, 1);
+  int previous = tailOp(opt, 2);
+  Value result;
+
+  // A literal operator expression.
+  if (isNumberConstant(opt, 3) && isNumberConstant(opt, 2) &&
+      isFusable(opt, 2) && isFusable(opt, 1) &&
+      foldNumbers((Code)last, tailNumber(opt, 3), tailNumber(opt, 2), &result))
+  {
+    if (IS_NUM(result))
+    {
+      replaceWithNumber(opt, 3, AS_NUM(result));
+    }
+    else
+    {
+      replaceTail(opt, 3, AS_BOOL(result) ? CODE_TRUE : CODE_FALSE, NULL, 0,
+                  -1);
+    }
+    return;
+  }
+
+  // A negative number literal.
+  if (last == CODE_CALL_0 && tailShort(opt, 1) == opt->negate &&
+      isNumberConstant(opt, 2) && isFusable(opt, 1))
+  {
+    replaceWithNumber(opt, 2, -tailNumber(opt, 2));
+    return;
+  }
+
+  // A condition that is known at compile time.
+  if (last == CODE_JUMP_IF && isFusable(opt, 1))
+  {
+    int target = opt->targets.data[opt->targets.count - 1];
+    Value condition = UNDEFINED_VAL;
+    if (previous == CODE_TRUE) condition = TRUE_VAL;
+    if (previous == CODE_FALSE) condition = FALSE_VAL;
+    if (previous == CODE_NULL) condition = NULL_VAL;
+    if (previous == CODE_CONSTANT)
+    {
+      condition = opt->compiler->fn->constants.data[tailShort(opt, 2)];
+    }
+
+    if (!IS_UNDEFINED(condition))
+    {
+      if (wrenIsFalsyValue(condition))
+      {
+        // The offset is filled in once every jump target has been placed.
+        uint8_t args[] = { 0, 0 };
+        replaceTail(opt, 2, CODE_JUMP, args, 2, target);
+      }
+      else
+      {
+        dropTail(opt, 2);
+      }
+      return;
+    }
+  }
+
+  // The comparison keeps its arguments and the JUMP_IF stays in place, so the
+  // fused instruction can fall back to calling the operator method.
+  if (last == CODE_JUMP_IF && previous >= CODE_LT && previous <= CODE_NEQ)
+  {
+    opt->output.data[tailStart(opt, 2)] =
+        (uint8_t)(CODE_LT_JUMP_IF + (previous - CODE_LT));
+    return;
+  }
+
+  if (last == CODE_POP && isFusable(opt, 1) &&
+      (previous == CODE_STORE_LOCAL || previous == CODE_STORE_FIELD_THIS))
+  {
+    uint8_t args[] = { opt->output.data[tailStart(opt, 2) + 1] };
+    replaceTail(opt, 2, previous == CODE_STORE_LOCAL
+                            ? CODE_STORE_LOCAL_POP : CODE_STORE_FIELD_THIS_POP,
+                args, 1, -1);
+    return;
+  }
+
+  int slot = tailLocal(opt, 2);
+  if (slot == -1 || !isFusable(opt, 1)) return;
+
+  if (tailLocal(opt, 1) != -1)
+  {
+    uint8_t args[] = { (uint8_t)slot, (uint8_t)tailLocal(opt, 1) };
+    replaceTail(opt, 2, CODE_LOAD_LOCALS, args, 2, -1);
+    return;
+  }
+
+  if (last == CODE_CALL_0 || last == CODE_CALL_1)
+  {
+    uint8_t* call = &opt->output.data[tailStart(opt, 1)];
+    uint8_t args[] = { (uint8_t)slot, call[1], call[2] };
+    replaceTail(opt, 2, last == CODE_CALL_0
+                            ? CODE_LOAD_LOCAL_CALL_0 : CODE_LOAD_LOCAL_CALL_1,
+                args, 3, -1);
+  }
+}
+
+// Rewrites the bytecode of the function [compiler] has just finished.
+static void optimizeCode(Compiler* compiler)
+{
+  WrenVM* vm = compiler->parser->vm;
+  ObjFn* fn = compiler->fn;
+
+  Optimizer opt;
+  opt.compiler = compiler;
+  opt.code = fn->code.data;
+  opt.count = fn->code.count;
+  opt.negate = wrenSymbolTableFind(&vm->methodNames, "-", 1);
+  wrenByteBufferInit(&opt.output);
+  wrenIntBufferInit(&opt.lines);
+  wrenIntBufferInit(&opt.starts);
+  wrenIntBufferInit(&opt.origins);
+  wrenIntBufferInit(&opt.targets);
+
+  opt.isTarget = ALLOCATE_ARRAY(vm, bool, opt.count);
+  opt.offsets = ALLOCATE_ARRAY(vm, int, opt.count);
+  memset(opt.isTarget, 0, sizeof(bool) * opt.count);
+
+  threadJumps(&opt);
+
+  for (int ip = 0; ip < opt.count; ip += instructionLength(&opt, ip))
+  {
+    int target = jumpTarget(opt.code, ip, instructionLength(&opt, ip));
+    if (target != -1) opt.isTarget[target] = true;
+  }
+
+  int* lines = fn->debug->sourceLines.data;
+  for (int ip = 0; ip < opt.count; )
+  {
+    int length = instructionLength(&opt, ip);
+    int target = jumpTarget(opt.code, ip, length);
+    opt.offsets[ip] = opt.output.count;
+
+    // A jump to the next instruction does nothing.
+    if (opt.code[ip] != CODE_JUMP || target != ip + length)
+    {
+      beginInstruction(&opt, ip, target);
+      for (int i = 0; i < length; i++)
+      {
+        writeByte(&opt, opt.code[ip + i], lines[ip + i]);
+      }
+      optimizeTail(&opt);
+    }
+
+    ip += length;
+  }
+
+  // Now that every instruction has its final place, point the jumps there.
+  for (int i = 0; i < opt.starts.count; i++)
+  {
+    int target = opt.targets.data[i];
+    if (target == -1) continue;
+
+    int end = i + 1 < opt.starts.count ? opt.starts.data[i + 1]
+                                       : opt.output.count;
+    int offset = opt.offsets[target] - end;
+    if (opt.output.data[opt.starts.data[i]] == CODE_LOOP) offset = -offset;
+    setJumpOffset(opt.output.data, end, offset);
+  }
+
+  wrenByteBufferClear(vm, &fn->code);
+  wrenIntBufferClear(vm, &fn->debug->sourceLines);
+  fn->code = opt.output;
+  fn->debug->sourceLines = opt.lines;
+
+  wrenIntBufferClear(vm, &opt.starts);
+  wrenIntBufferClear(vm, &opt.origins);
+  wrenIntBufferClear(vm, &opt.targets);
+  DEALLOCATE(vm, opt.isTarget);
+  DEALLOCATE(vm, opt.offsets);
+}
+
 ObjFn* wrenCompile(WrenVM* vm, ObjModule* module, const char* source,
                    bool isExpression, bool printErrors)
 {
@@ -3782,19 +4348,24 @@ ObjFn* wrenCompile(WrenVM* vm, ObjModule* module, const char* source,
   parser.next.length = 0;
   parser.next.line = 0;
   parser.next.value = UNDEFINED_VAL;
+  parser.current.value = UNDEFINED_VAL;
+  parser.previous.value = UNDEFINED_VAL;
 
   parser.printErrors = printErrors;
   parser.hasError = false;
 
+  int numExistingVariables = module->variables.count;
+
+  // The compiler is what keeps the values of the tokens from being collected,
+  // so it has to exist before they are read.
+  Compiler compiler;
+  initCompiler(&compiler, &parser, NULL, false);
+
   // Read the first token into next
   nextToken(&parser);
   // Copy next -> current
   nextToken(&parser);
 
-  int numExistingVariables = module->variables.count;
-
-  Compiler compiler;
-  initCompiler(&compiler, &parser, NULL, false);
   ignoreNewlines(&compiler);
 
   if (isExpression)
@@ -3840,7 +4411,12 @@ ObjFn* wrenCompile(WrenVM* vm, ObjModule* module, const char* source,
   return endCompiler(&compiler, "(script)", 8);
 }
 
-void wrenBindMethodCode(ObjClass* classObj, ObjFn* fn)
+int wrenInstructionLength(ObjFn* fn, int ip)
+{
+  return 1 + getByteCountForArguments(fn->code.data, fn->constants.data, ip);
+}
+
+void wrenBindMethodCode(WrenVM* vm, ObjClass* classObj, ObjFn* fn)
 {
   int ip = 0;
   for (;;)
@@ -3852,9 +4428,14 @@ void wrenBindMethodCode(ObjClass* classObj, ObjFn* fn)
       case CODE_STORE_FIELD:
       case CODE_LOAD_FIELD_THIS:
       case CODE_STORE_FIELD_THIS:
+      case CODE_STORE_FIELD_THIS_POP:
         // Shift this class's fields down past the inherited ones. We don't
         // check for overflow here because we'll see if the number of fields
         // overflows when the subclass is created.
+        if (classObj->superclass->numFields == 0) break;
+
+        // Code borrowed from an image is read-only, patch a private copy.
+        wrenUnshareFunction(vm, fn);
         fn->code.data[ip + 1] += classObj->superclass->numFields;
         break;
 
@@ -3879,6 +4460,7 @@ void wrenBindMethodCode(ObjClass* classObj, ObjFn* fn)
         // Fill in the constant slot with a reference to the superclass.
         int constant = (fn->code.data[ip + 3] << 8) | fn->code.data[ip + 4];
         fn->constants.data[constant] = OBJ_VAL(classObj->superclass);
+        wrenWriteBarrier(vm, &fn->obj, fn->constants.data[constant]);
         break;
       }
 
@@ -3886,7 +4468,7 @@ void wrenBindMethodCode(ObjClass* classObj, ObjFn* fn)
       {
         // Bind the nested closure too.
         int constant = (fn->code.data[ip + 1] << 8) | fn->code.data[ip + 2];
-        wrenBindMethodCode(classObj, AS_FN(fn->constants.data[constant]));
+        wrenBindMethodCode(vm, classObj, AS_FN(fn->constants.data[constant]));
         break;
       }
 
@@ -3981,6 +4563,7 @@ static void addToAttributeGroup(Compiler* compiler,
   //keyItems.add(value)
   ObjList* keyItems = AS_LIST(keyItemsValue);
   wrenValueBufferWrite(vm, &keyItems->elements, value);
+  wrenWriteBarrier(vm, &keyItems->obj, value);
 
   if(IS_OBJ(group)) wrenPopRoot(vm);
   if(IS_OBJ(key))   wrenPopRoot(vm);
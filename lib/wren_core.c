@@ -322,6 +322,7 @@ DEF_PRIMITIVE(list_new)
 DEF_PRIMITIVE(list_add)
 {
   wrenValueBufferWrite(vm, &AS_LIST(args[0])->elements, args[1]);
+  wrenWriteBarrier(vm, AS_OBJ(args[0]), args[1]);
   RETURN_VAL(args[1]);
 }
 
@@ -331,6 +332,7 @@ DEF_PRIMITIVE(list_add)
 DEF_PRIMITIVE(list_addCore)
 {
   wrenValueBufferWrite(vm, &AS_LIST(args[0])->elements, args[1]);
+  wrenWriteBarrier(vm, AS_OBJ(args[0]), args[1]);
   
   // Return the list.
   RETURN_VAL(args[0]);
@@ -467,6 +469,7 @@ DEF_PRIMITIVE(list_subscriptSetter)
   if (index == UINT32_MAX) return false;
 
   list->elements.data[index] = args[2];
+  wrenWriteBarrier(vm, &list->obj, args[2]);
   RETURN_VAL(args[2]);
 }
 
@@ -1232,7 +1235,9 @@ static ObjClass* defineClass(WrenVM* vm, ObjModule* module, const char* name)
   return classObj;
 }
 
-void wrenInitializeCore(WrenVM* vm)
+// Creates the core module and the Object and Class classes that everything
+// else is built on. Returns the core module.
+static ObjModule* bootstrapCore(WrenVM* vm)
 {
   ObjModule* coreModule = wrenNewModule(vm, NULL);
   wrenPushRoot(vm, (Obj*)coreModule);
@@ -1295,8 +1300,28 @@ void wrenInitializeCore(WrenVM* vm)
   //   | Derived |==>| Derived metaclass |=========="  |
   //   '---------'   '-------------------'            -'
 
+  return coreModule;
+}
+
+WrenCodeImage* wrenCompileCore(WrenVM* vm)
+{
+  bootstrapCore(vm);
+  return wrenCompileImage(vm, NULL, coreModuleSource);
+}
+
+void wrenInitializeCore(WrenVM* vm)
+{
+  ObjModule* coreModule = bootstrapCore(vm);
+
   // The rest of the classes can now be defined normally.
-  wrenInterpret(vm, NULL, coreModuleSource);
+  if (vm->config.coreImage != NULL)
+  {
+    wrenInterpretImage(vm, vm->config.coreImage);
+  }
+  else
+  {
+    wrenInterpret(vm, NULL, coreModuleSource);
+  }
 
   vm->boolClass = AS_CLASS(wrenFindVariable(vm, coreModule, "Bool"));
   PRIMITIVE(vm->boolClass, "toString", bool_toString);
@@ -1479,9 +1504,16 @@ void wrenInitializeCore(WrenVM* vm)
   // for its name.
   //
   // These all currently have a NULL classObj pointer, so go back and assign
-  // them now that the string class is known.
+  // them now that the string class is known. Those that are still young have
+  // not been moved to the old objects yet.
+  wrenFinishSweep(vm);
   for (Obj* obj = vm->first; obj != NULL; obj = obj->next)
   {
     if (obj->type == OBJ_STRING) obj->classObj = vm->stringClass;
   }
+
+  for (Obj* obj = vm->young; obj != NULL; obj = obj->next)
+  {
+    if (obj->type == OBJ_STRING) obj->classObj = vm->stringClass;
+  }
 }
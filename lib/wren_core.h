@@ -20,4 +20,8 @@
 
 void wrenInitializeCore(WrenVM* vm);
 
+// Compiles the core module into an image in [vm], which must not have been
+// initialized. [vm] is only good for freeing afterwards.
+WrenCodeImage* wrenCompileCore(WrenVM* vm);
+
 #endif
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "wren_debug.h"
 
@@ -125,6 +126,15 @@ static int dumpInstruction(WrenVM* vm, ObjFn* fn, int i, int* lastLine)
       printf("%-16s %5d\n", name, READ_BYTE());                                \
       break
 
+  #define CALL_INSTRUCTION(name)                                               \
+      do                                                                       \
+      {                                                                        \
+        int symbol = READ_SHORT();                                             \
+        printf("%-16s %5d '%s'\n", name, symbol,                               \
+               vm->methodNames.data[symbol]->value);                           \
+      } while (false);                                                         \
+      break
+
   switch (code)
   {
     case CODE_CONSTANT:
@@ -203,6 +213,46 @@ static int dumpInstruction(WrenVM* vm, ObjFn* fn, int i, int* lastLine)
       break;
     }
 
+    case CODE_ADD: CALL_INSTRUCTION("ADD");
+    case CODE_SUB: CALL_INSTRUCTION("SUB");
+    case CODE_MUL: CALL_INSTRUCTION("MUL");
+    case CODE_DIV: CALL_INSTRUCTION("DIV");
+    case CODE_MOD: CALL_INSTRUCTION("MOD");
+    case CODE_LT: CALL_INSTRUCTION("LT");
+    case CODE_GT: CALL_INSTRUCTION("GT");
+    case CODE_LTE: CALL_INSTRUCTION("LTE");
+    case CODE_GTE: CALL_INSTRUCTION("GTE");
+    case CODE_EQ: CALL_INSTRUCTION("EQ");
+    case CODE_NEQ: CALL_INSTRUCTION("NEQ");
+    case CODE_LT_JUMP_IF: CALL_INSTRUCTION("LT_JUMP_IF");
+    case CODE_GT_JUMP_IF: CALL_INSTRUCTION("GT_JUMP_IF");
+    case CODE_LTE_JUMP_IF: CALL_INSTRUCTION("LTE_JUMP_IF");
+    case CODE_GTE_JUMP_IF: CALL_INSTRUCTION("GTE_JUMP_IF");
+    case CODE_EQ_JUMP_IF: CALL_INSTRUCTION("EQ_JUMP_IF");
+    case CODE_NEQ_JUMP_IF: CALL_INSTRUCTION("NEQ_JUMP_IF");
+
+    case CODE_STORE_LOCAL_POP: BYTE_INSTRUCTION("STORE_LOCAL_POP");
+    case CODE_STORE_FIELD_THIS_POP: BYTE_INSTRUCTION("STORE_FIELD_THIS_POP");
+
+    case CODE_LOAD_LOCALS:
+    {
+      int first = READ_BYTE();
+      int second = READ_BYTE();
+      printf("%-16s %5d %5d\n", "LOAD_LOCALS", first, second);
+      break;
+    }
+
+    case CODE_LOAD_LOCAL_CALL_0:
+    case CODE_LOAD_LOCAL_CALL_1:
+    {
+      int numArgs = bytecode[i - 1] - CODE_LOAD_LOCAL_CALL_0;
+      int slot = READ_BYTE();
+      int symbol = READ_SHORT();
+      printf("LOAD_LOCAL_CALL_%d %3d %5d '%s'\n", numArgs, slot, symbol,
+             vm->methodNames.data[symbol]->value);
+      break;
+    }
+
     case CODE_SUPER_0:
     case CODE_SUPER_1:
     case CODE_SUPER_2:
@@ -250,6 +300,29 @@ static int dumpInstruction(WrenVM* vm, ObjFn* fn, int i, int* lastLine)
       break;
     }
 
+    case CODE_FOR_RANGE:
+    {
+      int slot = READ_BYTE();
+      int isInclusive = READ_BYTE();
+      int offset = READ_SHORT();
+      printf("%-16s %5d %5s %5d to %d\n", "FOR_RANGE", slot,
+             isInclusive ? ".." : "...", offset, i + offset);
+      break;
+    }
+
+    case CODE_FOR_ITERATE:
+    case CODE_FOR_ITERATOR_VALUE:
+    {
+      int sequence = READ_BYTE();
+      int iterator = READ_BYTE();
+      int symbol = READ_SHORT();
+      printf("%-18s %3d %3d '%s'\n",
+             code == CODE_FOR_ITERATE ? "FOR_ITERATE"
+                                      : "FOR_ITERATOR_VALUE",
+             sequence, iterator, vm->methodNames.data[symbol]->value);
+      break;
+    }
+
     case CODE_AND:
     {
       int offset = READ_SHORT();
@@ -386,3 +459,385 @@ void wrenDumpStack(ObjFiber* fiber)
   }
   printf("\n");
 }
+
+// Heap dumps ------------------------------------------------------------------
+
+// A heap dump starts with the four bytes "WRNH" and a format version, followed
+// by records that each start with one of the tags below. Numbers are unsigned
+// LEB128 varints, objects are identified by their address divided by 8 and
+// names are a length followed by that many bytes:
+//
+//   OBJECT   id type class size count id...   every object on the heap
+//   NAME     id name                          the name of a class or module
+//   ROOT     kind id                          an object the VM keeps alive
+//   VARIABLE module name id                   a module variable's object
+//   END
+//
+// [type] is an [ObjType] and [kind] a [HeapRootKind]. Object ids are written
+// as they are found, so a reference may come before the object it is to.
+typedef enum
+{
+  HEAP_TAG_OBJECT = 1,
+  HEAP_TAG_NAME,
+  HEAP_TAG_ROOT,
+  HEAP_TAG_VARIABLE,
+  HEAP_TAG_END
+} HeapTag;
+
+typedef enum
+{
+  HEAP_ROOT_MODULES,
+  HEAP_ROOT_TEMP,
+  HEAP_ROOT_FIBER,
+  HEAP_ROOT_HANDLE,
+  HEAP_ROOT_METHOD_NAME
+} HeapRootKind;
+
+#define HEAP_DUMP_VERSION 1
+
+// Writes are batched, a heap holds far too many small fields to hand each one
+// to the host.
+#define HEAP_BUFFER_SIZE (64 * 1024)
+
+typedef struct
+{
+  WrenVM* vm;
+  WrenWriteBytesFn write;
+  void* userData;
+
+  uint8_t* buffer;
+  size_t length;
+
+  // The references of the object being written. They are counted before they
+  // can be written.
+  uint64_t* refs;
+  size_t refCount;
+  size_t refCapacity;
+
+  // Set if scratch memory ran out, which leaves the dump incomplete.
+  bool failed;
+} HeapWriter;
+
+// Scratch memory comes straight from the host's allocator. Going through the
+// VM would count it against the heap and could start a collection mid-dump.
+static void* heapAllocate(HeapWriter* writer, void* memory, size_t size)
+{
+  return writer->vm->config.reallocateFn(memory, size,
+                                         writer->vm->config.userData);
+}
+
+static void heapFlush(HeapWriter* writer)
+{
+  if (writer->length == 0) return;
+  writer->write(writer->userData, writer->buffer, writer->length);
+  writer->length = 0;
+}
+
+static void heapWriteBytes(HeapWriter* writer, const void* bytes,
+                           size_t length)
+{
+  if (writer->length + length > HEAP_BUFFER_SIZE)
+  {
+    heapFlush(writer);
+    if (length > HEAP_BUFFER_SIZE)
+    {
+      writer->write(writer->userData, bytes, length);
+      return;
+    }
+  }
+
+  memcpy(writer->buffer + writer->length, bytes, length);
+  writer->length += length;
+}
+
+static void heapWriteNumber(HeapWriter* writer, uint64_t value)
+{
+  uint8_t bytes[10];
+  int length = 0;
+  do
+  {
+    bytes[length] = (uint8_t)(value & 0x7f);
+    value >>= 7;
+    if (value != 0) bytes[length] |= 0x80;
+    length++;
+  } while (value != 0);
+
+  heapWriteBytes(writer, bytes, length);
+}
+
+static uint64_t heapId(Obj* obj)
+{
+  return (uint64_t)(uintptr_t)obj >> 3;
+}
+
+static void heapWriteTag(HeapWriter* writer, HeapTag tag)
+{
+  uint8_t byte = (uint8_t)tag;
+  heapWriteBytes(writer, &byte, 1);
+}
+
+static void heapWriteName(HeapWriter* writer, ObjString* name)
+{
+  if (name == NULL)
+  {
+    heapWriteNumber(writer, 0);
+    return;
+  }
+
+  heapWriteNumber(writer, name->length);
+  heapWriteBytes(writer, name->value, name->length);
+}
+
+static void heapWriteRoot(HeapWriter* writer, HeapRootKind kind, Obj* obj)
+{
+  if (obj == NULL) return;
+
+  heapWriteTag(writer, HEAP_TAG_ROOT);
+  heapWriteNumber(writer, kind);
+  heapWriteNumber(writer, heapId(obj));
+}
+
+static void heapAddRef(HeapWriter* writer, Obj* obj)
+{
+  if (obj == NULL) return;
+
+  if (writer->refCount == writer->refCapacity)
+  {
+    size_t capacity = writer->refCapacity == 0 ? 64 : writer->refCapacity * 2;
+    uint64_t* refs = (uint64_t*)heapAllocate(writer, writer->refs,
+                                             capacity * sizeof(uint64_t));
+    if (refs == NULL)
+    {
+      writer->failed = true;
+      return;
+    }
+
+    writer->refs = refs;
+    writer->refCapacity = capacity;
+  }
+
+  writer->refs[writer->refCount++] = heapId(obj);
+}
+
+static void heapAddValue(HeapWriter* writer, Value value)
+{
+  if (IS_OBJ(value)) heapAddRef(writer, AS_OBJ(value));
+}
+
+// Collects the references of [obj], the same ones the collector follows.
+static void heapAddReferences(HeapWriter* writer, Obj* obj)
+{
+  heapAddRef(writer, (Obj*)obj->classObj);
+
+  switch (obj->type)
+  {
+    case OBJ_CLASS:
+    {
+      ObjClass* classObj = (ObjClass*)obj;
+      heapAddRef(writer, (Obj*)classObj->superclass);
+      for (int i = 0; i < classObj->methodSymbols.count; i++)
+      {
+        Method* method = wrenFindMethod(writer->vm, classObj,
+                                        classObj->methodSymbols.data[i]);
+        if (method != NULL && method->type == METHOD_BLOCK)
+        {
+          heapAddRef(writer, (Obj*)method->as.closure);
+        }
+      }
+      heapAddRef(writer, (Obj*)classObj->name);
+      heapAddValue(writer, classObj->attributes);
+      break;
+    }
+
+    case OBJ_CLOSURE:
+    {
+      ObjClosure* closure = (ObjClosure*)obj;
+      heapAddRef(writer, (Obj*)closure->fn);
+      for (int i = 0; i < closure->fn->numUpvalues; i++)
+      {
+        heapAddRef(writer, (Obj*)closure->upvalues[i]);
+      }
+      break;
+    }
+
+    case OBJ_FIBER:
+    {
+      ObjFiber* fiber = (ObjFiber*)obj;
+      for (int i = 0; i < fiber->numFrames; i++)
+      {
+        heapAddRef(writer, (Obj*)fiber->frames[i].closure);
+      }
+      for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++)
+      {
+        heapAddValue(writer, *slot);
+      }
+      for (ObjUpvalue* upvalue = fiber->openUpvalues;
+           upvalue != NULL;
+           upvalue = upvalue->next)
+      {
+        heapAddRef(writer, (Obj*)upvalue);
+      }
+      heapAddRef(writer, (Obj*)fiber->caller);
+      heapAddValue(writer, fiber->error);
+      break;
+    }
+
+    case OBJ_FN:
+    {
+      ObjFn* fn = (ObjFn*)obj;
+      for (int i = 0; i < fn->constants.count; i++)
+      {
+        heapAddValue(writer, fn->constants.data[i]);
+      }
+      break;
+    }
+
+    case OBJ_INSTANCE:
+    {
+      ObjInstance* instance = (ObjInstance*)obj;
+      for (int i = 0; i < obj->classObj->numFields; i++)
+      {
+        heapAddValue(writer, instance->fields[i]);
+      }
+      break;
+    }
+
+    case OBJ_LIST:
+    {
+      ObjList* list = (ObjList*)obj;
+      for (int i = 0; i < list->elements.count; i++)
+      {
+        heapAddValue(writer, list->elements.data[i]);
+      }
+      break;
+    }
+
+    case OBJ_MAP:
+    {
+      ObjMap* map = (ObjMap*)obj;
+      for (uint32_t i = 0; i < map->capacity; i++)
+      {
+        MapEntry* entry = &map->entries[i];
+        if (IS_UNDEFINED(entry->key)) continue;
+
+        heapAddValue(writer, entry->key);
+        heapAddValue(writer, entry->value);
+      }
+      break;
+    }
+
+    case OBJ_MODULE:
+    {
+      ObjModule* module = (ObjModule*)obj;
+      for (int i = 0; i < module->variables.count; i++)
+      {
+        heapAddValue(writer, module->variables.data[i]);
+      }
+      for (int i = 0; i < module->variableNames.count; i++)
+      {
+        heapAddRef(writer, (Obj*)module->variableNames.data[i]);
+      }
+      heapAddRef(writer, (Obj*)module->name);
+      break;
+    }
+
+    case OBJ_UPVALUE:
+      heapAddValue(writer, ((ObjUpvalue*)obj)->closed);
+      break;
+
+    case OBJ_FOREIGN:
+    case OBJ_RANGE:
+    case OBJ_STRING:
+      break;
+  }
+}
+
+static void heapWriteObject(HeapWriter* writer, Obj* obj)
+{
+  writer->refCount = 0;
+  heapAddReferences(writer, obj);
+
+  heapWriteTag(writer, HEAP_TAG_OBJECT);
+  heapWriteNumber(writer, heapId(obj));
+  heapWriteNumber(writer, obj->type);
+  heapWriteNumber(writer, obj->classObj == NULL ? 0 : heapId((Obj*)obj->classObj));
+  heapWriteNumber(writer, wrenObjectSize(obj));
+  heapWriteNumber(writer, writer->refCount);
+  for (size_t i = 0; i < writer->refCount; i++)
+  {
+    heapWriteNumber(writer, writer->refs[i]);
+  }
+
+  if (obj->type == OBJ_CLASS)
+  {
+    heapWriteTag(writer, HEAP_TAG_NAME);
+    heapWriteNumber(writer, heapId(obj));
+    heapWriteName(writer, ((ObjClass*)obj)->name);
+  }
+  else if (obj->type == OBJ_MODULE)
+  {
+    ObjModule* module = (ObjModule*)obj;
+    heapWriteTag(writer, HEAP_TAG_NAME);
+    heapWriteNumber(writer, heapId(obj));
+    heapWriteName(writer, module->name);
+
+    for (int i = 0; i < module->variables.count; i++)
+    {
+      Value value = module->variables.data[i];
+      if (!IS_OBJ(value)) continue;
+
+      heapWriteTag(writer, HEAP_TAG_VARIABLE);
+      heapWriteNumber(writer, heapId(obj));
+      heapWriteName(writer, module->variableNames.data[i]);
+      heapWriteNumber(writer, heapId(AS_OBJ(value)));
+    }
+  }
+}
+
+bool wrenDumpHeap(WrenVM* vm, WrenWriteBytesFn write, void* userData)
+{
+  // Otherwise the objects being swept are in neither list.
+  wrenFinishSweep(vm);
+
+  HeapWriter writer = { vm, write, userData, NULL, 0, NULL, 0, 0, false };
+  writer.buffer = (uint8_t*)heapAllocate(&writer, NULL, HEAP_BUFFER_SIZE);
+  if (writer.buffer == NULL) return false;
+
+  heapWriteBytes(&writer, "WRNH", 4);
+  heapWriteNumber(&writer, HEAP_DUMP_VERSION);
+
+  // The same roots a full collection starts from.
+  heapWriteRoot(&writer, HEAP_ROOT_MODULES, (Obj*)vm->modules);
+  for (int i = 0; i < vm->numTempRoots; i++)
+  {
+    heapWriteRoot(&writer, HEAP_ROOT_TEMP, vm->tempRoots[i]);
+  }
+  heapWriteRoot(&writer, HEAP_ROOT_FIBER, (Obj*)vm->fiber);
+  for (WrenHandle* handle = vm->handles; handle != NULL; handle = handle->next)
+  {
+    if (IS_OBJ(handle->value))
+    {
+      heapWriteRoot(&writer, HEAP_ROOT_HANDLE, AS_OBJ(handle->value));
+    }
+  }
+  for (int i = 0; i < vm->methodNames.count; i++)
+  {
+    heapWriteRoot(&writer, HEAP_ROOT_METHOD_NAME, (Obj*)vm->methodNames.data[i]);
+  }
+
+  Obj* lists[] = { vm->young, vm->first };
+  for (int i = 0; i < 2; i++)
+  {
+    for (Obj* obj = lists[i]; obj != NULL; obj = obj->next)
+    {
+      heapWriteObject(&writer, obj);
+    }
+  }
+
+  heapWriteTag(&writer, HEAP_TAG_END);
+  heapFlush(&writer);
+
+  heapAllocate(&writer, writer.refs, 0);
+  heapAllocate(&writer, writer.buffer, 0);
+  return !writer.failed;
+}
@@ -0,0 +1,831 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "wren.h"
+#include "wren_compiler.h"
+#include "wren_image.h"
+#include "wren_vm.h"
+
+// Images outlive the VM that compiled them and are shared between VMs, so
+// they are allocated from the C heap rather than through a VM's reallocateFn.
+static void* imageAllocate(void* memory, size_t size)
+{
+  if (size == 0)
+  {
+    free(memory);
+    return NULL;
+  }
+
+  return realloc(memory, size);
+}
+
+static char* copyBytes(const char* bytes, int length)
+{
+  char* copy = (char*)imageAllocate(NULL, length + 1);
+  memcpy(copy, bytes, length);
+  copy[length] = '\0';
+  return copy;
+}
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+
+// Continues an FNV-1a [hash] over [length] more bytes.
+static uint64_t hashBytes(uint64_t hash, const void* bytes, size_t length)
+{
+  const uint8_t* data = (const uint8_t*)bytes;
+  for (size_t i = 0; i < length; i++)
+  {
+    hash ^= data[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+static uint64_t hashSource(const char* source)
+{
+  return hashBytes(FNV_OFFSET_BASIS, source, strlen(source));
+}
+
+static ImageName* copySymbols(SymbolTable* symbols, int count)
+{
+  if (count == 0) return NULL;
+
+  ImageName* names = (ImageName*)imageAllocate(NULL, sizeof(ImageName) * count);
+  for (int i = 0; i < count; i++)
+  {
+    names[i].chars = copyBytes(symbols->data[i]->value, symbols->data[i]->length);
+    names[i].length = symbols->data[i]->length;
+  }
+
+  return names;
+}
+
+static bool symbolsMatch(SymbolTable* symbols, ImageName* names, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    ObjString* symbol = symbols->data[i];
+    if (symbol->length != (uint32_t)names[i].length ||
+        memcmp(symbol->value, names[i].chars, names[i].length) != 0)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Copies [fn] and, recursively, every function in its constant table into
+// [image]. Returns the index of [fn] in [WrenCodeImage.fns].
+static int addFn(WrenCodeImage* image, int* capacity, ObjFn* fn)
+{
+  if (image->numFns == *capacity)
+  {
+    *capacity = *capacity == 0 ? 8 : *capacity * 2;
+    image->fns = (ImageFn*)imageAllocate(image->fns,
+                                         sizeof(ImageFn) * *capacity);
+  }
+
+  int index = image->numFns++;
+  ImageFn* imageFn = &image->fns[index];
+
+  imageFn->codeCount = fn->code.count;
+  imageFn->code = (uint8_t*)imageAllocate(NULL, fn->code.count);
+  memcpy(imageFn->code, fn->code.data, fn->code.count);
+
+  imageFn->maxSlots = fn->maxSlots;
+  imageFn->numUpvalues = fn->numUpvalues;
+  imageFn->arity = fn->arity;
+
+  imageFn->debug.name = fn->debug->name == NULL ? NULL
+      : copyBytes(fn->debug->name, (int)strlen(fn->debug->name));
+  wrenIntBufferInit(&imageFn->debug.sourceLines);
+  if (fn->debug->sourceLines.count > 0)
+  {
+    size_t size = sizeof(int) * fn->debug->sourceLines.count;
+    imageFn->debug.sourceLines.data = (int*)imageAllocate(NULL, size);
+    memcpy(imageFn->debug.sourceLines.data, fn->debug->sourceLines.data, size);
+    imageFn->debug.sourceLines.count = fn->debug->sourceLines.count;
+    imageFn->debug.sourceLines.capacity = fn->debug->sourceLines.count;
+  }
+
+  int numConstants = fn->constants.count;
+  ImageConstant* constants = NULL;
+  if (numConstants > 0)
+  {
+    constants = (ImageConstant*)imageAllocate(NULL,
+        sizeof(ImageConstant) * numConstants);
+    memset(constants, 0, sizeof(ImageConstant) * numConstants);
+  }
+
+  for (int i = 0; i < numConstants; i++)
+  {
+    Value constant = fn->constants.data[i];
+    if (IS_STRING(constant))
+    {
+      constants[i].type = IMAGE_CONSTANT_STRING;
+      constants[i].bytes = copyBytes(AS_STRING(constant)->value,
+                                     AS_STRING(constant)->length);
+      constants[i].length = AS_STRING(constant)->length;
+    }
+    else if (IS_FN(constant))
+    {
+      constants[i].type = IMAGE_CONSTANT_FN;
+      constants[i].fn = addFn(image, capacity, AS_FN(constant));
+    }
+    else
+    {
+      ASSERT(!IS_OBJ(constant), "Unexpected object in constant table.");
+      constants[i].type = IMAGE_CONSTANT_VALUE;
+      constants[i].value = constant;
+    }
+  }
+
+  // [addFn] may have moved the array, so look the function up again.
+  image->fns[index].constants = constants;
+  image->fns[index].numConstants = numConstants;
+  return index;
+}
+
+WrenCodeImage* wrenCompileImage(WrenVM* vm, const char* module,
+                                const char* source)
+{
+  // Compile into a scratch module that is never registered, so nothing in
+  // [vm] can observe it. It implicitly imports core like any other module.
+  // When compiling core itself (see [wrenCompileCore]) that is just the
+  // bootstrapped Object and Class, which the core source builds upon.
+  ObjString* name = NULL;
+  if (module != NULL)
+  {
+    name = AS_STRING(wrenNewString(vm, module));
+    wrenPushRoot(vm, (Obj*)name);
+  }
+  ObjModule* scratch = wrenNewModule(vm, name);
+  if (module != NULL) wrenPopRoot(vm); // name.
+  wrenPushRoot(vm, (Obj*)scratch);
+
+  ObjModule* coreModule = AS_MODULE(wrenMapGet(vm->modules, NULL_VAL));
+  for (int i = 0; i < coreModule->variables.count; i++)
+  {
+    wrenDefineVariable(vm, scratch,
+                       coreModule->variableNames.data[i]->value,
+                       coreModule->variableNames.data[i]->length,
+                       coreModule->variables.data[i], NULL);
+  }
+
+  ObjFn* fn = wrenCompile(vm, scratch, source, false, true);
+  if (fn == NULL)
+  {
+    wrenPopRoot(vm); // scratch.
+    return NULL;
+  }
+
+  WrenCodeImage* image = (WrenCodeImage*)imageAllocate(NULL,
+                                                       sizeof(WrenCodeImage));
+  memset(image, 0, sizeof(WrenCodeImage));
+  image->module = module == NULL ? NULL
+      : copyBytes(module, (int)strlen(module));
+  image->source = copyBytes(source, (int)strlen(source));
+  image->sourceHash = hashSource(source);
+
+  image->numMethodNames = vm->methodNames.count;
+  image->methodNames = copySymbols(&vm->methodNames, vm->methodNames.count);
+  image->numVariables = scratch->variableNames.count;
+  image->variableNames = copySymbols(&scratch->variableNames,
+                                     scratch->variableNames.count);
+
+  int capacity = 0;
+  addFn(image, &capacity, fn);
+
+  wrenPopRoot(vm); // scratch.
+  return image;
+}
+
+// Fills in the constant table of [fn], which was instantiated from
+// [image.fns[index]]. Nested functions are stored in [fn] before their own
+// constants are loaded so that they are always reachable by the GC.
+static void loadConstants(WrenVM* vm, WrenCodeImage* image, ObjFn* fn,
+                          int index)
+{
+  ImageFn* imageFn = &image->fns[index];
+  wrenValueBufferFill(vm, &fn->constants, NULL_VAL, imageFn->numConstants);
+
+  for (int i = 0; i < imageFn->numConstants; i++)
+  {
+    ImageConstant* constant = &imageFn->constants[i];
+    switch (constant->type)
+    {
+      case IMAGE_CONSTANT_VALUE:
+        fn->constants.data[i] = constant->value;
+        break;
+
+      case IMAGE_CONSTANT_STRING:
+        fn->constants.data[i] = wrenNewStringLength(vm, constant->bytes,
+                                                    constant->length);
+        break;
+
+      case IMAGE_CONSTANT_FN:
+      {
+        ImageFn* nested = &image->fns[constant->fn];
+        ObjFn* nestedFn = wrenNewSharedFunction(vm, fn->module,
+            nested->maxSlots, nested->code, nested->codeCount,
+            &nested->debug);
+        nestedFn->numUpvalues = nested->numUpvalues;
+        nestedFn->arity = nested->arity;
+        fn->constants.data[i] = OBJ_VAL(nestedFn);
+
+        loadConstants(vm, image, nestedFn, constant->fn);
+        break;
+      }
+    }
+
+    // Creating the constant may have collected and promoted [fn].
+    wrenWriteBarrier(vm, &fn->obj, fn->constants.data[i]);
+  }
+}
+
+ObjClosure* wrenLoadImage(WrenVM* vm, WrenCodeImage* image)
+{
+  // Bytecode refers to methods by symbol, so this VM must not know any
+  // method the compiling VM didn't, in a different order.
+  if (vm->methodNames.count > image->numMethodNames ||
+      !symbolsMatch(&vm->methodNames, image->methodNames,
+                    vm->methodNames.count))
+  {
+    return NULL;
+  }
+
+  // Likewise the implicitly imported core variables come first in the module,
+  // and must line up with the ones the image was compiled with.
+  ObjModule* coreModule = AS_MODULE(wrenMapGet(vm->modules, NULL_VAL));
+  if (coreModule->variableNames.count > image->numVariables ||
+      !symbolsMatch(&coreModule->variableNames, image->variableNames,
+                    coreModule->variableNames.count))
+  {
+    return NULL;
+  }
+
+  ObjModule* module;
+  if (image->module == NULL)
+  {
+    // The core image loads into the bootstrapped core module, before any of
+    // the core source has run.
+    if (coreModule->variables.count == image->numVariables) return NULL;
+    module = coreModule;
+  }
+  else
+  {
+    Value name = wrenNewStringLength(vm, image->module, strlen(image->module));
+    wrenPushRoot(vm, AS_OBJ(name));
+
+    // Loading on top of an existing module would renumber its variables.
+    if (!IS_UNDEFINED(wrenMapGet(vm->modules, name)))
+    {
+      wrenPopRoot(vm); // name.
+      return NULL;
+    }
+
+    module = wrenNewModule(vm, AS_STRING(name));
+    wrenPushRoot(vm, (Obj*)module);
+    wrenMapSet(vm, vm->modules, name, OBJ_VAL(module));
+    wrenPopRoot(vm); // module.
+    wrenPopRoot(vm); // name.
+
+    for (int i = 0; i < coreModule->variables.count; i++)
+    {
+      wrenDefineVariable(vm, module,
+                         coreModule->variableNames.data[i]->value,
+                         coreModule->variableNames.data[i]->length,
+                         coreModule->variables.data[i], NULL);
+    }
+  }
+
+  // The module's own variables start out as null until its body runs, exactly
+  // as they are after compiling it.
+  for (int i = module->variables.count; i < image->numVariables; i++)
+  {
+    wrenDefineVariable(vm, module, image->variableNames[i].chars,
+                       image->variableNames[i].length, NULL_VAL, NULL);
+  }
+
+  for (int i = vm->methodNames.count; i < image->numMethodNames; i++)
+  {
+    wrenSymbolTableAdd(vm, &vm->methodNames, image->methodNames[i].chars,
+                       image->methodNames[i].length);
+  }
+
+  ImageFn* body = &image->fns[0];
+  ObjFn* fn = wrenNewSharedFunction(vm, module, body->maxSlots, body->code,
+                                    body->codeCount, &body->debug);
+  fn->numUpvalues = body->numUpvalues;
+  fn->arity = body->arity;
+
+  wrenPushRoot(vm, (Obj*)fn);
+  loadConstants(vm, image, fn, 0);
+  ObjClosure* closure = wrenNewClosure(vm, fn);
+  wrenPopRoot(vm); // fn.
+
+  return closure;
+}
+
+void wrenUnshareFunction(WrenVM* vm, ObjFn* fn)
+{
+  if (!fn->isShared) return;
+
+  FnDebug* shared = fn->debug;
+  FnDebug* debug = ALLOCATE(vm, FnDebug);
+  debug->name = NULL;
+  wrenIntBufferInit(&debug->sourceLines);
+
+  if (shared->name != NULL)
+  {
+    size_t length = strlen(shared->name);
+    debug->name = ALLOCATE_ARRAY(vm, char, length + 1);
+    memcpy(debug->name, shared->name, length + 1);
+  }
+
+  if (shared->sourceLines.count > 0)
+  {
+    debug->sourceLines.data = ALLOCATE_ARRAY(vm, int,
+                                             shared->sourceLines.count);
+    memcpy(debug->sourceLines.data, shared->sourceLines.data,
+           sizeof(int) * shared->sourceLines.count);
+    debug->sourceLines.count = shared->sourceLines.count;
+    debug->sourceLines.capacity = shared->sourceLines.count;
+  }
+
+  uint8_t* code = ALLOCATE_ARRAY(vm, uint8_t, fn->code.count);
+  memcpy(code, fn->code.data, fn->code.count);
+
+  fn->code.data = code;
+  fn->code.capacity = fn->code.count;
+  fn->debug = debug;
+  fn->isShared = false;
+}
+
+void wrenFreeCodeImage(WrenCodeImage* image)
+{
+  for (int i = 0; i < image->numFns; i++)
+  {
+    ImageFn* fn = &image->fns[i];
+    for (int j = 0; j < fn->numConstants; j++)
+    {
+      imageAllocate(fn->constants[j].bytes, 0);
+    }
+    imageAllocate(fn->constants, 0);
+    imageAllocate(fn->code, 0);
+    imageAllocate(fn->debug.name, 0);
+    imageAllocate(fn->debug.sourceLines.data, 0);
+  }
+  imageAllocate(image->fns, 0);
+
+  for (int i = 0; i < image->numMethodNames; i++)
+  {
+    imageAllocate(image->methodNames[i].chars, 0);
+  }
+  imageAllocate(image->methodNames, 0);
+
+  for (int i = 0; i < image->numVariables; i++)
+  {
+    imageAllocate(image->variableNames[i].chars, 0);
+  }
+  imageAllocate(image->variableNames, 0);
+
+  imageAllocate(image->module, 0);
+  imageAllocate(image->source, 0);
+  imageAllocate(image, 0);
+}
+
+// Serialization ---------------------------------------------------------------
+
+// The first four bytes of every serialized image.
+static const char imageMagic[4] = { 'W', 'R', 'N', 'I' };
+
+// Tags for constants in a serialized image. Non-object values are stored by
+// kind rather than as raw [Value]s, since their representation depends on
+// WREN_NAN_TAGGING.
+typedef enum
+{
+  CONSTANT_TAG_NULL,
+  CONSTANT_TAG_FALSE,
+  CONSTANT_TAG_TRUE,
+  CONSTANT_TAG_NUM,
+  CONSTANT_TAG_STRING,
+  CONSTANT_TAG_FN
+} ConstantTag;
+
+// Marks a missing function name.
+#define NO_NAME UINT32_MAX
+
+typedef struct
+{
+  WrenWriteBytesFn write;
+  void* userData;
+
+  // A hash of everything written so far, appended at the end so that a
+  // corrupted cache file is rejected instead of run.
+  uint64_t checksum;
+} ImageWriter;
+
+static void writeBytes(ImageWriter* writer, const void* bytes, size_t length)
+{
+  writer->checksum = hashBytes(writer->checksum, bytes, length);
+  writer->write(writer->userData, bytes, length);
+}
+
+// Everything is written little-endian, a byte at a time, so images can be
+// read back on any host.
+static void writeInt(ImageWriter* writer, uint32_t value)
+{
+  uint8_t bytes[4];
+  for (int i = 0; i < 4; i++) bytes[i] = (uint8_t)(value >> (i * 8));
+  writeBytes(writer, bytes, 4);
+}
+
+static void writeLong(ImageWriter* writer, uint64_t value)
+{
+  writeInt(writer, (uint32_t)value);
+  writeInt(writer, (uint32_t)(value >> 32));
+}
+
+static void writeName(ImageWriter* writer, const char* chars, int length)
+{
+  writeInt(writer, (uint32_t)length);
+  writeBytes(writer, chars, length);
+}
+
+// Writes [name], which may be `NULL`.
+static void writeOptionalName(ImageWriter* writer, const char* name)
+{
+  if (name == NULL)
+  {
+    writeInt(writer, NO_NAME);
+  }
+  else
+  {
+    writeName(writer, name, (int)strlen(name));
+  }
+}
+
+static void writeNames(ImageWriter* writer, ImageName* names, int count)
+{
+  writeInt(writer, (uint32_t)count);
+  for (int i = 0; i < count; i++)
+  {
+    writeName(writer, names[i].chars, names[i].length);
+  }
+}
+
+static void writeConstant(ImageWriter* writer, ImageConstant* constant)
+{
+  uint8_t tag;
+  switch (constant->type)
+  {
+    case IMAGE_CONSTANT_STRING:
+      tag = CONSTANT_TAG_STRING;
+      writeBytes(writer, &tag, 1);
+      writeName(writer, constant->bytes, constant->length);
+      return;
+
+    case IMAGE_CONSTANT_FN:
+      tag = CONSTANT_TAG_FN;
+      writeBytes(writer, &tag, 1);
+      writeInt(writer, (uint32_t)constant->fn);
+      return;
+
+    case IMAGE_CONSTANT_VALUE:
+      break;
+  }
+
+  Value value = constant->value;
+  if (IS_NUM(value))
+  {
+    double number = AS_NUM(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+
+    tag = CONSTANT_TAG_NUM;
+    writeBytes(writer, &tag, 1);
+    writeLong(writer, bits);
+    return;
+  }
+
+  if (IS_NULL(value)) tag = CONSTANT_TAG_NULL;
+  else if (IS_FALSE(value)) tag = CONSTANT_TAG_FALSE;
+  else tag = CONSTANT_TAG_TRUE;
+  writeBytes(writer, &tag, 1);
+}
+
+void wrenSerializeImage(WrenCodeImage* image, WrenWriteBytesFn write,
+                        void* userData)
+{
+  ImageWriter writer = { write, userData, FNV_OFFSET_BASIS };
+
+  writeBytes(&writer, imageMagic, sizeof(imageMagic));
+  writeInt(&writer, WREN_IMAGE_VERSION);
+  writeInt(&writer, WREN_VERSION_NUMBER);
+  writeLong(&writer, image->sourceHash);
+  writeOptionalName(&writer, image->module);
+
+  writeNames(&writer, image->methodNames, image->numMethodNames);
+  writeNames(&writer, image->variableNames, image->numVariables);
+
+  writeInt(&writer, (uint32_t)image->numFns);
+  for (int i = 0; i < image->numFns; i++)
+  {
+    ImageFn* fn = &image->fns[i];
+
+    writeInt(&writer, (uint32_t)fn->codeCount);
+    writeBytes(&writer, fn->code, fn->codeCount);
+    writeInt(&writer, (uint32_t)fn->maxSlots);
+    writeInt(&writer, (uint32_t)fn->numUpvalues);
+    writeInt(&writer, (uint32_t)fn->arity);
+
+    writeOptionalName(&writer, fn->debug.name);
+
+    writeInt(&writer, (uint32_t)fn->debug.sourceLines.count);
+    for (int j = 0; j < fn->debug.sourceLines.count; j++)
+    {
+      writeInt(&writer, (uint32_t)fn->debug.sourceLines.data[j]);
+    }
+
+    writeInt(&writer, (uint32_t)fn->numConstants);
+    for (int j = 0; j < fn->numConstants; j++)
+    {
+      writeConstant(&writer, &fn->constants[j]);
+    }
+  }
+
+  // Not part of the checksum itself.
+  uint64_t checksum = writer.checksum;
+  writeLong(&writer, checksum);
+}
+
+typedef struct
+{
+  const uint8_t* bytes;
+  size_t size;
+  size_t position;
+
+  // Set once anything could not be read. Every read after that returns zeroes,
+  // so callers only need to check it at the end.
+  bool error;
+} ImageReader;
+
+static bool readBytes(ImageReader* reader, void* out, size_t length)
+{
+  if (length == 0) return !reader->error;
+
+  if (reader->error || length > reader->size - reader->position)
+  {
+    reader->error = true;
+    memset(out, 0, length);
+    return false;
+  }
+
+  memcpy(out, reader->bytes + reader->position, length);
+  reader->position += length;
+  return true;
+}
+
+static uint32_t readInt(ImageReader* reader)
+{
+  uint8_t bytes[4];
+  readBytes(reader, bytes, 4);
+
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) value |= (uint32_t)bytes[i] << (i * 8);
+  return value;
+}
+
+static uint64_t readLong(ImageReader* reader)
+{
+  uint64_t low = readInt(reader);
+  uint64_t high = readInt(reader);
+  return low | (high << 32);
+}
+
+// Reads a count of items that take at least [itemSize] bytes each, rejecting
+// counts the rest of the image could not possibly hold.
+static int readCount(ImageReader* reader, size_t itemSize)
+{
+  uint32_t count = readInt(reader);
+  if (reader->error) return 0;
+
+  if (count > INT32_MAX ||
+      (size_t)count > (reader->size - reader->position) / itemSize)
+  {
+    reader->error = true;
+    return 0;
+  }
+
+  return (int)count;
+}
+
+static char* readName(ImageReader* reader, int* length)
+{
+  *length = readCount(reader, 1);
+  if (reader->error) return NULL;
+
+  char* chars = (char*)imageAllocate(NULL, *length + 1);
+  readBytes(reader, chars, *length);
+  chars[*length] = '\0';
+  return chars;
+}
+
+// Reads a name written by [writeOptionalName].
+static char* readOptionalName(ImageReader* reader)
+{
+  uint32_t length = readInt(reader);
+  if (length == NO_NAME || reader->error) return NULL;
+
+  if (length > reader->size - reader->position)
+  {
+    reader->error = true;
+    return NULL;
+  }
+
+  char* chars = (char*)imageAllocate(NULL, length + 1);
+  readBytes(reader, chars, length);
+  chars[length] = '\0';
+  return chars;
+}
+
+static ImageName* readNames(ImageReader* reader, int* count)
+{
+  *count = readCount(reader, 4);
+  if (*count == 0) return NULL;
+
+  ImageName* names = (ImageName*)imageAllocate(NULL, sizeof(ImageName) * *count);
+  memset(names, 0, sizeof(ImageName) * *count);
+  for (int i = 0; i < *count; i++)
+  {
+    names[i].chars = readName(reader, &names[i].length);
+  }
+
+  return names;
+}
+
+static void readFn(ImageReader* reader, WrenCodeImage* image, int index)
+{
+  ImageFn* fn = &image->fns[index];
+
+  fn->codeCount = readCount(reader, 1);
+  fn->code = (uint8_t*)imageAllocate(NULL, fn->codeCount);
+  readBytes(reader, fn->code, fn->codeCount);
+
+  // Everything the interpreter walks ends with CODE_END.
+  if (fn->codeCount == 0 || fn->code[fn->codeCount - 1] != CODE_END)
+  {
+    reader->error = true;
+  }
+
+  fn->maxSlots = (int)readInt(reader);
+  fn->numUpvalues = (int)readInt(reader);
+  fn->arity = (int)readInt(reader);
+
+  fn->debug.name = readOptionalName(reader);
+
+  wrenIntBufferInit(&fn->debug.sourceLines);
+  int numLines = readCount(reader, 4);
+  if (numLines > 0)
+  {
+    fn->debug.sourceLines.data = (int*)imageAllocate(NULL,
+                                                     sizeof(int) * numLines);
+    fn->debug.sourceLines.count = numLines;
+    fn->debug.sourceLines.capacity = numLines;
+    for (int i = 0; i < numLines; i++)
+    {
+      fn->debug.sourceLines.data[i] = (int)readInt(reader);
+    }
+  }
+
+  // Stack traces index the line table by instruction offset.
+  if (numLines != fn->codeCount) reader->error = true;
+
+  fn->numConstants = readCount(reader, 1);
+  if (fn->numConstants == 0) return;
+
+  fn->constants = (ImageConstant*)imageAllocate(NULL,
+      sizeof(ImageConstant) * fn->numConstants);
+  memset(fn->constants, 0, sizeof(ImageConstant) * fn->numConstants);
+
+  for (int i = 0; i < fn->numConstants && !reader->error; i++)
+  {
+    ImageConstant* constant = &fn->constants[i];
+    uint8_t tag;
+    readBytes(reader, &tag, 1);
+
+    switch (tag)
+    {
+      case CONSTANT_TAG_NULL:
+        constant->type = IMAGE_CONSTANT_VALUE;
+        constant->value = NULL_VAL;
+        break;
+
+      case CONSTANT_TAG_FALSE:
+        constant->type = IMAGE_CONSTANT_VALUE;
+        constant->value = FALSE_VAL;
+        break;
+
+      case CONSTANT_TAG_TRUE:
+        constant->type = IMAGE_CONSTANT_VALUE;
+        constant->value = TRUE_VAL;
+        break;
+
+      case CONSTANT_TAG_NUM:
+      {
+        uint64_t bits = readLong(reader);
+        double number;
+        memcpy(&number, &bits, sizeof(number));
+        constant->type = IMAGE_CONSTANT_VALUE;
+        constant->value = NUM_VAL(number);
+        break;
+      }
+
+      case CONSTANT_TAG_STRING:
+        constant->type = IMAGE_CONSTANT_STRING;
+        constant->bytes = readName(reader, &constant->length);
+        break;
+
+      case CONSTANT_TAG_FN:
+        constant->type = IMAGE_CONSTANT_FN;
+        constant->fn = (int)readInt(reader);
+
+        // Nested functions always come after the function that contains
+        // them, which also rules out cycles.
+        if (constant->fn <= index || constant->fn >= image->numFns)
+        {
+          reader->error = true;
+        }
+        break;
+
+      default:
+        reader->error = true;
+        break;
+    }
+  }
+}
+
+WrenCodeImage* wrenDeserializeImage(const char* module, const char* source,
+                                    const void* bytes, size_t size)
+{
+  // Check the trailing checksum first, and then leave it out of the reader.
+  if (size < sizeof(uint64_t)) return NULL;
+  size -= sizeof(uint64_t);
+  ImageReader trailer = { (const uint8_t*)bytes, size + sizeof(uint64_t), size,
+                          false };
+  if (readLong(&trailer) != hashBytes(FNV_OFFSET_BASIS, bytes, size)) return NULL;
+
+  ImageReader reader = { (const uint8_t*)bytes, size, 0, false };
+
+  char magic[sizeof(imageMagic)];
+  readBytes(&reader, magic, sizeof(magic));
+  if (reader.error || memcmp(magic, imageMagic, sizeof(magic)) != 0) return NULL;
+
+  if (readInt(&reader) != WREN_IMAGE_VERSION) return NULL;
+  if (readInt(&reader) != WREN_VERSION_NUMBER) return NULL;
+
+  uint64_t sourceHash = hashSource(source);
+  if (readLong(&reader) != sourceHash) return NULL;
+
+  WrenCodeImage* image = (WrenCodeImage*)imageAllocate(NULL,
+                                                       sizeof(WrenCodeImage));
+  memset(image, 0, sizeof(WrenCodeImage));
+  image->source = copyBytes(source, (int)strlen(source));
+  image->sourceHash = sourceHash;
+
+  // A `NULL` [module] is the core module.
+  image->module = readOptionalName(&reader);
+  if (reader.error || (image->module == NULL) != (module == NULL) ||
+      (module != NULL && strcmp(image->module, module) != 0))
+  {
+    wrenFreeCodeImage(image);
+    return NULL;
+  }
+
+  image->methodNames = readNames(&reader, &image->numMethodNames);
+  image->variableNames = readNames(&reader, &image->numVariables);
+
+  int numFns = readCount(&reader, 1);
+  if (numFns > 0)
+  {
+    image->fns = (ImageFn*)imageAllocate(NULL, sizeof(ImageFn) * numFns);
+    memset(image->fns, 0, sizeof(ImageFn) * numFns);
+    image->numFns = numFns;
+  }
+
+  for (int i = 0; i < numFns && !reader.error; i++)
+  {
+    readFn(&reader, image, i);
+  }
+
+  if (reader.error || numFns == 0 || reader.position != reader.size)
+  {
+    wrenFreeCodeImage(image);
+    return NULL;
+  }
+
+  return image;
+}
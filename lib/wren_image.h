@@ -0,0 +1,100 @@
+#ifndef wren_image_h
+#define wren_image_h
+
+#include "wren_common.h"
+#include "wren_value.h"
+
+// A code image is a compiled module detached from any VM. Its bytecode and
+// debug info are allocated outside of every VM's heap and are only ever read
+// after the image is built, so any number of VMs, on any number of threads,
+// can run the same image at once. Each VM that loads the image gets its own
+// ObjFn headers and constant tables, which borrow the image's code (see
+// [ObjFn.isShared]). The GC neither marks nor frees the borrowed parts.
+//
+// Bytecode refers to methods and module variables by symbol, so an image can
+// only be loaded into a VM whose method and core variable symbol tables are a
+// prefix of the ones it was compiled against. That holds for any fresh VM.
+
+// The version of the serialized image format. This must be bumped whenever the
+// layout of an image or the meaning of the bytecode changes, which includes
+// adding, removing or reordering opcodes.
+#define WREN_IMAGE_VERSION 4
+
+typedef enum
+{
+  // A value that is not an object: null, a bool or a number.
+  IMAGE_CONSTANT_VALUE,
+
+  // A string constant.
+  IMAGE_CONSTANT_STRING,
+
+  // A nested function, stored as an index into [WrenCodeImage.fns].
+  IMAGE_CONSTANT_FN
+} ImageConstantType;
+
+typedef struct
+{
+  ImageConstantType type;
+  Value value;
+  char* bytes;
+  int length;
+  int fn;
+} ImageConstant;
+
+typedef struct
+{
+  uint8_t* code;
+  int codeCount;
+
+  ImageConstant* constants;
+  int numConstants;
+
+  int maxSlots;
+  int numUpvalues;
+  int arity;
+
+  // Shared with every ObjFn instantiated from this function.
+  FnDebug debug;
+} ImageFn;
+
+typedef struct
+{
+  char* chars;
+  int length;
+} ImageName;
+
+struct WrenCodeImage
+{
+  // The module the image was compiled as.
+  char* module;
+
+  // The original source, compiled instead of loading the image when a VM's
+  // symbol tables don't match.
+  char* source;
+
+  // A hash of [source], used to tell if a serialized image is stale.
+  uint64_t sourceHash;
+
+  // The method symbol table the bytecode was compiled against.
+  ImageName* methodNames;
+  int numMethodNames;
+
+  // The module's variables, including the implicitly imported core ones.
+  ImageName* variableNames;
+  int numVariables;
+
+  // Every function in the module. The module body is always the first.
+  ImageFn* fns;
+  int numFns;
+};
+
+// Instantiates [image] in [vm] as a new module and returns a closure for its
+// body, or `NULL` if [image] is not compatible with [vm] or the module has
+// already been loaded.
+ObjClosure* wrenLoadImage(WrenVM* vm, WrenCodeImage* image);
+
+// Replaces the bytecode and debug info [fn] borrows from an image with private
+// copies, so the VM can patch them.
+void wrenUnshareFunction(WrenVM* vm, ObjFn* fn);
+
+#endif
@@ -0,0 +1,1008 @@
+#include "wren_jit.h"
+
+#if WREN_JIT
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "wren_compiler.h"
+#include "wren_vm.h"
+
+// The size of the chunks of executable memory that machine code is allocated
+// from. A function too large for one gets a chunk of its own.
+#define JIT_CHUNK_SIZE (256 * 1024)
+
+// The general purpose registers, numbered as they are encoded.
+typedef enum
+{
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15
+} Register;
+
+// The machine code keeps the interpreter's state in registers that C functions
+// preserve, so it can call them without saving anything.
+#define REG_STACK_START RBX
+#define REG_CLOSURE     RBP
+#define REG_STACK_TOP   R12
+#define REG_FIBER       R13
+#define REG_VM          R14
+
+// Always holds QNAN, to tell numbers apart from other values.
+#define REG_QNAN        R15
+
+// The conditions of conditional jumps and SETcc. After UCOMISD, B, AE, BE and
+// A compare like unsigned integers, and P is set if either side is NaN.
+typedef enum
+{
+  CC_ALWAYS = -1,
+  CC_B = 0x2,
+  CC_AE = 0x3,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_BE = 0x6,
+  CC_A = 0x7,
+  CC_P = 0xa,
+  CC_NP = 0xb
+} Condition;
+
+// The opcodes of "op r/m64, r64" instructions.
+#define OP_ADD 0x01
+#define OP_OR  0x09
+#define OP_AND 0x21
+#define OP_SUB 0x29
+#define OP_CMP 0x39
+#define OP_MOV 0x89
+
+// The opcode extensions of "op r/m64, imm8" instructions.
+#define EXT_ADD 0
+#define EXT_SUB 5
+#define EXT_CMP 7
+
+// The opcodes of scalar double instructions.
+#define OP_ADDSD 0x0f58
+#define OP_MULSD 0x0f59
+#define OP_SUBSD 0x0f5c
+#define OP_DIVSD 0x0f5e
+
+typedef int (*JitEnterFn)(WrenVM* vm, ObjFiber* fiber, Value* stackStart,
+                          ObjClosure* closure, void* entry);
+
+// A mapping of executable memory. Its header is at the start of the mapping.
+typedef struct sJitChunk
+{
+  struct sJitChunk* next;
+  size_t size;
+} JitChunk;
+
+struct sJitArena
+{
+  // The chunks mapped so far, the one being filled first.
+  JitChunk* chunks;
+
+  // The unused end of the chunk being filled.
+  uint8_t* free;
+  uint8_t* end;
+
+  // Saves the registers C functions preserve, loads the interpreter's state
+  // into them, and jumps to an entry of a compiled function. The function
+  // returns from it with the offset of the instruction it stopped at.
+  JitEnterFn enter;
+};
+
+typedef struct
+{
+  WrenVM* vm;
+
+  // The function being compiled.
+  ObjFn* fn;
+
+  // The machine code so far. It only has jumps relative to itself and absolute
+  // addresses outside of it, so it can be copied anywhere once it is done.
+  ByteBuffer code;
+
+  // The offset in [code] of the machine code of each instruction in the
+  // bytecode, or -1 for offsets that don't start an instruction.
+  int* labels;
+
+  // Where in [code] the jumps to other instructions are, each followed by the
+  // offset of the instruction it jumps to.
+  IntBuffer jumps;
+
+  // Where in [code] the jumps that hand back to the interpreter are, each
+  // followed by the offset of the instruction the interpreter takes over at.
+  IntBuffer exits;
+} JitCompiler;
+
+// Machine code ----------------------------------------------------------------
+
+static void emitByte(JitCompiler* jit, int byte)
+{
+  wrenByteBufferWrite(jit->vm, &jit->code, (uint8_t)byte);
+}
+
+static void emitInt(JitCompiler* jit, uint32_t value)
+{
+  for (int i = 0; i < 32; i += 8) emitByte(jit, (value >> i) & 0xff);
+}
+
+// Stores the offset from the end of the 32-bit jump offset at [at] to [target]
+// in it.
+static void patchJump(JitCompiler* jit, int at, int target)
+{
+  uint32_t offset = (uint32_t)(target - (at + 4));
+  for (int i = 0; i < 4; i++)
+  {
+    jit->code.data[at + i] = (offset >> (i * 8)) & 0xff;
+  }
+}
+
+// Emits [prefix], if not zero, the REX prefix for [wide] operands and for
+// registers [reg] and [rm], if needed, then [opcode], which has two bytes if it
+// is above 0xff.
+static void emitOpcode(JitCompiler* jit, int prefix, bool wide, int opcode,
+                       int reg, int rm)
+{
+  if (prefix != 0) emitByte(jit, prefix);
+
+  int rex = (wide ? 8 : 0) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+  if (rex != 0) emitByte(jit, 0x40 | rex);
+
+  if (opcode > 0xff) emitByte(jit, opcode >> 8);
+  emitByte(jit, opcode & 0xff);
+}
+
+// Emits an instruction on register [reg] and register [rm]. For instructions
+// with an opcode extension, [reg] is the extension.
+static void emitRegister(JitCompiler* jit, int prefix, bool wide, int opcode,
+                         int reg, int rm)
+{
+  emitOpcode(jit, prefix, wide, opcode, reg, rm);
+  emitByte(jit, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// Emits an instruction on register [reg] and the memory [disp] bytes after the
+// address in register [base].
+static void emitMemory(JitCompiler* jit, int prefix, bool wide, int opcode,
+                       int reg, int base, int disp)
+{
+  emitOpcode(jit, prefix, wide, opcode, reg, base);
+
+  // RBP and R13 can't be a base without a displacement.
+  int mod = 2;
+  if (disp == 0 && (base & 7) != RBP) mod = 0;
+  else if (disp >= -128 && disp <= 127) mod = 1;
+
+  emitByte(jit, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+
+  // RSP and R12 can only be a base with a SIB byte.
+  if ((base & 7) == RSP) emitByte(jit, 0x24);
+
+  if (mod == 1) emitByte(jit, disp & 0xff);
+  if (mod == 2) emitInt(jit, (uint32_t)disp);
+}
+
+// mov [reg], [base + disp]
+static void load(JitCompiler* jit, int reg, int base, int disp)
+{
+  emitMemory(jit, 0, true, 0x8b, reg, base, disp);
+}
+
+// mov [base + disp], [reg]
+static void store(JitCompiler* jit, int base, int disp, int reg)
+{
+  emitMemory(jit, 0, true, 0x89, reg, base, disp);
+}
+
+// mov [reg], [value]
+static void loadConstant(JitCompiler* jit, int reg, uint64_t value)
+{
+  if (value <= UINT32_MAX)
+  {
+    // Writing the lower half of a register clears the upper one.
+    if (reg >= R8) emitByte(jit, 0x41);
+    emitByte(jit, 0xb8 | (reg & 7));
+    emitInt(jit, (uint32_t)value);
+    return;
+  }
+
+  emitByte(jit, 0x48 | ((reg & 8) >> 3));
+  emitByte(jit, 0xb8 | (reg & 7));
+  emitInt(jit, (uint32_t)value);
+  emitInt(jit, (uint32_t)(value >> 32));
+}
+
+// [op] [dst], [src]
+static void arithmetic(JitCompiler* jit, int opcode, int dst, int src)
+{
+  emitRegister(jit, 0, true, opcode, src, dst);
+}
+
+// [op] [reg], [value], where [value] fits in a byte.
+static void arithmeticConstant(JitCompiler* jit, int extension, int reg,
+                               int value)
+{
+  emitRegister(jit, 0, true, 0x83, extension, reg);
+  emitByte(jit, value);
+}
+
+// Pushes [reg] onto the fiber's stack.
+static void push(JitCompiler* jit, int reg)
+{
+  store(jit, REG_STACK_TOP, 0, reg);
+  arithmeticConstant(jit, EXT_ADD, REG_STACK_TOP, sizeof(Value));
+}
+
+// Drops [count] values from the top of the fiber's stack.
+static void drop(JitCompiler* jit, int count)
+{
+  arithmeticConstant(jit, EXT_SUB, REG_STACK_TOP,
+                     (int)(count * sizeof(Value)));
+}
+
+// Turns the object value in [reg] into a pointer to the object.
+static void untagObject(JitCompiler* jit, int reg)
+{
+  // Keep the bits below QNAN and the sign bit.
+  emitRegister(jit, 0, true, 0xc1, 4, reg);
+  emitByte(jit, 14);
+  emitRegister(jit, 0, true, 0xc1, 5, reg);
+  emitByte(jit, 14);
+}
+
+// movq [xmm], [reg]
+static void moveToDouble(JitCompiler* jit, int xmm, int reg)
+{
+  emitRegister(jit, 0x66, true, 0x0f6e, xmm, reg);
+}
+
+// movq [reg], [xmm]
+static void moveFromDouble(JitCompiler* jit, int reg, int xmm)
+{
+  emitRegister(jit, 0x66, true, 0x0f7e, xmm, reg);
+}
+
+// movsd [xmm], [base + disp]
+static void loadDouble(JitCompiler* jit, int xmm, int base, int disp)
+{
+  emitMemory(jit, 0xf2, false, 0x0f10, xmm, base, disp);
+}
+
+// [op] [dst], [src] on doubles.
+static void arithmeticDouble(JitCompiler* jit, int opcode, int dst, int src)
+{
+  emitRegister(jit, 0xf2, false, opcode, dst, src);
+}
+
+// ucomisd [a], [b]
+static void compareDouble(JitCompiler* jit, int a, int b)
+{
+  emitRegister(jit, 0x66, false, 0x0f2e, a, b);
+}
+
+// Sets the low byte of [reg], one of RAX to RBX, to whether [condition] holds.
+static void setIf(JitCompiler* jit, Condition condition, int reg)
+{
+  emitRegister(jit, 0, false, 0x0f90 | condition, 0, reg);
+}
+
+// Calls the C function at [address].
+static void callFunction(JitCompiler* jit, uint64_t address)
+{
+  loadConstant(jit, RAX, address);
+  emitRegister(jit, 0, false, 0xff, 2, RAX);
+}
+
+// Emits a jump if [condition] holds with a placeholder offset. Returns the
+// offset of the placeholder.
+static int emitJump(JitCompiler* jit, Condition condition)
+{
+  if (condition == CC_ALWAYS)
+  {
+    emitByte(jit, 0xe9);
+  }
+  else
+  {
+    emitByte(jit, 0x0f);
+    emitByte(jit, 0x80 | condition);
+  }
+
+  int at = jit->code.count;
+  emitInt(jit, 0);
+  return at;
+}
+
+// Makes the jump with the placeholder at [at] jump to the next code emitted.
+static void patchHere(JitCompiler* jit, int at)
+{
+  patchJump(jit, at, jit->code.count);
+}
+
+// Jumps to the instruction at [offset] if [condition] holds.
+static void jumpTo(JitCompiler* jit, Condition condition, int offset)
+{
+  wrenIntBufferWrite(jit->vm, &jit->jumps, emitJump(jit, condition));
+  wrenIntBufferWrite(jit->vm, &jit->jumps, offset);
+}
+
+// Hands back to the interpreter at the instruction at [offset] if [condition]
+// holds.
+static void exitTo(JitCompiler* jit, Condition condition, int offset)
+{
+  wrenIntBufferWrite(jit->vm, &jit->exits, emitJump(jit, condition));
+  wrenIntBufferWrite(jit->vm, &jit->exits, offset);
+}
+
+// Hands back to the interpreter at the instruction at [offset] unless [reg]
+// holds a number. Clobbers RCX.
+static void exitUnlessNumber(JitCompiler* jit, int reg, int offset)
+{
+  arithmetic(jit, OP_MOV, RCX, reg);
+  arithmetic(jit, OP_AND, RCX, REG_QNAN);
+  arithmetic(jit, OP_CMP, RCX, REG_QNAN);
+  exitTo(jit, CC_E, offset);
+}
+
+// Compares the value in RAX so that BE holds if it is falsy, and A if not.
+// Clobbers RAX.
+static void testFalsy(JitCompiler* jit)
+{
+  // Only null and false are falsy, and they are next to each other just after
+  // QNAN. Everything else ends up above them.
+  arithmetic(jit, OP_SUB, RAX, REG_QNAN);
+  arithmeticConstant(jit, EXT_SUB, RAX, TAG_NULL);
+  arithmeticConstant(jit, EXT_CMP, RAX, TAG_FALSE - TAG_NULL);
+}
+
+static void writeBarrier(WrenVM* vm, Obj* obj, Value value)
+{
+  wrenWriteBarrier(vm, obj, value);
+}
+
+static double modulo(double a, double b)
+{
+  return fmod(a, b);
+}
+
+// Runs the write barrier for storing the value in RAX into the object that RSI
+// points to, if the value is an object. Clobbers everything C functions may.
+static void emitWriteBarrier(JitCompiler* jit)
+{
+  loadConstant(jit, RCX, QNAN | SIGN_BIT);
+  arithmetic(jit, OP_MOV, RDX, RAX);
+  arithmetic(jit, OP_AND, RDX, RCX);
+  arithmetic(jit, OP_CMP, RDX, RCX);
+  int notObject = emitJump(jit, CC_NE);
+
+  store(jit, REG_FIBER, offsetof(ObjFiber, stackTop), REG_STACK_TOP);
+  arithmetic(jit, OP_MOV, RDI, REG_VM);
+  arithmetic(jit, OP_MOV, RDX, RAX);
+  callFunction(jit, (uint64_t)(uintptr_t)&writeBarrier);
+
+  patchHere(jit, notObject);
+}
+
+// Templates -------------------------------------------------------------------
+
+// Computes the next number of a range from the last one, the way
+// [iterateRange] in wren_vm.c does. Takes the last number in XMM0 and the start
+// and end of the range in XMM1 and XMM2, and leaves the next one in XMM0, or
+// jumps to the instruction at [done] if it is past the end. Whether the end
+// itself is included is left to the caller.
+//
+// The first number is always left to the interpreter, which also takes care of
+// empty ranges.
+static void nextInRange(JitCompiler* jit, int done)
+{
+  loadConstant(jit, RAX, NUM_VAL(1));
+  moveToDouble(jit, 3, RAX);
+
+  // Count up if the start is before the end.
+  compareDouble(jit, 2, 1);
+  int down = emitJump(jit, CC_BE);
+  arithmeticDouble(jit, OP_ADDSD, 0, 3);
+  compareDouble(jit, 0, 2);
+  jumpTo(jit, CC_A, done);
+  int counted = emitJump(jit, CC_ALWAYS);
+
+  patchHere(jit, down);
+  arithmeticDouble(jit, OP_SUBSD, 0, 3);
+  compareDouble(jit, 2, 0);
+  jumpTo(jit, CC_A, done);
+
+  patchHere(jit, counted);
+}
+
+// Jumps to the instruction at [done] if the number in XMM0 is the end of the
+// range, in XMM2.
+static void stopAtEnd(JitCompiler* jit, int done)
+{
+  compareDouble(jit, 0, 2);
+  int different = emitJump(jit, CC_P);
+  jumpTo(jit, CC_E, done);
+  patchHere(jit, different);
+}
+
+// Loads the two operands of a binary operator on numbers into XMM0 and XMM1,
+// or hands the instruction at [ip] back to the interpreter if they aren't
+// both numbers.
+static void loadNumberOperands(JitCompiler* jit, int ip)
+{
+  load(jit, RAX, REG_STACK_TOP, -2 * (int)sizeof(Value));
+  load(jit, RDX, REG_STACK_TOP, -(int)sizeof(Value));
+  exitUnlessNumber(jit, RAX, ip);
+  exitUnlessNumber(jit, RDX, ip);
+  moveToDouble(jit, 0, RAX);
+  moveToDouble(jit, 1, RDX);
+}
+
+// Replaces the two operands on the stack with the result in RAX.
+static void storeResult(JitCompiler* jit)
+{
+  store(jit, REG_STACK_TOP, -2 * (int)sizeof(Value), RAX);
+  drop(jit, 1);
+}
+
+// Compiles the instruction at [ip]. Returns false if it is left to the
+// interpreter.
+static bool compileInstruction(JitCompiler* jit, int ip)
+{
+  ObjFn* fn = jit->fn;
+  const uint8_t* bytecode = fn->code.data;
+  Code instruction = (Code)bytecode[ip];
+
+  #define ARG(n) (bytecode[ip + (n)])
+  #define SHORT_ARG(n) ((bytecode[ip + (n)] << 8) | bytecode[ip + (n) + 1])
+  #define LOCAL(slot) ((int)((slot) * sizeof(Value)))
+  #define FIELD(field)                                                         \
+      ((int)(offsetof(ObjInstance, fields) + (field) * sizeof(Value)))
+  #define UPVALUE(index)                                                       \
+      ((int)(offsetof(ObjClosure, upvalues) + (index) * sizeof(ObjUpvalue*)))
+
+  switch (instruction)
+  {
+    case CODE_LOAD_LOCAL_0:
+    case CODE_LOAD_LOCAL_1:
+    case CODE_LOAD_LOCAL_2:
+    case CODE_LOAD_LOCAL_3:
+    case CODE_LOAD_LOCAL_4:
+    case CODE_LOAD_LOCAL_5:
+    case CODE_LOAD_LOCAL_6:
+    case CODE_LOAD_LOCAL_7:
+    case CODE_LOAD_LOCAL_8:
+      load(jit, RAX, REG_STACK_START, LOCAL(instruction - CODE_LOAD_LOCAL_0));
+      push(jit, RAX);
+      return true;
+
+    case CODE_LOAD_LOCAL:
+      load(jit, RAX, REG_STACK_START, LOCAL(ARG(1)));
+      push(jit, RAX);
+      return true;
+
+    case CODE_LOAD_LOCALS:
+      // The second local may be the slot the first one is pushed into.
+      load(jit, RAX, REG_STACK_START, LOCAL(ARG(1)));
+      push(jit, RAX);
+      load(jit, RAX, REG_STACK_START, LOCAL(ARG(2)));
+      push(jit, RAX);
+      return true;
+
+    case CODE_STORE_LOCAL:
+      load(jit, RAX, REG_STACK_TOP, -(int)sizeof(Value));
+      store(jit, REG_STACK_START, LOCAL(ARG(1)), RAX);
+      return true;
+
+    case CODE_STORE_LOCAL_POP:
+      load(jit, RAX, REG_STACK_TOP, -(int)sizeof(Value));
+      store(jit, REG_STACK_START, LOCAL(ARG(1)), RAX);
+      drop(jit, 1);
+      return true;
+
+    case CODE_POP:
+      drop(jit, 1);
+      return true;
+
+    case CODE_NULL:
+    case CODE_FALSE:
+    case CODE_TRUE:
+    case CODE_CONSTANT:
+    {
+      Value value = NULL_VAL;
+      if (instruction == CODE_FALSE) value = FALSE_VAL;
+      if (instruction == CODE_TRUE) value = TRUE_VAL;
+      if (instruction == CODE_CONSTANT)
+      {
+        value = fn->constants.data[SHORT_ARG(1)];
+      }
+
+      // Constants are kept alive by the function and objects never move.
+      loadConstant(jit, RAX, value);
+      push(jit, RAX);
+      return true;
+    }
+
+    case CODE_LOAD_MODULE_VAR:
+      // The variables may be reallocated as more are defined.
+      loadConstant(jit, RAX, (uintptr_t)&fn->module->variables.data);
+      load(jit, RAX, RAX, 0);
+      load(jit, RAX, RAX, LOCAL(SHORT_ARG(1)));
+      push(jit, RAX);
+      return true;
+
+    case CODE_STORE_MODULE_VAR:
+      loadConstant(jit, RCX, (uintptr_t)&fn->module->variables.data);
+      load(jit, RCX, RCX, 0);
+      load(jit, RAX, REG_STACK_TOP, -(int)sizeof(Value));
+      store(jit, RCX, LOCAL(SHORT_ARG(1)), RAX);
+      loadConstant(jit, RSI, (uintptr_t)fn->module);
+      emitWriteBarrier(jit);
+      return true;
+
+    case CODE_LOAD_UPVALUE:
+      load(jit, RAX, REG_CLOSURE, UPVALUE(ARG(1)));
+      load(jit, RAX, RAX, offsetof(ObjUpvalue, value));
+      load(jit, RAX, RAX, 0);
+      push(jit, RAX);
+      return true;
+
+    case CODE_STORE_UPVALUE:
+      load(jit, RSI, REG_CLOSURE, UPVALUE(ARG(1)));
+      load(jit, RCX, RSI, offsetof(ObjUpvalue, value));
+      load(jit, RAX, REG_STACK_TOP, -(int)sizeof(Value));
+      store(jit, RCX, 0, RAX);
+      emitWriteBarrier(jit);
+      return true;
+
+    case CODE_LOAD_FIELD_THIS:
+      load(jit, RAX, REG_STACK_START, 0);
+      untagObject(jit, RAX);
+      load(jit, RAX, RAX, FIELD(ARG(1)));
+      push(jit, RAX);
+      return true;
+
+    case CODE_STORE_FIELD_THIS:
+    case CODE_STORE_FIELD_THIS_POP:
+      load(jit, RSI, REG_STACK_START, 0);
+      untagObject(jit, RSI);
+      load(jit, RAX, REG_STACK_TOP, -(int)sizeof(Value));
+      store(jit, RSI, FIELD(ARG(1)), RAX);
+      if (instruction == CODE_STORE_FIELD_THIS_POP) drop(jit, 1);
+      emitWriteBarrier(jit);
+      return true;
+
+    case CODE_LOAD_FIELD:
+      load(jit, RAX, REG_STACK_TOP, -(int)sizeof(Value));
+      untagObject(jit, RAX);
+      load(jit, RAX, RAX, FIELD(ARG(1)));
+      store(jit, REG_STACK_TOP, -(int)sizeof(Value), RAX);
+      return true;
+
+    case CODE_STORE_FIELD:
+      load(jit, RSI, REG_STACK_TOP, -(int)sizeof(Value));
+      untagObject(jit, RSI);
+      drop(jit, 1);
+      load(jit, RAX, REG_STACK_TOP, -(int)sizeof(Value));
+      store(jit, RSI, FIELD(ARG(1)), RAX);
+      emitWriteBarrier(jit);
+      return true;
+
+    case CODE_JUMP:
+      jumpTo(jit, CC_ALWAYS, ip + 3 + SHORT_ARG(1));
+      return true;
+
+    case CODE_LOOP:
+      jumpTo(jit, CC_ALWAYS, ip + 3 - SHORT_ARG(1));
+      return true;
+
+    case CODE_JUMP_IF:
+      load(jit, RAX, REG_STACK_TOP, -(int)sizeof(Value));
+      drop(jit, 1);
+      testFalsy(jit);
+      jumpTo(jit, CC_BE, ip + 3 + SHORT_ARG(1));
+      return true;
+
+    case CODE_AND:
+    case CODE_OR:
+      // Short-circuit with the condition left as the result, or discard it
+      // and evaluate the right hand side.
+      load(jit, RAX, REG_STACK_TOP, -(int)sizeof(Value));
+      testFalsy(jit);
+      jumpTo(jit, instruction == CODE_AND ? CC_BE : CC_A,
+             ip + 3 + SHORT_ARG(1));
+      drop(jit, 1);
+      return true;
+
+    case CODE_ADD:
+    case CODE_SUB:
+    case CODE_MUL:
+    case CODE_DIV:
+    case CODE_MOD:
+      loadNumberOperands(jit, ip);
+      switch (instruction)
+      {
+        case CODE_ADD: arithmeticDouble(jit, OP_ADDSD, 0, 1); break;
+        case CODE_SUB: arithmeticDouble(jit, OP_SUBSD, 0, 1); break;
+        case CODE_MUL: arithmeticDouble(jit, OP_MULSD, 0, 1); break;
+        case CODE_DIV: arithmeticDouble(jit, OP_DIVSD, 0, 1); break;
+        default:
+          callFunction(jit, (uint64_t)(uintptr_t)&modulo);
+          break;
+      }
+      moveFromDouble(jit, RAX, 0);
+      storeResult(jit);
+      return true;
+
+    case CODE_LT:
+    case CODE_GT:
+    case CODE_LTE:
+    case CODE_GTE:
+    case CODE_EQ:
+    case CODE_NEQ:
+      loadNumberOperands(jit, ip);
+      switch (instruction)
+      {
+        case CODE_LT:  compareDouble(jit, 1, 0); setIf(jit, CC_A, RAX);  break;
+        case CODE_GT:  compareDouble(jit, 0, 1); setIf(jit, CC_A, RAX);  break;
+        case CODE_LTE: compareDouble(jit, 1, 0); setIf(jit, CC_AE, RAX); break;
+        case CODE_GTE: compareDouble(jit, 0, 1); setIf(jit, CC_AE, RAX); break;
+
+        case CODE_EQ:
+          compareDouble(jit, 0, 1);
+          setIf(jit, CC_E, RAX);
+          setIf(jit, CC_NP, RCX);
+          emitRegister(jit, 0, false, 0x20, RCX, RAX);
+          break;
+
+        default:
+          compareDouble(jit, 0, 1);
+          setIf(jit, CC_NE, RAX);
+          setIf(jit, CC_P, RCX);
+          emitRegister(jit, 0, false, 0x08, RCX, RAX);
+          break;
+      }
+
+      // false and true are next to each other.
+      emitRegister(jit, 0, false, 0x0fb6, RAX, RAX);
+      loadConstant(jit, RCX, FALSE_VAL);
+      arithmetic(jit, OP_ADD, RAX, RCX);
+      storeResult(jit);
+      return true;
+
+    case CODE_LT_JUMP_IF:
+    case CODE_GT_JUMP_IF:
+    case CODE_LTE_JUMP_IF:
+    case CODE_GTE_JUMP_IF:
+    case CODE_EQ_JUMP_IF:
+    case CODE_NEQ_JUMP_IF:
+    {
+      // Do the JUMP_IF that follows too, and skip it.
+      int next = ip + 6;
+      int done = next + SHORT_ARG(4);
+
+      loadNumberOperands(jit, ip);
+      drop(jit, 2);
+      switch (instruction)
+      {
+        case CODE_LT_JUMP_IF:
+          compareDouble(jit, 1, 0);
+          jumpTo(jit, CC_BE, done);
+          break;
+
+        case CODE_GT_JUMP_IF:
+          compareDouble(jit, 0, 1);
+          jumpTo(jit, CC_BE, done);
+          break;
+
+        case CODE_LTE_JUMP_IF:
+          compareDouble(jit, 1, 0);
+          jumpTo(jit, CC_B, done);
+          break;
+
+        case CODE_GTE_JUMP_IF:
+          compareDouble(jit, 0, 1);
+          jumpTo(jit, CC_B, done);
+          break;
+
+        case CODE_EQ_JUMP_IF:
+          compareDouble(jit, 0, 1);
+          jumpTo(jit, CC_NE, done);
+          jumpTo(jit, CC_P, done);
+          break;
+
+        default:
+          compareDouble(jit, 0, 1);
+          jumpTo(jit, CC_P, next);
+          jumpTo(jit, CC_E, done);
+          break;
+      }
+      jumpTo(jit, CC_ALWAYS, next);
+      return true;
+    }
+
+    case CODE_FOR_RANGE:
+    {
+      int slot = ARG(1);
+      bool isInclusive = ARG(2);
+      int done = ip + 5 + SHORT_ARG(3);
+
+      load(jit, RAX, REG_STACK_START, LOCAL(slot + 2));
+      exitUnlessNumber(jit, RAX, ip);
+      moveToDouble(jit, 0, RAX);
+      loadDouble(jit, 1, REG_STACK_START, LOCAL(slot));
+      loadDouble(jit, 2, REG_STACK_START, LOCAL(slot + 1));
+
+      nextInRange(jit, done);
+      if (!isInclusive) stopAtEnd(jit, done);
+
+      moveFromDouble(jit, RAX, 0);
+      store(jit, REG_STACK_START, LOCAL(slot + 2), RAX);
+      push(jit, RAX);
+      return true;
+    }
+
+    case CODE_FOR_ITERATE:
+    {
+      // Like the interpreter, do the STORE_LOCAL, JUMP_IF and
+      // FOR_ITERATOR_VALUE that follow too for a range.
+      if (bytecode[ip + 5] != CODE_STORE_LOCAL ||
+          bytecode[ip + 7] != CODE_JUMP_IF ||
+          bytecode[ip + 10] != CODE_FOR_ITERATOR_VALUE)
+      {
+        return false;
+      }
+
+      int iterator = ARG(2);
+      int done = ip + 10 + SHORT_ARG(8);
+
+      load(jit, RSI, REG_STACK_START, LOCAL(ARG(1)));
+      loadConstant(jit, RCX, QNAN | SIGN_BIT);
+      arithmetic(jit, OP_MOV, RDX, RSI);
+      arithmetic(jit, OP_AND, RDX, RCX);
+      arithmetic(jit, OP_CMP, RDX, RCX);
+      exitTo(jit, CC_NE, ip);
+      untagObject(jit, RSI);
+
+      emitMemory(jit, 0, false, 0x83, 7, RSI, offsetof(Obj, type));
+      emitByte(jit, OBJ_RANGE);
+      exitTo(jit, CC_NE, ip);
+
+      load(jit, RDX, REG_STACK_START, LOCAL(iterator));
+      exitUnlessNumber(jit, RDX, ip);
+      moveToDouble(jit, 0, RDX);
+      loadDouble(jit, 1, RSI, offsetof(ObjRange, from));
+      loadDouble(jit, 2, RSI, offsetof(ObjRange, to));
+
+      nextInRange(jit, done);
+
+      emitMemory(jit, 0, false, 0x80, 7, RSI, offsetof(ObjRange, isInclusive));
+      emitByte(jit, 0);
+      int inclusive = emitJump(jit, CC_NE);
+      stopAtEnd(jit, done);
+      patchHere(jit, inclusive);
+
+      moveFromDouble(jit, RAX, 0);
+      store(jit, REG_STACK_START, LOCAL(iterator), RAX);
+      push(jit, RAX);
+      jumpTo(jit, CC_ALWAYS, ip + 15);
+      return true;
+    }
+
+    default:
+      // Calls, returns, and everything that may allocate or fail.
+      return false;
+  }
+
+  #undef ARG
+  #undef SHORT_ARG
+  #undef LOCAL
+  #undef FIELD
+  #undef UPVALUE
+}
+
+// Restores the registers saved by [JitArena.enter] and returns from it.
+static void emitEpilogue(JitCompiler* jit)
+{
+  store(jit, REG_FIBER, offsetof(ObjFiber, stackTop), REG_STACK_TOP);
+  arithmeticConstant(jit, EXT_ADD, RSP, 8);
+
+  static const int saved[] = { R15, R14, R13, R12, RBP, RBX };
+  for (int i = 0; i < 6; i++)
+  {
+    if (saved[i] >= R8) emitByte(jit, 0x41);
+    emitByte(jit, 0x58 | (saved[i] & 7));
+  }
+  emitByte(jit, 0xc3);
+}
+
+static void emitEnter(JitCompiler* jit)
+{
+  static const int saved[] = { RBX, RBP, R12, R13, R14, R15 };
+  for (int i = 0; i < 6; i++)
+  {
+    if (saved[i] >= R8) emitByte(jit, 0x41);
+    emitByte(jit, 0x50 | (saved[i] & 7));
+  }
+
+  // Keep the stack aligned for calling C functions.
+  arithmeticConstant(jit, EXT_SUB, RSP, 8);
+
+  arithmetic(jit, OP_MOV, REG_VM, RDI);
+  arithmetic(jit, OP_MOV, REG_FIBER, RSI);
+  arithmetic(jit, OP_MOV, REG_STACK_START, RDX);
+  arithmetic(jit, OP_MOV, REG_CLOSURE, RCX);
+  load(jit, REG_STACK_TOP, REG_FIBER, offsetof(ObjFiber, stackTop));
+  loadConstant(jit, REG_QNAN, QNAN);
+
+  // jmp r8
+  emitRegister(jit, 0, false, 0xff, 4, R8);
+}
+
+// Executable memory -----------------------------------------------------------
+
+// Copies [code] into executable memory. Returns where it went, or `NULL` if
+// no memory could be mapped.
+static uint8_t* install(JitArena* arena, ByteBuffer* code)
+{
+  size_t size = ((size_t)code->count + 15) & ~(size_t)15;
+
+  if (arena->chunks == NULL || (size_t)(arena->end - arena->free) < size)
+  {
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t chunkSize = size + sizeof(JitChunk) + 15;
+    if (chunkSize < JIT_CHUNK_SIZE) chunkSize = JIT_CHUNK_SIZE;
+    chunkSize = (chunkSize + pageSize - 1) / pageSize * pageSize;
+
+    void* memory = mmap(NULL, chunkSize, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return NULL;
+
+    JitChunk* chunk = (JitChunk*)memory;
+    chunk->next = arena->chunks;
+    chunk->size = chunkSize;
+    arena->chunks = chunk;
+    arena->free = (uint8_t*)memory +
+                  ((sizeof(JitChunk) + 15) & ~(size_t)15);
+    arena->end = (uint8_t*)memory + chunkSize;
+  }
+
+  // The chunk is only writable while the code is copied in.
+  JitChunk* chunk = arena->chunks;
+  if (mprotect(chunk, chunk->size, PROT_READ | PROT_WRITE) != 0) return NULL;
+  memcpy(arena->free, code->data, code->count);
+  if (mprotect(chunk, chunk->size, PROT_READ | PROT_EXEC) != 0) return NULL;
+
+  uint8_t* start = arena->free;
+  arena->free += size;
+  return start;
+}
+
+// Sets up the executable memory of [vm] and its entry code. Returns false if it
+// couldn't be.
+static bool initArena(WrenVM* vm)
+{
+  JitArena* arena = ALLOCATE(vm, JitArena);
+  arena->chunks = NULL;
+  arena->free = NULL;
+  arena->end = NULL;
+  arena->enter = NULL;
+  vm->jit = arena;
+
+  JitCompiler jit;
+  jit.vm = vm;
+  jit.fn = NULL;
+  wrenByteBufferInit(&jit.code);
+  emitEnter(&jit);
+  uint8_t* enter = install(arena, &jit.code);
+  wrenByteBufferClear(vm, &jit.code);
+
+  if (enter == NULL) return false;
+
+  // Converting a data pointer to a function pointer is what a JIT is for.
+  memcpy(&arena->enter, &enter, sizeof(enter));
+  return true;
+}
+
+void wrenJitCompile(WrenVM* vm, ObjFn* fn)
+{
+  if (vm->jit == NULL && !initArena(vm)) return;
+  if (vm->jit->enter == NULL) return;
+
+  JitCompiler jit;
+  jit.vm = vm;
+  jit.fn = fn;
+  wrenByteBufferInit(&jit.code);
+  wrenIntBufferInit(&jit.jumps);
+  wrenIntBufferInit(&jit.exits);
+
+  int count = fn->code.count;
+  jit.labels = ALLOCATE_ARRAY(vm, int, count);
+  bool* isCompiled = ALLOCATE_ARRAY(vm, bool, count);
+  for (int ip = 0; ip < count; ip++)
+  {
+    jit.labels[ip] = -1;
+    isCompiled[ip] = false;
+  }
+
+  for (int ip = 0; ip < count; ip += wrenInstructionLength(fn, ip))
+  {
+    jit.labels[ip] = jit.code.count;
+    isCompiled[ip] = compileInstruction(&jit, ip);
+    if (!isCompiled[ip]) exitTo(&jit, CC_ALWAYS, ip);
+  }
+
+  int epilogue = jit.code.count;
+  emitEpilogue(&jit);
+
+  // Each instruction the interpreter takes over at gets one exit that tells it
+  // where, shared by every jump to it.
+  int* exits = ALLOCATE_ARRAY(vm, int, count);
+  for (int ip = 0; ip < count; ip++) exits[ip] = -1;
+
+  for (int i = 0; i < jit.exits.count; i += 2)
+  {
+    int offset = jit.exits.data[i + 1];
+    if (exits[offset] == -1)
+    {
+      exits[offset] = jit.code.count;
+      loadConstant(&jit, RAX, (uint64_t)offset);
+      patchJump(&jit, emitJump(&jit, CC_ALWAYS), epilogue);
+    }
+    patchJump(&jit, jit.exits.data[i], exits[offset]);
+  }
+
+  bool isValid = true;
+  for (int i = 0; i < jit.jumps.count; i += 2)
+  {
+    int target = jit.jumps.data[i + 1];
+    if (target < 0 || target >= count || jit.labels[target] == -1)
+    {
+      isValid = false;
+      break;
+    }
+    patchJump(&jit, jit.jumps.data[i], jit.labels[target]);
+  }
+
+  uint8_t* code = isValid ? install(vm->jit, &jit.code) : NULL;
+  if (code != NULL)
+  {
+    void** entries = ALLOCATE_ARRAY(vm, void*, count);
+    for (int ip = 0; ip < count; ip++)
+    {
+      entries[ip] = isCompiled[ip] ? code + jit.labels[ip] : NULL;
+    }
+    fn->jitEntries = entries;
+  }
+
+  DEALLOCATE(vm, exits);
+  DEALLOCATE(vm, isCompiled);
+  DEALLOCATE(vm, jit.labels);
+  wrenIntBufferClear(vm, &jit.exits);
+  wrenIntBufferClear(vm, &jit.jumps);
+  wrenByteBufferClear(vm, &jit.code);
+}
+
+int wrenJitRun(WrenVM* vm, ObjFiber* fiber, Value* stackStart,
+               ObjClosure* closure, void* entry)
+{
+  return vm->jit->enter(vm, fiber, stackStart, closure, entry);
+}
+
+void wrenJitFree(WrenVM* vm)
+{
+  if (vm->jit == NULL) return;
+
+  JitChunk* chunk = vm->jit->chunks;
+  while (chunk != NULL)
+  {
+    JitChunk* next = chunk->next;
+    munmap(chunk, chunk->size);
+    chunk = next;
+  }
+
+  DEALLOCATE(vm, vm->jit);
+  vm->jit = NULL;
+}
+
+#endif
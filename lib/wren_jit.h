@@ -0,0 +1,47 @@
+#ifndef wren_jit_h
+#define wren_jit_h
+
+#include "wren.h"
+#include "wren_common.h"
+#include "wren_value.h"
+
+// A baseline JIT that translates the bytecode of hot functions to x86-64
+// machine code, one template of instructions per opcode.
+//
+// The machine code works on the same fiber stack and call frames as the
+// interpreter, and every instruction of a compiled function keeps its own
+// entry point. So the interpreter can hand a function over to the machine code
+// at any instruction, and the machine code hands it back at the first one it
+// can't do by itself: method calls, returns, and anything that may fail or
+// allocate. The interpreter runs that instruction, then enters the machine code
+// again after calls, returns, and backward jumps.
+//
+// Only instructions that touch nothing but the stack, fields, upvalues, module
+// variables, and numbers are compiled. The operators on numbers are, but fall
+// back to the interpreter, and so to the operator method, for anything else.
+//
+// Each VM has its own executable memory, so functions compiled by one are never
+// run by another, which leaves threads nothing to share.
+
+// The executable memory that a VM's machine code is allocated from.
+typedef struct sJitArena JitArena;
+
+#if WREN_JIT
+
+// Compiles [fn] to machine code, setting [fn->jitEntries]. Leaves [fn] to the
+// interpreter if it can't be compiled.
+void wrenJitCompile(WrenVM* vm, ObjFn* fn);
+
+// Runs the machine code at [entry], one of the [jitEntries] of the function
+// in the top call frame of [fiber], which starts at [stackStart] and runs
+// [closure]. Returns the offset of the instruction where the interpreter
+// takes over again.
+int wrenJitRun(WrenVM* vm, ObjFiber* fiber, Value* stackStart,
+               ObjClosure* closure, void* entry);
+
+// Frees the machine code of every function of [vm].
+void wrenJitFree(WrenVM* vm);
+
+#endif
+
+#endif
@@ -117,6 +117,22 @@ OPCODE(SUPER_14, -14)
 OPCODE(SUPER_15, -15)
 OPCODE(SUPER_16, -16)
 
+// Arithmetic and comparison operators. If both operands are numbers, these
+// compute the result directly instead of calling the Num method. Otherwise
+// they call the operator method with symbol [arg] like CALL_1 does, which is
+// why they take the same arguments.
+OPCODE(ADD, -1)
+OPCODE(SUB, -1)
+OPCODE(MUL, -1)
+OPCODE(DIV, -1)
+OPCODE(MOD, -1)
+OPCODE(LT, -1)
+OPCODE(GT, -1)
+OPCODE(LTE, -1)
+OPCODE(GTE, -1)
+OPCODE(EQ, -1)
+OPCODE(NEQ, -1)
+
 // Jump the instruction pointer [arg] forward.
 OPCODE(JUMP, 0)
 
@@ -134,6 +150,25 @@ OPCODE(AND, -1)
 // and continue.
 OPCODE(OR, -1)
 
+// Counts through a range literal in a for loop. The start and end of the range
+// are in local slot [arg1] and the one after it, and the last number counted
+// is in the slot after that, or null before the first. If [arg2] is 1, the
+// end is included. Pushes the next number and stores it as the last one, or
+// if there is none, jumps [arg3] forward.
+OPCODE(FOR_RANGE, 1)
+
+// Calls iterate(_) on the sequence in local slot [arg1] with the iterator in
+// local slot [arg2], the way LOAD_LOCAL, LOAD_LOCAL and CALL_1 with symbol
+// [arg3] would. If the sequence is a Range, iterates it directly instead and
+// also does the work of the STORE_LOCAL, JUMP_IF and FOR_ITERATOR_VALUE that
+// always follow this instruction, skipping over them.
+OPCODE(FOR_ITERATE, 1)
+
+// Calls iteratorValue(_) on the sequence in local slot [arg1] with the
+// iterator in local slot [arg2], the way LOAD_LOCAL, LOAD_LOCAL and CALL_1
+// with symbol [arg3] would.
+OPCODE(FOR_ITERATOR_VALUE, 1)
+
 // Close the upvalue for the local on the top of the stack, then pop it.
 OPCODE(CLOSE_UPVALUE, -1)
 
@@ -212,6 +247,36 @@ OPCODE(IMPORT_MODULE, 1)
 // variable's value.
 OPCODE(IMPORT_VARIABLE, 1)
 
+// The following superinstructions are never emitted directly. They are fused
+// from common pairs of the instructions above by the pass that optimizes a
+// function once it has been compiled.
+
+// Stores the top of stack in local slot [arg] and pops it.
+OPCODE(STORE_LOCAL_POP, -1)
+
+// Stores the top of stack in field slot [arg] of the receiver of the current
+// function and pops it.
+OPCODE(STORE_FIELD_THIS_POP, -1)
+
+// Pushes the values in local slot [arg1] and then local slot [arg2].
+OPCODE(LOAD_LOCALS, 2)
+
+// Pushes the value in local slot [arg1], then invokes the method with symbol
+// [arg2] like CALL_0 and CALL_1 do.
+OPCODE(LOAD_LOCAL_CALL_0, 1)
+OPCODE(LOAD_LOCAL_CALL_1, 0)
+
+// A comparison that is always followed by a JUMP_IF. If both operands are
+// numbers, these compare them and perform the jump too. Otherwise they call
+// the operator method like the plain comparisons do and leave the result for
+// the JUMP_IF.
+OPCODE(LT_JUMP_IF, -1)
+OPCODE(GT_JUMP_IF, -1)
+OPCODE(LTE_JUMP_IF, -1)
+OPCODE(GTE_JUMP_IF, -1)
+OPCODE(EQ_JUMP_IF, -1)
+OPCODE(NEQ_JUMP_IF, -1)
+
 // This pseudo-instruction indicates the end of the bytecode. It should
 // always be preceded by a `CODE_RETURN`, so is never actually executed.
 OPCODE(END, 0)
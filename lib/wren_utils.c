@@ -9,12 +9,28 @@ DEFINE_BUFFER(String, ObjString*);
 
 void wrenSymbolTableInit(SymbolTable* symbols)
 {
-  wrenStringBufferInit(symbols);
+  symbols->data = NULL;
+  symbols->count = 0;
+  symbols->capacity = 0;
+  symbols->slots = NULL;
+  symbols->slotCapacity = 0;
 }
 
 void wrenSymbolTableClear(WrenVM* vm, SymbolTable* symbols)
 {
-  wrenStringBufferClear(vm, symbols);
+  wrenReallocate(vm, symbols->data, 0, 0);
+  wrenReallocate(vm, symbols->slots, 0, 0);
+  wrenSymbolTableInit(symbols);
+}
+
+// Adds the name at [index] in [symbols] to its hash index.
+static void indexSymbol(SymbolTable* symbols, int index)
+{
+  uint32_t mask = (uint32_t)symbols->slotCapacity - 1;
+  uint32_t slot = symbols->data[index]->hash & mask;
+  while (symbols->slots[slot] != 0) slot = (slot + 1) & mask;
+
+  symbols->slots[slot] = index + 1;
 }
 
 int wrenSymbolTableAdd(WrenVM* vm, SymbolTable* symbols,
@@ -23,7 +39,33 @@ int wrenSymbolTableAdd(WrenVM* vm, SymbolTable* symbols,
   ObjString* symbol = AS_STRING(wrenNewStringLength(vm, name, length));
   
   wrenPushRoot(vm, &symbol->obj);
-  wrenStringBufferWrite(vm, symbols, symbol);
+
+  if (symbols->capacity < symbols->count + 1)
+  {
+    int capacity = wrenPowerOf2Ceil(symbols->count + 1);
+    symbols->data = (ObjString**)wrenReallocate(vm, symbols->data,
+        symbols->capacity * sizeof(ObjString*), capacity * sizeof(ObjString*));
+    symbols->capacity = capacity;
+  }
+  symbols->data[symbols->count++] = symbol;
+
+  if (symbols->count * 2 > symbols->slotCapacity)
+  {
+    // Rebuilt in order, so that of two equal names the first is still found.
+    int slotCapacity = symbols->slotCapacity == 0 ? 16
+                                                  : symbols->slotCapacity * 2;
+    symbols->slots = (int*)wrenReallocate(vm, symbols->slots,
+        symbols->slotCapacity * sizeof(int), slotCapacity * sizeof(int));
+    symbols->slotCapacity = slotCapacity;
+    memset(symbols->slots, 0, slotCapacity * sizeof(int));
+
+    for (int i = 0; i < symbols->count; i++) indexSymbol(symbols, i);
+  }
+  else
+  {
+    indexSymbol(symbols, symbols->count - 1);
+  }
+
   wrenPopRoot(vm);
   
   return symbols->count - 1;
@@ -43,14 +85,21 @@ int wrenSymbolTableEnsure(WrenVM* vm, SymbolTable* symbols,
 int wrenSymbolTableFind(const SymbolTable* symbols,
                         const char* name, size_t length)
 {
-  // See if the symbol is already defined.
-  // TODO: O(n). Do something better.
-  for (int i = 0; i < symbols->count; i++)
+  if (symbols->slotCapacity == 0) return -1;
+
+  uint32_t hash = wrenHashBytes(name, length);
+  uint32_t mask = (uint32_t)symbols->slotCapacity - 1;
+  for (uint32_t slot = hash & mask; ; slot = (slot + 1) & mask)
   {
-    if (wrenStringEqualsCString(symbols->data[i], name, length)) return i;
-  }
+    int index = symbols->slots[slot] - 1;
+    if (index == -1) return -1;
 
-  return -1;
+    ObjString* symbol = symbols->data[index];
+    if (symbol->hash == hash && wrenStringEqualsCString(symbol, name, length))
+    {
+      return index;
+    }
+  }
 }
 
 void wrenBlackenSymbolTable(WrenVM* vm, SymbolTable* symbolTable)
@@ -61,7 +110,8 @@ void wrenBlackenSymbolTable(WrenVM* vm, SymbolTable* symbolTable)
   }
   
   // Keep track of how much memory is still in use.
-  vm->bytesAllocated += symbolTable->capacity * sizeof(*symbolTable->data);
+  vm->bytesAllocated += symbolTable->capacity * sizeof(*symbolTable->data) +
+                        symbolTable->slotCapacity * sizeof(int);
 }
 
 int wrenUtf8EncodeNumBytes(int value)
@@ -67,8 +67,21 @@ DECLARE_BUFFER(Byte, uint8_t);
 DECLARE_BUFFER(Int, int);
 DECLARE_BUFFER(String, ObjString*);
 
-// TODO: Change this to use a map.
-typedef StringBuffer SymbolTable;
+// A list of names, each known by its index, with a hash index over them so
+// that finding a name doesn't have to compare it with every other one.
+typedef struct
+{
+  ObjString** data;
+  int count;
+  int capacity;
+
+  // Open addressing with linear probing, starting from the name's hash. Each
+  // slot holds an index into [data] plus one, or zero if it is empty. Its size
+  // is a power of two that is kept at least twice [count], and a table starts
+  // without one until its first name is added.
+  int* slots;
+  int slotCapacity;
+} SymbolTable;
 
 // Initializes the symbol table.
 void wrenSymbolTableInit(SymbolTable* symbols);
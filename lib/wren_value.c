@@ -11,6 +11,11 @@
   #include "wren_debug.h"
 #endif
 
+#if WREN_PARALLEL_MARK
+  #include <pthread.h>
+  #include <stdlib.h>
+#endif
+
 // TODO: Tune these.
 // The initial (and minimum) capacity of a non-empty list or map object.
 #define MIN_CAPACITY 16
@@ -32,15 +37,26 @@
 #define INITIAL_CALL_FRAMES 4
 
 DEFINE_BUFFER(Value, Value);
-DEFINE_BUFFER(Method, Method);
+DEFINE_BUFFER(MethodEntry, MethodEntry);
 
 static void initObj(WrenVM* vm, Obj* obj, ObjType type, ObjClass* classObj)
 {
   obj->type = type;
   obj->isDark = false;
+  obj->isRemembered = false;
   obj->classObj = classObj;
-  obj->next = vm->first;
-  vm->first = obj;
+
+  obj->isYoung = wrenAllocatesYoung(vm);
+  if (obj->isYoung)
+  {
+    obj->next = vm->young;
+    vm->young = obj;
+  }
+  else
+  {
+    obj->next = vm->first;
+    vm->first = obj;
+  }
 }
 
 ObjClass* wrenNewSingleClass(WrenVM* vm, int numFields, ObjString* name)
@@ -52,13 +68,113 @@ ObjClass* wrenNewSingleClass(WrenVM* vm, int numFields, ObjString* name)
   classObj->name = name;
   classObj->attributes = NULL_VAL;
 
-  wrenPushRoot(vm, (Obj*)classObj);
-  wrenMethodBufferInit(&classObj->methods);
-  wrenPopRoot(vm);
+  classObj->methodBase = 0;
+  wrenIntBufferInit(&classObj->methodSymbols);
 
   return classObj;
 }
 
+// Returns `true` if the method table entry at [index] belongs to no class.
+static bool methodEntryFree(WrenVM* vm, int index)
+{
+  if (index < 0) return false;
+  return index >= vm->methods.count || vm->methods.data[index].owner == NULL;
+}
+
+// Returns `true` if the symbols of [classObj] from the [from]th on all land on
+// empty entries when its row starts at [base].
+static bool methodRowFits(WrenVM* vm, ObjClass* classObj, int base, int from)
+{
+  for (int i = from; i < classObj->methodSymbols.count; i++)
+  {
+    if (!methodEntryFree(vm, base + classObj->methodSymbols.data[i]))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Gives the symbols of [classObj] from the [placed]th on entries in the method
+// table. If one of them is taken by another class, the whole row moves to the
+// first place where it fits.
+static void placeMethods(WrenVM* vm, ObjClass* classObj, int placed)
+{
+  int base = classObj->methodBase;
+  int lowest = classObj->methodSymbols.data[0];
+  int highest = lowest;
+  for (int i = 1; i < classObj->methodSymbols.count; i++)
+  {
+    int symbol = classObj->methodSymbols.data[i];
+    if (symbol < lowest) lowest = symbol;
+    if (symbol > highest) highest = symbol;
+  }
+
+  if (!methodRowFits(vm, classObj, base, placed))
+  {
+    // Every entry before [methodsFree] is taken, so the lowest symbol can't
+    // land before it.
+    base = vm->methodsFree - lowest;
+    while (!methodRowFits(vm, classObj, base, 0)) base++;
+  }
+
+  if (base + highest >= vm->methods.count)
+  {
+    MethodEntry empty;
+    empty.owner = NULL;
+    empty.method.type = METHOD_NONE;
+    wrenMethodEntryBufferFill(vm, &vm->methods, empty,
+                              base + highest - vm->methods.count + 1);
+  }
+
+  MethodEntry* entries = vm->methods.data;
+  int* symbols = classObj->methodSymbols.data;
+  if (base != classObj->methodBase)
+  {
+    for (int i = 0; i < placed; i++)
+    {
+      MethodEntry* from = &entries[classObj->methodBase + symbols[i]];
+      entries[base + symbols[i]] = *from;
+      from->owner = NULL;
+      from->method.type = METHOD_NONE;
+
+      int index = (int)(from - entries);
+      if (index < vm->methodsFree) vm->methodsFree = index;
+    }
+
+    classObj->methodBase = base;
+  }
+
+  for (int i = placed; i < classObj->methodSymbols.count; i++)
+  {
+    entries[base + symbols[i]].owner = classObj;
+  }
+
+  while (vm->methodsFree < vm->methods.count &&
+         entries[vm->methodsFree].owner != NULL)
+  {
+    vm->methodsFree++;
+  }
+}
+
+// Empties the entries of [classObj] in the method table.
+static void freeMethods(WrenVM* vm, ObjClass* classObj)
+{
+  for (int i = 0; i < classObj->methodSymbols.count; i++)
+  {
+    int symbol = classObj->methodSymbols.data[i];
+    if (wrenFindMethod(vm, classObj, symbol) == NULL) continue;
+
+    int index = classObj->methodBase + symbol;
+    vm->methods.data[index].owner = NULL;
+    vm->methods.data[index].method.type = METHOD_NONE;
+    if (index < vm->methodsFree) vm->methodsFree = index;
+  }
+
+  wrenIntBufferClear(vm, &classObj->methodSymbols);
+}
+
 void wrenBindSuperclass(WrenVM* vm, ObjClass* subclass, ObjClass* superclass)
 {
   ASSERT(superclass != NULL, "Must have superclass.");
@@ -76,10 +192,28 @@ void wrenBindSuperclass(WrenVM* vm, ObjClass* subclass, ObjClass* superclass)
            "A foreign class cannot inherit from a class with fields.");
   }
 
-  // Inherit methods from its superclass.
-  for (int i = 0; i < superclass->methods.count; i++)
+  // Inherit methods from its superclass. Make room for all of them at once so
+  // that the row doesn't move for each one.
+  int placed = subclass->methodSymbols.count;
+  for (int i = 0; i < superclass->methodSymbols.count; i++)
   {
-    wrenBindMethod(vm, subclass, i, superclass->methods.data[i]);
+    int symbol = superclass->methodSymbols.data[i];
+    if (wrenFindMethod(vm, subclass, symbol) == NULL)
+    {
+      wrenIntBufferWrite(vm, &subclass->methodSymbols, symbol);
+    }
+  }
+
+  if (subclass->methodSymbols.count > placed)
+  {
+    placeMethods(vm, subclass, placed);
+  }
+
+  for (int i = 0; i < superclass->methodSymbols.count; i++)
+  {
+    int symbol = superclass->methodSymbols.data[i];
+    wrenBindMethod(vm, subclass, symbol,
+                   *wrenFindMethod(vm, superclass, symbol));
   }
 }
 
@@ -119,16 +253,20 @@ ObjClass* wrenNewClass(WrenVM* vm, ObjClass* superclass, int numFields,
 
 void wrenBindMethod(WrenVM* vm, ObjClass* classObj, int symbol, Method method)
 {
-  // Make sure the buffer is big enough to contain the symbol's index.
-  if (symbol >= classObj->methods.count)
+  Method* entry = wrenFindMethod(vm, classObj, symbol);
+  if (entry == NULL)
   {
-    Method noMethod;
-    noMethod.type = METHOD_NONE;
-    wrenMethodBufferFill(vm, &classObj->methods, noMethod,
-                         symbol - classObj->methods.count + 1);
+    int placed = classObj->methodSymbols.count;
+    wrenIntBufferWrite(vm, &classObj->methodSymbols, symbol);
+    placeMethods(vm, classObj, placed);
+    entry = wrenFindMethod(vm, classObj, symbol);
   }
 
-  classObj->methods.data[symbol] = method;
+  *entry = method;
+  if (method.type == METHOD_BLOCK)
+  {
+    wrenWriteBarrier(vm, &classObj->obj, OBJ_VAL(method.as.closure));
+  }
 }
 
 ObjClosure* wrenNewClosure(WrenVM* vm, ObjFn* fn)
@@ -257,10 +395,35 @@ ObjFn* wrenNewFunction(WrenVM* vm, ObjModule* module, int maxSlots)
   fn->numUpvalues = 0;
   fn->arity = 0;
   fn->debug = debug;
+  fn->isShared = false;
+  fn->jitCountdown = vm->config.jitThreshold;
+  fn->jitEntries = NULL;
   
   return fn;
 }
 
+ObjFn* wrenNewSharedFunction(WrenVM* vm, ObjModule* module, int maxSlots,
+                             uint8_t* code, int codeCount, FnDebug* debug)
+{
+  ObjFn* fn = ALLOCATE(vm, ObjFn);
+  initObj(vm, &fn->obj, OBJ_FN, vm->fnClass);
+
+  wrenValueBufferInit(&fn->constants);
+  fn->code.data = code;
+  fn->code.count = codeCount;
+  fn->code.capacity = codeCount;
+  fn->module = module;
+  fn->maxSlots = maxSlots;
+  fn->numUpvalues = 0;
+  fn->arity = 0;
+  fn->debug = debug;
+  fn->isShared = true;
+  fn->jitCountdown = vm->config.jitThreshold;
+  fn->jitEntries = NULL;
+
+  return fn;
+}
+
 void wrenFunctionBindName(WrenVM* vm, ObjFn* fn, const char* name, int length)
 {
   fn->debug->name = ALLOCATE_ARRAY(vm, char, length + 1);
@@ -318,6 +481,7 @@ void wrenListInsert(WrenVM* vm, ObjList* list, Value value, uint32_t index)
 
   // Store the new element.
   list->elements.data[index] = value;
+  wrenWriteBarrier(vm, &list->obj, value);
 }
 
 int wrenListIndexOf(WrenVM* vm, ObjList* list, Value value)
@@ -596,6 +760,9 @@ void wrenMapSet(WrenVM* vm, ObjMap* map, Value key, Value value)
     // A new key was added.
     map->count++;
   }
+
+  wrenWriteBarrier(vm, &map->obj, key);
+  wrenWriteBarrier(vm, &map->obj, value);
 }
 
 void wrenMapClear(WrenVM* vm, ObjMap* map)
@@ -686,22 +853,27 @@ static ObjString* allocateString(WrenVM* vm, size_t length)
   return string;
 }
 
-// Calculates and stores the hash code for [string].
-static void hashString(ObjString* string)
+uint32_t wrenHashBytes(const char* bytes, size_t length)
 {
   // FNV-1a hash. See: http://www.isthe.com/chongo/tech/comp/fnv/
   uint32_t hash = 2166136261u;
 
-  // This is O(n) on the length of the string, but we only call this when a new
-  // string is created. Since the creation is also O(n) (to copy/initialize all
-  // the bytes), we allow this here.
-  for (uint32_t i = 0; i < string->length; i++)
+  for (size_t i = 0; i < length; i++)
   {
-    hash ^= string->value[i];
+    hash ^= bytes[i];
     hash *= 16777619;
   }
 
-  string->hash = hash;
+  return hash;
+}
+
+// Calculates and stores the hash code for [string].
+static void hashString(ObjString* string)
+{
+  // This is O(n) on the length of the string, but we only call this when a new
+  // string is created. Since the creation is also O(n) (to copy/initialize all
+  // the bytes), we allow this here.
+  string->hash = wrenHashBytes(string->value, string->length);
 }
 
 Value wrenNewString(WrenVM* vm, const char* text)
@@ -973,13 +1145,92 @@ ObjUpvalue* wrenNewUpvalue(WrenVM* vm, Value* value)
   return upvalue;
 }
 
+#if WREN_PARALLEL_MARK
+
+typedef struct ParallelMark ParallelMark;
+
+// One of the threads taking part in a parallel mark.
+typedef struct
+{
+  ParallelMark* mark;
+
+  // The objects this thread has marked and not yet blackened. Markers don't
+  // allocate through the VM, whose allocator may not be thread-safe.
+  Obj** gray;
+  int grayCount;
+  int grayCapacity;
+
+  // The size of the objects this thread has blackened.
+  size_t bytesAllocated;
+} Marker;
+
+struct ParallelMark
+{
+  WrenVM* vm;
+
+  pthread_mutex_t lock;
+
+  // Signaled when work is shared or the mark is done.
+  pthread_cond_t changed;
+
+  // Gray objects given up by busy markers for idle ones to take.
+  Obj** shared;
+  int sharedCount;
+  int sharedCapacity;
+
+  // The number of markers running, and how many of them are waiting for work.
+  // When they all are, there is nothing left to mark.
+  int numMarkers;
+  int idle;
+  bool done;
+};
+
+// The marker of the current thread, if it is taking part in a parallel mark.
+static __thread Marker* currentMarker = NULL;
+
+// Adds [obj] to the gray stack of [marker].
+static void pushGray(Marker* marker, Obj* obj)
+{
+  if (marker->grayCount >= marker->grayCapacity)
+  {
+    marker->grayCapacity = marker->grayCapacity == 0
+        ? 256 : marker->grayCapacity * 2;
+    marker->gray = (Obj**)realloc(marker->gray,
+                                  marker->grayCapacity * sizeof(Obj*));
+  }
+
+  marker->gray[marker->grayCount++] = obj;
+}
+
+static void markerGray(Marker* marker, Obj* obj)
+{
+  // Several markers may reach the same object. Only the first one to set the
+  // mark goes on to blacken it.
+  if (__atomic_exchange_n(&obj->isDark, true, __ATOMIC_ACQ_REL)) return;
+
+  pushGray(marker, obj);
+}
+#endif
+
 void wrenGrayObj(WrenVM* vm, Obj* obj)
 {
   if (obj == NULL) return;
 
+#if WREN_PARALLEL_MARK
+  if (currentMarker != NULL)
+  {
+    markerGray(currentMarker, obj);
+    return;
+  }
+#endif
+
   // Stop if the object is already darkened so we don't get stuck in a cycle.
   if (obj->isDark) return;
 
+  // A minor collection takes every old object to be alive. The ones that may
+  // refer to young objects are traced from the remembered set instead.
+  if (vm->collectingYoung && !obj->isYoung) return;
+
   // It's been reached.
   obj->isDark = true;
 
@@ -1019,21 +1270,19 @@ static void blackenClass(WrenVM* vm, ObjClass* classObj)
   wrenGrayObj(vm, (Obj*)classObj->superclass);
 
   // Method function objects.
-  for (int i = 0; i < classObj->methods.count; i++)
+  for (int i = 0; i < classObj->methodSymbols.count; i++)
   {
-    if (classObj->methods.data[i].type == METHOD_BLOCK)
+    Method* method = wrenFindMethod(vm, classObj,
+                                    classObj->methodSymbols.data[i]);
+    if (method != NULL && method->type == METHOD_BLOCK)
     {
-      wrenGrayObj(vm, (Obj*)classObj->methods.data[i].as.closure);
+      wrenGrayObj(vm, (Obj*)method->as.closure);
     }
   }
 
   wrenGrayObj(vm, (Obj*)classObj->name);
 
   if(!IS_NULL(classObj->attributes)) wrenGrayObj(vm, AS_OBJ(classObj->attributes));
-
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjClass);
-  vm->bytesAllocated += classObj->methods.capacity * sizeof(Method);
 }
 
 static void blackenClosure(WrenVM* vm, ObjClosure* closure)
@@ -1046,10 +1295,6 @@ static void blackenClosure(WrenVM* vm, ObjClosure* closure)
   {
     wrenGrayObj(vm, (Obj*)closure->upvalues[i]);
   }
-
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjClosure);
-  vm->bytesAllocated += sizeof(ObjUpvalue*) * closure->fn->numUpvalues;
 }
 
 static void blackenFiber(WrenVM* vm, ObjFiber* fiber)
@@ -1077,35 +1322,12 @@ static void blackenFiber(WrenVM* vm, ObjFiber* fiber)
   // The caller.
   wrenGrayObj(vm, (Obj*)fiber->caller);
   wrenGrayValue(vm, fiber->error);
-
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjFiber);
-  vm->bytesAllocated += fiber->frameCapacity * sizeof(CallFrame);
-  vm->bytesAllocated += fiber->stackCapacity * sizeof(Value);
 }
 
 static void blackenFn(WrenVM* vm, ObjFn* fn)
 {
   // Mark the constants.
   wrenGrayBuffer(vm, &fn->constants);
-
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjFn);
-  vm->bytesAllocated += sizeof(uint8_t) * fn->code.capacity;
-  vm->bytesAllocated += sizeof(Value) * fn->constants.capacity;
-  
-  // The debug line number buffer.
-  vm->bytesAllocated += sizeof(int) * fn->code.capacity;
-  // TODO: What about the function name?
-}
-
-static void blackenForeign(WrenVM* vm, ObjForeign* foreign)
-{
-  // TODO: Keep track of how much memory the foreign object uses. We can store
-  // this in each foreign object, but it will balloon the size. We may not want
-  // that much overhead. One option would be to let the foreign class register
-  // a C function that returns a size for the object. That way the VM doesn't
-  // always have to explicitly store it.
 }
 
 static void blackenInstance(WrenVM* vm, ObjInstance* instance)
@@ -1117,20 +1339,12 @@ static void blackenInstance(WrenVM* vm, ObjInstance* instance)
   {
     wrenGrayValue(vm, instance->fields[i]);
   }
-
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjInstance);
-  vm->bytesAllocated += sizeof(Value) * instance->obj.classObj->numFields;
 }
 
 static void blackenList(WrenVM* vm, ObjList* list)
 {
   // Mark the elements.
   wrenGrayBuffer(vm, &list->elements);
-
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjList);
-  vm->bytesAllocated += sizeof(Value) * list->elements.capacity;
 }
 
 static void blackenMap(WrenVM* vm, ObjMap* map)
@@ -1144,10 +1358,6 @@ static void blackenMap(WrenVM* vm, ObjMap* map)
     wrenGrayValue(vm, entry->key);
     wrenGrayValue(vm, entry->value);
   }
-
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjMap);
-  vm->bytesAllocated += sizeof(MapEntry) * map->capacity;
 }
 
 static void blackenModule(WrenVM* vm, ObjModule* module)
@@ -1161,30 +1371,79 @@ static void blackenModule(WrenVM* vm, ObjModule* module)
   wrenBlackenSymbolTable(vm, &module->variableNames);
 
   wrenGrayObj(vm, (Obj*)module->name);
-
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjModule);
 }
 
-static void blackenRange(WrenVM* vm, ObjRange* range)
+static void blackenUpvalue(WrenVM* vm, ObjUpvalue* upvalue)
 {
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjRange);
+  // Mark the closed-over object (in case it is closed).
+  wrenGrayValue(vm, upvalue->closed);
 }
 
-static void blackenString(WrenVM* vm, ObjString* string)
+size_t wrenObjectSize(Obj* obj)
 {
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjString) + string->length + 1;
-}
+  switch (obj->type)
+  {
+    case OBJ_CLASS:
+      // Its share of the method table as well as its list of symbols.
+      return sizeof(ObjClass) +
+             ((ObjClass*)obj)->methodSymbols.capacity * sizeof(int) +
+             ((ObjClass*)obj)->methodSymbols.count * sizeof(MethodEntry);
 
-static void blackenUpvalue(WrenVM* vm, ObjUpvalue* upvalue)
-{
-  // Mark the closed-over object (in case it is closed).
-  wrenGrayValue(vm, upvalue->closed);
+    case OBJ_CLOSURE:
+      return sizeof(ObjClosure) +
+             sizeof(ObjUpvalue*) * ((ObjClosure*)obj)->fn->numUpvalues;
 
-  // Keep track of how much memory is still in use.
-  vm->bytesAllocated += sizeof(ObjUpvalue);
+    case OBJ_FIBER:
+    {
+      ObjFiber* fiber = (ObjFiber*)obj;
+      return sizeof(ObjFiber) +
+             fiber->frameCapacity * sizeof(CallFrame) +
+             fiber->stackCapacity * sizeof(Value);
+    }
+
+    case OBJ_FN:
+    {
+      ObjFn* fn = (ObjFn*)obj;
+      size_t size = sizeof(ObjFn) + sizeof(Value) * fn->constants.capacity;
+      if (fn->jitEntries != NULL)
+      {
+        size += sizeof(void*) * fn->code.count;
+      }
+
+      // Shared code belongs to the image, not to this VM's heap.
+      if (fn->isShared) return size;
+
+      // The code and the debug line number buffer.
+      // TODO: What about the function name?
+      return size + (sizeof(uint8_t) + sizeof(int)) * fn->code.capacity;
+    }
+
+    case OBJ_FOREIGN:
+      // TODO: Keep track of how much memory the foreign object uses. We can
+      // store this in each foreign object, but it will balloon the size. We
+      // may not want that much overhead. One option would be to let the
+      // foreign class register a C function that returns a size for the
+      // object. That way the VM doesn't always have to explicitly store it.
+      return 0;
+
+    case OBJ_INSTANCE:
+      return sizeof(ObjInstance) +
+             sizeof(Value) * obj->classObj->numFields;
+
+    case OBJ_LIST:
+      return sizeof(ObjList) +
+             sizeof(Value) * ((ObjList*)obj)->elements.capacity;
+
+    case OBJ_MAP:
+      return sizeof(ObjMap) + sizeof(MapEntry) * ((ObjMap*)obj)->capacity;
+
+    case OBJ_MODULE:   return sizeof(ObjModule);
+    case OBJ_RANGE:    return sizeof(ObjRange);
+    case OBJ_STRING:   return sizeof(ObjString) + ((ObjString*)obj)->length + 1;
+    case OBJ_UPVALUE:  return sizeof(ObjUpvalue);
+  }
+
+  return 0;
 }
 
 static void blackenObject(WrenVM* vm, Obj* obj)
@@ -1195,6 +1454,16 @@ static void blackenObject(WrenVM* vm, Obj* obj)
   printf(" @ %p\n", obj);
 #endif
 
+  // Keep track of how much memory is still in use.
+#if WREN_PARALLEL_MARK
+  if (currentMarker != NULL)
+  {
+    currentMarker->bytesAllocated += wrenObjectSize(obj);
+  }
+  else
+#endif
+  vm->bytesAllocated += wrenObjectSize(obj);
+
   // Traverse the object's fields.
   switch (obj->type)
   {
@@ -1202,17 +1471,33 @@ static void blackenObject(WrenVM* vm, Obj* obj)
     case OBJ_CLOSURE:  blackenClosure( vm, (ObjClosure*) obj); break;
     case OBJ_FIBER:    blackenFiber(   vm, (ObjFiber*)   obj); break;
     case OBJ_FN:       blackenFn(      vm, (ObjFn*)      obj); break;
-    case OBJ_FOREIGN:  blackenForeign( vm, (ObjForeign*) obj); break;
+    case OBJ_FOREIGN:  break;
     case OBJ_INSTANCE: blackenInstance(vm, (ObjInstance*)obj); break;
     case OBJ_LIST:     blackenList(    vm, (ObjList*)    obj); break;
     case OBJ_MAP:      blackenMap(     vm, (ObjMap*)     obj); break;
     case OBJ_MODULE:   blackenModule(  vm, (ObjModule*)  obj); break;
-    case OBJ_RANGE:    blackenRange(   vm, (ObjRange*)   obj); break;
-    case OBJ_STRING:   blackenString(  vm, (ObjString*)  obj); break;
+    case OBJ_RANGE:    break;
+    case OBJ_STRING:   break;
     case OBJ_UPVALUE:  blackenUpvalue( vm, (ObjUpvalue*) obj); break;
   }
 }
 
+void wrenGrayReferences(WrenVM* vm, Obj* obj)
+{
+  // The value of an open upvalue lives on the stack of a fiber that may not
+  // have run since, so it has to be reached through the upvalue.
+  if (obj->type == OBJ_UPVALUE)
+  {
+    wrenGrayValue(vm, *((ObjUpvalue*)obj)->value);
+    return;
+  }
+
+  // Only the objects the collection reaches count towards the heap.
+  size_t bytesAllocated = vm->bytesAllocated;
+  blackenObject(vm, obj);
+  vm->bytesAllocated = bytesAllocated;
+}
+
 void wrenBlackenObjects(WrenVM* vm)
 {
   while (vm->grayCount > 0)
@@ -1223,6 +1508,162 @@ void wrenBlackenObjects(WrenVM* vm)
   }
 }
 
+#if WREN_PARALLEL_MARK
+// Waits until there is shared work for [marker] and moves some of it to its
+// own stack. Returns false once every marker is waiting, which means the
+// whole heap has been marked.
+static bool takeWork(Marker* marker)
+{
+  ParallelMark* mark = marker->mark;
+  pthread_mutex_lock(&mark->lock);
+
+  __atomic_add_fetch(&mark->idle, 1, __ATOMIC_RELAXED);
+  while (mark->sharedCount == 0 && !mark->done)
+  {
+    if (mark->idle == mark->numMarkers)
+    {
+      mark->done = true;
+      pthread_cond_broadcast(&mark->changed);
+      break;
+    }
+
+    pthread_cond_wait(&mark->changed, &mark->lock);
+  }
+  __atomic_sub_fetch(&mark->idle, 1, __ATOMIC_RELAXED);
+
+  if (mark->done)
+  {
+    pthread_mutex_unlock(&mark->lock);
+    return false;
+  }
+
+  // Take half, so that other idle markers get some too.
+  int count = (mark->sharedCount + 1) / 2;
+  for (int i = 0; i < count; i++)
+  {
+    pushGray(marker, mark->shared[--mark->sharedCount]);
+  }
+
+  pthread_mutex_unlock(&mark->lock);
+  return true;
+}
+
+// Gives half of the gray stack of [marker] to the markers that are waiting.
+static void shareWork(Marker* marker)
+{
+  ParallelMark* mark = marker->mark;
+  pthread_mutex_lock(&mark->lock);
+
+  int count = marker->grayCount / 2;
+  if (mark->sharedCount + count > mark->sharedCapacity)
+  {
+    mark->sharedCapacity = (mark->sharedCount + count) * 2;
+    mark->shared = (Obj**)realloc(mark->shared,
+                                  mark->sharedCapacity * sizeof(Obj*));
+  }
+
+  marker->grayCount -= count;
+  memcpy(mark->shared + mark->sharedCount, marker->gray + marker->grayCount,
+         count * sizeof(Obj*));
+  mark->sharedCount += count;
+
+  pthread_cond_broadcast(&mark->changed);
+  pthread_mutex_unlock(&mark->lock);
+}
+
+static void* runMarker(void* data)
+{
+  Marker* marker = (Marker*)data;
+  ParallelMark* mark = marker->mark;
+  currentMarker = marker;
+
+  while (takeWork(marker))
+  {
+    while (marker->grayCount > 0)
+    {
+      Obj* obj = marker->gray[--marker->grayCount];
+      blackenObject(mark->vm, obj);
+
+      if (marker->grayCount > 1 &&
+          __atomic_load_n(&mark->idle, __ATOMIC_RELAXED) > 0)
+      {
+        shareWork(marker);
+      }
+    }
+  }
+
+  currentMarker = NULL;
+  return NULL;
+}
+
+void wrenBlackenObjectsParallel(WrenVM* vm, int numThreads)
+{
+  Marker* markers = (Marker*)calloc(numThreads, sizeof(Marker));
+  pthread_t* threads = (pthread_t*)calloc(numThreads, sizeof(pthread_t));
+  Obj** shared = (Obj**)malloc((vm->grayCount + 1) * sizeof(Obj*));
+  if (markers == NULL || threads == NULL || shared == NULL)
+  {
+    free(markers);
+    free(threads);
+    free(shared);
+    wrenBlackenObjects(vm);
+    return;
+  }
+
+  ParallelMark mark;
+  mark.vm = vm;
+  pthread_mutex_init(&mark.lock, NULL);
+  pthread_cond_init(&mark.changed, NULL);
+  mark.numMarkers = 1;
+  mark.idle = 0;
+  mark.done = false;
+
+  // The roots grayed so far are the first work to share out.
+  memcpy(shared, vm->gray, vm->grayCount * sizeof(Obj*));
+  mark.shared = shared;
+  mark.sharedCount = vm->grayCount;
+  mark.sharedCapacity = vm->grayCount + 1;
+  vm->grayCount = 0;
+
+  for (int i = 0; i < numThreads; i++) markers[i].mark = &mark;
+
+  // The calling thread is the first marker. The others join as they start.
+  int started = 0;
+  for (int i = 1; i < numThreads; i++)
+  {
+    pthread_mutex_lock(&mark.lock);
+    mark.numMarkers++;
+    pthread_mutex_unlock(&mark.lock);
+
+    if (pthread_create(&threads[started], NULL, runMarker, &markers[i]) != 0)
+    {
+      pthread_mutex_lock(&mark.lock);
+      mark.numMarkers--;
+      pthread_cond_broadcast(&mark.changed);
+      pthread_mutex_unlock(&mark.lock);
+      break;
+    }
+    started++;
+  }
+
+  runMarker(&markers[0]);
+
+  for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+  for (int i = 0; i < numThreads; i++)
+  {
+    vm->bytesAllocated += markers[i].bytesAllocated;
+    free(markers[i].gray);
+  }
+
+  pthread_cond_destroy(&mark.changed);
+  pthread_mutex_destroy(&mark.lock);
+  free(mark.shared);
+  free(threads);
+  free(markers);
+}
+#endif
+
 void wrenFreeObj(WrenVM* vm, Obj* obj)
 {
 #if WREN_DEBUG_TRACE_MEMORY
@@ -1234,7 +1675,7 @@ void wrenFreeObj(WrenVM* vm, Obj* obj)
   switch (obj->type)
   {
     case OBJ_CLASS:
-      wrenMethodBufferClear(vm, &((ObjClass*)obj)->methods);
+      freeMethods(vm, (ObjClass*)obj);
       break;
 
     case OBJ_FIBER:
@@ -1249,6 +1690,9 @@ void wrenFreeObj(WrenVM* vm, Obj* obj)
     {
       ObjFn* fn = (ObjFn*)obj;
       wrenValueBufferClear(vm, &fn->constants);
+      DEALLOCATE(vm, fn->jitEntries);
+      if (fn->isShared) break;
+
       wrenByteBufferClear(vm, &fn->code);
       wrenIntBufferClear(vm, &fn->debug->sourceLines);
       DEALLOCATE(vm, fn->debug->name);
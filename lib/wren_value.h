@@ -111,6 +111,13 @@ struct sObj
   ObjType type;
   bool isDark;
 
+  // Whether the object was allocated inside a region and has not survived a
+  // collection yet. See [wrenBeginRegion].
+  bool isYoung;
+
+  // Whether the object is in [WrenVM.remembered].
+  bool isRemembered;
+
   // The object's class.
   ObjClass* classObj;
 
@@ -265,6 +272,19 @@ typedef struct
   // only be set for fns, and not ObjFns that represent methods or scripts.
   int arity;
   FnDebug* debug;
+
+  // If true, [code] and [debug] are borrowed from a shared code image and are
+  // never written, freed or counted by this VM. See wren_image.h.
+  bool isShared;
+
+  // The calls and loop iterations left before the function is compiled to
+  // machine code, or zero if it won't be. See wren_jit.h.
+  int jitCountdown;
+
+  // The machine code of each instruction in [code], indexed by its offset, or
+  // `NULL` for instructions left to the interpreter. `NULL` itself until the
+  // function is compiled.
+  void** jitEntries;
 } ObjFn;
 
 // An instance of a first-class function and the environment it has closed over.
@@ -387,7 +407,15 @@ typedef struct
   } as;
 } Method;
 
-DECLARE_BUFFER(Method, Method);
+// An entry in the VM's method table, which holds the methods of every class.
+// An empty entry has no [owner].
+typedef struct
+{
+  ObjClass* owner;
+  Method method;
+} MethodEntry;
+
+DECLARE_BUFFER(MethodEntry, MethodEntry);
 
 struct sObjClass
 {
@@ -398,21 +426,28 @@ struct sObjClass
   // of its superclass fields.
   int numFields;
 
-  // The table of methods that are defined in or inherited by this class.
-  // Methods are called by symbol, and the symbol directly maps to an index in
-  // this table. This makes method calls fast at the expense of empty cells in
-  // the list for methods the class doesn't support.
+  // The methods that are defined in or inherited by this class live in the
+  // VM's method table. Methods are called by symbol, and the method for a
+  // symbol is at [methodBase] plus the symbol if this class owns that entry.
   //
-  // You can think of it as a hash table that never has collisions but has a
-  // really low load factor. Since methods are pretty small (just a type and a
-  // pointer), this should be a worthwhile trade-off.
-  MethodBuffer methods;
+  // Giving every class its own array indexed by symbol would leave most of it
+  // empty, since a class only has a few of all the symbols. Instead, the rows
+  // of all classes are shifted so that they fit into each other's gaps, which
+  // keeps the lookup a single indexed load.
+  int methodBase;
+
+  // The symbols this class has methods for, in the order they were bound.
+  IntBuffer methodSymbols;
 
   // The name of the class.
   ObjString* name;
   
   // The ClassAttribute for the class, if any
   Value attributes;
+
+  // Where [wrenGetClassStats] counts the instances of the class.
+  size_t statsCount;
+  size_t statsBytes;
 };
 
 typedef struct
@@ -668,6 +703,11 @@ ObjForeign* wrenNewForeign(WrenVM* vm, ObjClass* classObj, size_t size);
 // constants, etc. added to it.
 ObjFn* wrenNewFunction(WrenVM* vm, ObjModule* module, int maxSlots);
 
+// Creates a new function that borrows [code] and [debug] from a code image
+// instead of owning them. Its constants still need to be filled in.
+ObjFn* wrenNewSharedFunction(WrenVM* vm, ObjModule* module, int maxSlots,
+                             uint8_t* code, int codeCount, FnDebug* debug);
+
 void wrenFunctionBindName(WrenVM* vm, ObjFn* fn, const char* name, int length);
 
 // Creates a new instance of the given [classObj].
@@ -760,6 +800,10 @@ Value wrenStringCodePointAt(WrenVM* vm, ObjString* string, uint32_t index);
 uint32_t wrenStringFind(ObjString* haystack, ObjString* needle,
                         uint32_t startIndex);
 
+// Returns the hash code a string with the [length] [bytes] has, which is
+// stored in [ObjString.hash] when the string is created.
+uint32_t wrenHashBytes(const char* bytes, size_t length);
+
 // Returns true if [a] and [b] represent the same string.
 static inline bool wrenStringEqualsCString(const ObjString* a,
                                            const char* b, size_t length)
@@ -782,11 +826,25 @@ void wrenGrayValue(WrenVM* vm, Value value);
 // be called during the sweep phase of a garbage collection.
 void wrenGrayBuffer(WrenVM* vm, ValueBuffer* buffer);
 
+// Grays the objects [obj] refers to, for an old object that has to be traced
+// by a minor collection without being counted as reached itself.
+void wrenGrayReferences(WrenVM* vm, Obj* obj);
+
 // Processes every object in the gray stack until all reachable objects have
 // been marked. After that, all objects are either white (freeable) or black
 // (in use and fully traversed).
 void wrenBlackenObjects(WrenVM* vm);
 
+// Returns the number of bytes of the heap [obj] accounts for. An instance's
+// class must not have been freed yet.
+size_t wrenObjectSize(Obj* obj);
+
+#if WREN_PARALLEL_MARK
+// Does what [wrenBlackenObjects] does with [numThreads] threads, the calling
+// one included. Only for full collections.
+void wrenBlackenObjectsParallel(WrenVM* vm, int numThreads);
+#endif
+
 // Releases all memory owned by [obj], including [obj] itself.
 void wrenFreeObj(WrenVM* vm, Obj* obj);
 
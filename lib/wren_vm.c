@@ -6,6 +6,7 @@
 #include "wren_compiler.h"
 #include "wren_core.h"
 #include "wren_debug.h"
+#include "wren_image.h"
 #include "wren_primitive.h"
 #include "wren_vm.h"
 
@@ -16,11 +17,38 @@
   #include "wren_opt_random.h"
 #endif
 
+#include <time.h>
+
 #if WREN_DEBUG_TRACE_MEMORY || WREN_DEBUG_TRACE_GC
-  #include <time.h>
   #include <stdio.h>
 #endif
 
+// The number of old objects left by a full collection that are swept each
+// time memory is allocated, until they have all been.
+#define SWEEP_STEP 32
+
+// Returns a monotonic time in seconds, to measure collection pauses with. The
+// clock() of MSVC already measures wall time, elsewhere it is CPU time of the
+// whole process and of no use with other threads running.
+static double gcClock()
+{
+#ifdef _WIN32
+  return (double)clock() / CLOCKS_PER_SEC;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+// Adds a collection that started at [startTime] to the pause statistics.
+static void recordPause(WrenVM* vm, double startTime)
+{
+  double pause = gcClock() - startTime;
+  vm->heapStats.pauseTime += pause;
+  if (pause > vm->heapStats.maxPauseTime) vm->heapStats.maxPauseTime = pause;
+}
+
 // The behavior of realloc() when the size is 0 is implementation defined. It
 // may return a non-NULL pointer which must not be dereferenced but nevertheless
 // should be freed. To prevent that, we avoid calling realloc() with a zero
@@ -53,10 +81,16 @@ void wrenInitConfiguration(WrenConfiguration* config)
   config->initialHeapSize = 1024 * 1024 * 10;
   config->minHeapSize = 1024 * 1024;
   config->heapGrowthPercent = 50;
+  config->maxHeapSize = 0;
+  config->nurserySize = 1024 * 1024;
+  config->markThreads = 1;
+  config->jitThreshold = 0;
+  config->coreImage = NULL;
   config->userData = NULL;
 }
 
-WrenVM* wrenNewVM(WrenConfiguration* config)
+// Creates a VM from [config] that has no modules loaded, not even core.
+static WrenVM* allocateVM(WrenConfiguration* config)
 {
   WrenReallocateFn reallocate = defaultReallocate;
   void* userData = NULL;
@@ -88,20 +122,61 @@ WrenVM* wrenNewVM(WrenConfiguration* config)
   vm->grayCapacity = 4;
   vm->gray = (Obj**)reallocate(NULL, vm->grayCapacity * sizeof(Obj*), userData);
   vm->nextGC = vm->config.initialHeapSize;
+  if (vm->config.maxHeapSize > 0 && vm->nextGC > vm->config.maxHeapSize)
+  {
+    vm->nextGC = vm->config.maxHeapSize;
+  }
 
   wrenSymbolTableInit(&vm->methodNames);
+  wrenMethodEntryBufferInit(&vm->methods);
 
   vm->modules = wrenNewMap(vm);
+  return vm;
+}
+
+WrenVM* wrenNewVM(WrenConfiguration* config)
+{
+  WrenVM* vm = allocateVM(config);
   wrenInitializeCore(vm);
   return vm;
 }
 
+WrenCodeImage* wrenCompileCoreImage(WrenConfiguration* config)
+{
+  // The image has to be compiled in the state the core module is normally
+  // compiled in, so build a VM only up to that point and throw it away.
+  WrenConfiguration coreConfig;
+  wrenInitConfiguration(&coreConfig);
+  if (config != NULL)
+  {
+    coreConfig.reallocateFn = config->reallocateFn;
+    coreConfig.errorFn = config->errorFn;
+    coreConfig.userData = config->userData;
+  }
+
+  WrenVM* vm = allocateVM(&coreConfig);
+  WrenCodeImage* image = wrenCompileCore(vm);
+  wrenFreeVM(vm);
+  return image;
+}
+
 void wrenFreeVM(WrenVM* vm)
 {
   ASSERT(vm->methodNames.count > 0, "VM appears to have already been freed.");
+
+  // Put the objects the last collection kept back in the list with the rest.
+  wrenFinishSweep(vm);
   
-  // Free all of the GC objects.
-  Obj* obj = vm->first;
+  // Free all of the GC objects, the young ones first since they are newer.
+  Obj* obj = vm->young;
+  while (obj != NULL)
+  {
+    Obj* next = obj->next;
+    wrenFreeObj(vm, obj);
+    obj = next;
+  }
+
+  obj = vm->first;
   while (obj != NULL)
   {
     Obj* next = obj->next;
@@ -111,6 +186,8 @@ void wrenFreeVM(WrenVM* vm)
 
   // Free up the GC gray set.
   vm->gray = (Obj**)vm->config.reallocateFn(vm->gray, 0, vm->config.userData);
+  vm->remembered = (Obj**)vm->config.reallocateFn(vm->remembered, 0,
+                                                  vm->config.userData);
 
   // Tell the user if they didn't free any handles. We don't want to just free
   // them here because the host app may still have pointers to them that they
@@ -118,11 +195,234 @@ void wrenFreeVM(WrenVM* vm)
   ASSERT(vm->handles == NULL, "All handles have not been released.");
 
   wrenSymbolTableClear(vm, &vm->methodNames);
+  wrenMethodEntryBufferClear(vm, &vm->methods);
+
+#if WREN_JIT
+  wrenJitFree(vm);
+#endif
 
   DEALLOCATE(vm, vm);
 }
 
-void wrenCollectGarbage(WrenVM* vm)
+// Empties the remembered set, except for the running fiber, which stays
+// remembered for as long as it runs.
+static void forgetRemembered(WrenVM* vm)
+{
+  for (int i = 0; i < vm->rememberedCount; i++)
+  {
+    vm->remembered[i]->isRemembered = false;
+  }
+  vm->rememberedCount = 0;
+
+  if (vm->fiber != NULL) wrenRememberFiber(vm, vm->fiber);
+}
+
+// Frees the young objects that were not reached by the collection that just
+// marked the heap and makes the rest old. They are stored in [survivors] for
+// the caller to add to [vm->first], so that it can sweep the old objects
+// first. Afterwards no old object refers to a young one, so the remembered
+// set is emptied as well.
+//
+// Returns the number of bytes freed.
+static size_t sweepYoung(WrenVM* vm, Obj** survivors)
+{
+  size_t freed = 0;
+  *survivors = NULL;
+
+  // Objects are freed newest first, so an instance's class, which is older,
+  // is still there to tell its size.
+  Obj* obj = vm->young;
+  while (obj != NULL)
+  {
+    Obj* next = obj->next;
+    if (obj->isDark)
+    {
+      obj->isDark = false;
+      obj->isYoung = false;
+      obj->next = *survivors;
+      *survivors = obj;
+    }
+    else
+    {
+      freed += wrenObjectSize(obj);
+      wrenFreeObj(vm, obj);
+    }
+    obj = next;
+  }
+  vm->young = NULL;
+  vm->youngBytes = 0;
+
+  forgetRemembered(vm);
+  return freed;
+}
+
+// Adds the [survivors] of a young collection to the old objects.
+static void promote(WrenVM* vm, Obj* survivors)
+{
+  while (survivors != NULL)
+  {
+    Obj* next = survivors->next;
+    survivors->next = vm->first;
+    vm->first = survivors;
+    survivors = next;
+  }
+}
+
+void wrenRemember(WrenVM* vm, Obj* obj)
+{
+  if (vm->rememberedCount >= vm->rememberedCapacity)
+  {
+    vm->rememberedCapacity = vm->rememberedCapacity == 0
+        ? 64 : vm->rememberedCapacity * 2;
+    vm->remembered = (Obj**)vm->config.reallocateFn(vm->remembered,
+        vm->rememberedCapacity * sizeof(Obj*), vm->config.userData);
+  }
+
+  obj->isRemembered = true;
+  vm->remembered[vm->rememberedCount++] = obj;
+}
+
+// Grays the young objects [obj] refers to, and [obj] itself if it is young.
+static void grayYoungRoot(WrenVM* vm, Obj* obj)
+{
+  if (obj == NULL) return;
+
+  if (obj->isYoung)
+  {
+    wrenGrayObj(vm, obj);
+  }
+  else
+  {
+    wrenGrayReferences(vm, obj);
+  }
+}
+
+// Collects only the young objects, taking every old one to be alive. Traces
+// from the same roots as a full collection plus the remembered set, but stops
+// at old objects, so the cost depends on the young objects that survive
+// rather than on the size of the heap.
+static void collectYoung(WrenVM* vm)
+{
+#if WREN_DEBUG_TRACE_MEMORY || WREN_DEBUG_TRACE_GC
+  printf("-- minor gc --\n");
+
+  size_t youngBytes = vm->youngBytes;
+  double startTime = (double)clock() / CLOCKS_PER_SEC;
+#endif
+
+  double pauseStart = gcClock();
+
+  // Old objects are not marked, so rather than counting what is reached, the
+  // size of what is freed is taken off.
+  size_t bytesAllocated = vm->bytesAllocated;
+  vm->collectingYoung = true;
+
+  // The module map is normally old, but not right after the VM is created.
+  grayYoungRoot(vm, (Obj*)vm->modules);
+
+  for (int i = 0; i < vm->numTempRoots; i++)
+  {
+    grayYoungRoot(vm, vm->tempRoots[i]);
+  }
+
+  // The stack of the current fiber has no write barrier.
+  grayYoungRoot(vm, (Obj*)vm->fiber);
+
+  for (WrenHandle* handle = vm->handles;
+       handle != NULL;
+       handle = handle->next)
+  {
+    wrenGrayValue(vm, handle->value);
+  }
+
+  if (vm->compiler != NULL) wrenMarkCompiler(vm, vm->compiler);
+  wrenBlackenSymbolTable(vm, &vm->methodNames);
+
+  // The old objects that were stored into.
+  for (int i = 0; i < vm->rememberedCount; i++)
+  {
+    wrenGrayReferences(vm, vm->remembered[i]);
+  }
+
+  wrenBlackenObjects(vm);
+  vm->collectingYoung = false;
+
+  Obj* survivors;
+  size_t freed = sweepYoung(vm, &survivors);
+  promote(vm, survivors);
+  vm->bytesAllocated = bytesAllocated > freed ? bytesAllocated - freed : 0;
+
+  vm->heapStats.minorCollections++;
+  vm->heapStats.bytesFreed += bytesAllocated - vm->bytesAllocated;
+  recordPause(vm, pauseStart);
+
+#if WREN_DEBUG_TRACE_MEMORY || WREN_DEBUG_TRACE_GC
+  double elapsed = ((double)clock() / CLOCKS_PER_SEC) - startTime;
+  printf("Minor GC %lu young, %lu collected, heap at %lu. Took %.3fms.\n",
+         (unsigned long)youngBytes,
+         (unsigned long)freed,
+         (unsigned long)vm->bytesAllocated,
+         elapsed*1000.0);
+#endif
+}
+
+void wrenBeginRegion(WrenVM* vm)
+{
+  vm->regionDepth++;
+}
+
+void wrenEndRegion(WrenVM* vm)
+{
+  ASSERT(vm->regionDepth > 0, "No region to end.");
+  vm->regionDepth--;
+
+  if (vm->young != NULL) collectYoung(vm);
+}
+
+// Visits up to [count] of the old objects left by the last full collection,
+// freeing those it didn't reach. Once they have all been visited, the ones
+// kept go back behind the objects allocated since, so that the list stays
+// ordered from newest to oldest.
+static void sweepOld(WrenVM* vm, size_t count)
+{
+  while (vm->unswept != NULL && count-- > 0)
+  {
+    Obj* obj = vm->unswept;
+    vm->unswept = obj->next;
+
+    if (obj->isDark)
+    {
+      // This object was reached, so unmark it (for the next GC) and keep it.
+      obj->isDark = false;
+      obj->next = NULL;
+      *vm->sweptTail = obj;
+      vm->sweptTail = &obj->next;
+    }
+    else
+    {
+      // This object wasn't reached, so free it.
+      wrenFreeObj(vm, obj);
+    }
+  }
+
+  if (vm->unswept != NULL || vm->sweptTail == NULL) return;
+
+  Obj** tail = &vm->first;
+  while (*tail != NULL) tail = &(*tail)->next;
+  *tail = vm->swept;
+
+  vm->swept = NULL;
+  vm->sweptTail = NULL;
+}
+
+void wrenFinishSweep(WrenVM* vm)
+{
+  sweepOld(vm, SIZE_MAX);
+}
+
+// Collects the whole heap. Only the young objects are swept right away. The
+// old ones are swept a few at a time by later allocations.
+static void collectGarbage(WrenVM* vm)
 {
 #if WREN_DEBUG_TRACE_MEMORY || WREN_DEBUG_TRACE_GC
   printf("-- gc --\n");
@@ -133,6 +433,12 @@ void wrenCollectGarbage(WrenVM* vm)
 
   // Mark all reachable objects.
 
+  // The marks of the last collection are still on the objects it hasn't swept.
+  wrenFinishSweep(vm);
+
+  double pauseStart = gcClock();
+  size_t bytesBefore = vm->bytesAllocated;
+
   // Reset this. As we mark objects, their size will be counted again so that
   // we can track how much memory is in use without needing to know the size
   // of each *freed* object.
@@ -170,26 +476,34 @@ void wrenCollectGarbage(WrenVM* vm)
 
   // Now that we have grayed the roots, do a depth-first search over all of the
   // reachable objects.
+#if WREN_PARALLEL_MARK
+  if (vm->config.markThreads > 1)
+  {
+    wrenBlackenObjectsParallel(vm, vm->config.markThreads);
+  }
+  else
+#endif
   wrenBlackenObjects(vm);
 
-  // Collect the white objects.
-  Obj** obj = &vm->first;
-  while (*obj != NULL)
+  // Collect the white objects, the young ones first since they are newer and
+  // a foreign object's finalizer still needs its class. The survivors become
+  // old, there are too few young objects left to be worth telling apart.
+  Obj* survivors;
+  sweepYoung(vm, &survivors);
+
+  // Set the old objects aside for [sweepOld]. Those allocated from now on are
+  // kept in [first] until the sweep is done.
+  vm->unswept = vm->first;
+  vm->first = NULL;
+  vm->swept = NULL;
+  vm->sweptTail = &vm->swept;
+  promote(vm, survivors);
+  vm->liveBytes = vm->bytesAllocated;
+
+  vm->heapStats.fullCollections++;
+  if (bytesBefore > vm->bytesAllocated)
   {
-    if (!((*obj)->isDark))
-    {
-      // This object wasn't reached, so remove it from the list and free it.
-      Obj* unreached = *obj;
-      *obj = unreached->next;
-      wrenFreeObj(vm, unreached);
-    }
-    else
-    {
-      // This object was reached, so unmark it (for the next GC) and move on to
-      // the next.
-      (*obj)->isDark = false;
-      obj = &(*obj)->next;
-    }
+    vm->heapStats.bytesFreed += bytesBefore - vm->bytesAllocated;
   }
 
   // Calculate the next gc point, this is the current allocation plus
@@ -197,6 +511,25 @@ void wrenCollectGarbage(WrenVM* vm)
   vm->nextGC = vm->bytesAllocated + ((vm->bytesAllocated * vm->config.heapGrowthPercent) / 100);
   if (vm->nextGC < vm->config.minHeapSize) vm->nextGC = vm->config.minHeapSize;
 
+  // Never let the heap grow past its ceiling without collecting first. Close
+  // to the ceiling, a collection would be triggered every few allocations, so
+  // a heap still more than seven eighths full counts as exceeded. It keeps
+  // the normal growth so it doesn't thrash until the fiber is aborted.
+  size_t maxHeapSize = vm->config.maxHeapSize;
+  if (maxHeapSize > 0)
+  {
+    if (vm->bytesAllocated > maxHeapSize - maxHeapSize / 8)
+    {
+      vm->heapExceeded = true;
+    }
+    else if (vm->nextGC > maxHeapSize)
+    {
+      vm->nextGC = maxHeapSize;
+    }
+  }
+
+  recordPause(vm, pauseStart);
+
 #if WREN_DEBUG_TRACE_MEMORY || WREN_DEBUG_TRACE_GC
   double elapsed = ((double)clock() / CLOCKS_PER_SEC) - startTime;
   // Explicit cast because size_t has different sizes on 32-bit and 64-bit and
@@ -210,6 +543,129 @@ void wrenCollectGarbage(WrenVM* vm)
 #endif
 }
 
+void wrenCollectGarbage(WrenVM* vm)
+{
+  collectGarbage(vm);
+  wrenFinishSweep(vm);
+}
+
+size_t wrenCollectGarbageIdle(WrenVM* vm, size_t budget)
+{
+  if (vm->unswept != NULL)
+  {
+    size_t visited = 0;
+    while (vm->unswept != NULL && visited < budget)
+    {
+      visited += wrenObjectSize(vm->unswept);
+      sweepOld(vm, 1);
+    }
+    return visited;
+  }
+
+  // Tracing young objects costs at most their size.
+  size_t youngBytes = vm->youngBytes;
+  if (vm->young != NULL && youngBytes <= budget)
+  {
+    collectYoung(vm);
+    return youngBytes > 0 ? youngBytes : 1;
+  }
+
+  // Not worth it while the heap has barely grown since the last collection.
+  size_t growth = vm->bytesAllocated > vm->liveBytes
+                ? vm->bytesAllocated - vm->liveBytes : 0;
+  size_t allowed = vm->nextGC > vm->liveBytes ? vm->nextGC - vm->liveBytes : 0;
+  if (growth <= allowed / 2) return 0;
+
+  // Marking can't be split up, so once it is due the collection runs even if
+  // it visits more than [budget]. It costs what the one an allocation would
+  // trigger later costs, without a request waiting for it. The old objects
+  // are swept by the calls that follow.
+  collectGarbage(vm);
+  return vm->liveBytes > 0 ? vm->liveBytes : 1;
+}
+
+// Returns the statistics of the objects of [type] in [stats].
+static WrenObjectStats* objectStats(WrenHeapStats* stats, ObjType type)
+{
+  switch (type)
+  {
+    case OBJ_CLASS:    return &stats->classes;
+    case OBJ_CLOSURE:  return &stats->closures;
+    case OBJ_FIBER:    return &stats->fibers;
+    case OBJ_FN:       return &stats->fns;
+    case OBJ_FOREIGN:  return &stats->foreigns;
+    case OBJ_INSTANCE: return &stats->instances;
+    case OBJ_LIST:     return &stats->lists;
+    case OBJ_MAP:      return &stats->maps;
+    case OBJ_MODULE:   return &stats->modules;
+    case OBJ_RANGE:    return &stats->ranges;
+    case OBJ_STRING:   return &stats->strings;
+    case OBJ_UPVALUE:  return &stats->upvalues;
+  }
+
+  UNREACHABLE();
+  return NULL;
+}
+
+void wrenGetHeapStats(WrenVM* vm, WrenHeapStats* stats)
+{
+  // Otherwise the objects being swept are in neither list.
+  wrenFinishSweep(vm);
+
+  *stats = vm->heapStats;
+  stats->heapSize = vm->bytesAllocated;
+  stats->liveBytes = vm->liveBytes;
+  stats->nextGC = vm->nextGC;
+
+  Obj* lists[] = { vm->young, vm->first };
+  for (int i = 0; i < 2; i++)
+  {
+    for (Obj* obj = lists[i]; obj != NULL; obj = obj->next)
+    {
+      WrenObjectStats* objects = objectStats(stats, obj->type);
+      objects->count++;
+      objects->bytes += wrenObjectSize(obj);
+    }
+  }
+}
+
+void wrenGetClassStats(WrenVM* vm, WrenClassStatsFn fn, void* userData)
+{
+  wrenFinishSweep(vm);
+
+  Obj* lists[] = { vm->young, vm->first };
+  for (int i = 0; i < 2; i++)
+  {
+    for (Obj* obj = lists[i]; obj != NULL; obj = obj->next)
+    {
+      if (obj->type != OBJ_CLASS) continue;
+      ((ObjClass*)obj)->statsCount = 0;
+      ((ObjClass*)obj)->statsBytes = 0;
+    }
+  }
+
+  for (int i = 0; i < 2; i++)
+  {
+    for (Obj* obj = lists[i]; obj != NULL; obj = obj->next)
+    {
+      if (obj->type != OBJ_INSTANCE && obj->type != OBJ_FOREIGN) continue;
+      obj->classObj->statsCount++;
+      obj->classObj->statsBytes += wrenObjectSize(obj);
+    }
+  }
+
+  for (int i = 0; i < 2; i++)
+  {
+    for (Obj* obj = lists[i]; obj != NULL; obj = obj->next)
+    {
+      ObjClass* classObj = (ObjClass*)obj;
+      if (obj->type != OBJ_CLASS || classObj->statsCount == 0) continue;
+      fn(classObj->name != NULL ? classObj->name->value : "",
+         classObj->statsCount, classObj->statsBytes, userData);
+    }
+  }
+}
+
 void* wrenReallocate(WrenVM* vm, void* memory, size_t oldSize, size_t newSize)
 {
 #if WREN_DEBUG_TRACE_MEMORY
@@ -224,13 +680,30 @@ void* wrenReallocate(WrenVM* vm, void* memory, size_t oldSize, size_t newSize)
   // track the original size). Instead, that will be handled while marking
   // during the next GC.
   vm->bytesAllocated += newSize - oldSize;
+  if (newSize > oldSize)
+  {
+    vm->heapStats.bytesAllocated += newSize - oldSize;
+    if (wrenAllocatesYoung(vm)) vm->youngBytes += newSize - oldSize;
+  }
 
 #if WREN_DEBUG_GC_STRESS
   // Since collecting calls this function to free things, make sure we don't
   // recurse.
   if (newSize > 0) wrenCollectGarbage(vm);
 #else
-  if (newSize > 0 && vm->bytesAllocated > vm->nextGC) wrenCollectGarbage(vm);
+  if (newSize > 0 && vm->bytesAllocated > vm->nextGC)
+  {
+    collectGarbage(vm);
+  }
+  else if (newSize > 0 && vm->config.nurserySize > 0 &&
+           vm->youngBytes > vm->config.nurserySize)
+  {
+    collectYoung(vm);
+  }
+  else if (newSize > 0 && vm->unswept != NULL)
+  {
+    sweepOld(vm, SWEEP_STEP);
+  }
 #endif
 
   return vm->config.reallocateFn(memory, newSize, vm->config.userData);
@@ -284,7 +757,7 @@ static ObjUpvalue* captureUpvalue(WrenVM* vm, ObjFiber* fiber, Value* local)
 
 // Closes any open upvalues that have been created for stack slots at [last]
 // and above.
-static void closeUpvalues(ObjFiber* fiber, Value* last)
+static void closeUpvalues(WrenVM* vm, ObjFiber* fiber, Value* last)
 {
   while (fiber->openUpvalues != NULL &&
          fiber->openUpvalues->value >= last)
@@ -294,6 +767,7 @@ static void closeUpvalues(ObjFiber* fiber, Value* last)
     // Move the value into the upvalue itself and point the upvalue to it.
     upvalue->closed = *upvalue->value;
     upvalue->value = &upvalue->closed;
+    wrenWriteBarrier(vm, &upvalue->obj, upvalue->closed);
 
     // Remove it from the open upvalue list.
     fiber->openUpvalues = upvalue->next;
@@ -375,7 +849,7 @@ static void bindMethod(WrenVM* vm, int methodType, int symbol,
     method.type = METHOD_BLOCK;
 
     // Patch up the bytecode now that we know the superclass.
-    wrenBindMethodCode(classObj, method.as.closure->fn);
+    wrenBindMethodCode(vm, classObj, method.as.closure->fn);
   }
 
   wrenBindMethod(vm, classObj, symbol, method);
@@ -411,6 +885,7 @@ static void runtimeError(WrenVM* vm)
   {
     // Every fiber along the call chain gets aborted with the same error.
     current->error = error;
+    wrenWriteBarrier(vm, &current->obj, error);
 
     // If the caller ran this fiber using "try", give it the error and stop.
     if (current->state == FIBER_TRY)
@@ -626,6 +1101,7 @@ static void endClass(WrenVM* vm)
 
   ObjClass* classObj = AS_CLASS(classValue);
     classObj->attributes = attributes;
+    wrenWriteBarrier(vm, &classObj->obj, attributes);
 }
 
 // Creates a new class.
@@ -664,8 +1140,8 @@ static void createForeign(WrenVM* vm, ObjFiber* fiber, Value* stack)
   int symbol = wrenSymbolTableFind(&vm->methodNames, "<allocate>", 10);
   ASSERT(symbol != -1, "Should have defined <allocate> symbol.");
 
-  ASSERT(classObj->methods.count > symbol, "Class should have allocator.");
-  Method* method = &classObj->methods.data[symbol];
+  Method* method = wrenFindMethod(vm, classObj, symbol);
+  ASSERT(method != NULL, "Class should have allocator.");
   ASSERT(method->type == METHOD_FOREIGN, "Allocator should be foreign.");
 
   // Pass the constructor arguments to the allocator as well.
@@ -688,10 +1164,8 @@ void wrenFinalizeForeign(WrenVM* vm, ObjForeign* foreign)
 
   // If the class doesn't have a finalizer, bail out.
   ObjClass* classObj = foreign->obj.classObj;
-  if (symbol >= classObj->methods.count) return;
-
-  Method* method = &classObj->methods.data[symbol];
-  if (method->type == METHOD_NONE) return;
+  Method* method = wrenFindMethod(vm, classObj, symbol);
+  if (method == NULL) return;
 
   ASSERT(method->type == METHOD_FOREIGN, "Finalizer should be foreign.");
 
@@ -767,7 +1241,18 @@ static Value importModule(WrenVM* vm, Value name)
     return NULL_VAL;
   }
   
-  ObjClosure* moduleClosure = compileInModule(vm, name, result.source, false, true);
+  // Prefer an image of the module the host compiled earlier, if it fits.
+  ObjClosure* moduleClosure = NULL;
+  if (result.image != NULL && result.image->module != NULL &&
+      strcmp(result.image->module, AS_CSTRING(name)) == 0)
+  {
+    moduleClosure = wrenLoadImage(vm, result.image);
+  }
+
+  if (moduleClosure == NULL)
+  {
+    moduleClosure = compileInModule(vm, name, result.source, false, true);
+  }
   
   // Now that we're done, give the result back in case there's cleanup to do.
   if(result.onComplete) result.onComplete(vm, AS_CSTRING(name), result);
@@ -820,6 +1305,38 @@ inline static bool checkArity(WrenVM* vm, Value value, int numArgs)
   return false;
 }
 
+// Finds the number after [iterator] in the range from [from] to [to], or the
+// first one if [iterator] is null, the same way Range.iterate(_) does. Returns
+// false if there are no more. [iterator] must be null or a number.
+static inline bool iterateRange(double from, double to, bool isInclusive,
+                                Value iterator, double* next)
+{
+  // Special case: empty range.
+  if (from == to && !isInclusive) return false;
+
+  // Start the iteration.
+  if (IS_NULL(iterator))
+  {
+    *next = from;
+    return true;
+  }
+
+  // Iterate towards [to] from [from].
+  *next = AS_NUM(iterator);
+  if (from < to)
+  {
+    *next += 1;
+    if (*next > to) return false;
+  }
+  else
+  {
+    *next -= 1;
+    if (*next < to) return false;
+  }
+
+  return isInclusive || *next != to;
+}
+
 
 // The main bytecode interpreter loop. This is where the magic happens. It is
 // also, as you can imagine, highly performance critical.
@@ -828,6 +1345,7 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
   // Remember the current fiber so we can find it if a GC happens.
   vm->fiber = fiber;
   fiber->state = FIBER_ROOT;
+  wrenRememberFiber(vm, fiber);
 
   // Hoist these into local variables. They are accessed frequently in the loop
   // but assigned less frequently. Keeping them in locals and updating them when
@@ -871,10 +1389,40 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
         runtimeError(vm);                                                      \
         if (vm->fiber == NULL) return WREN_RESULT_RUNTIME_ERROR;               \
         fiber = vm->fiber;                                                     \
+        wrenRememberFiber(vm, fiber);                                          \
         LOAD_FRAME();                                                          \
         DISPATCH();                                                            \
       } while (false)
 
+  #if WREN_JIT
+    // Counts a call or a loop iteration of the current function, and compiles
+    // it to machine code once there have been enough.
+    #define COUNT_JIT()                                                        \
+        do                                                                     \
+        {                                                                      \
+          if (fn->jitCountdown > 0 && --fn->jitCountdown == 0)                 \
+          {                                                                    \
+            wrenJitCompile(vm, fn);                                            \
+          }                                                                    \
+        } while (false)
+
+    // Runs the machine code of the current function from [ip] on, if it has
+    // any there, up to the next instruction it leaves to the interpreter.
+    #define RUN_JIT()                                                          \
+        do                                                                     \
+        {                                                                      \
+          if (fn->jitEntries != NULL &&                                        \
+              fn->jitEntries[ip - fn->code.data] != NULL)                      \
+          {                                                                    \
+            ip = fn->code.data + wrenJitRun(vm, fiber, stackStart,             \
+                frame->closure, fn->jitEntries[ip - fn->code.data]);           \
+          }                                                                    \
+        } while (false)
+  #else
+    #define COUNT_JIT() do { } while (false)
+    #define RUN_JIT()   do { } while (false)
+  #endif
+
   #if WREN_DEBUG_TRACE_INSTRUCTIONS
     // Prints the stack and instruction before each instruction is executed.
     #define DEBUG_TRACE_INSTRUCTIONS()                                         \
@@ -918,6 +1466,8 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
   #endif
 
   LOAD_FRAME();
+  COUNT_JIT();
+  RUN_JIT();
 
   Code instruction;
   INTERPRET_LOOP
@@ -938,6 +1488,11 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
       PUSH(stackStart[READ_BYTE()]);
       DISPATCH();
 
+    CASE_CODE(LOAD_LOCALS):
+      PUSH(stackStart[READ_BYTE()]);
+      PUSH(stackStart[READ_BYTE()]);
+      DISPATCH();
+
     CASE_CODE(LOAD_FIELD_THIS):
     {
       uint8_t field = READ_BYTE();
@@ -958,6 +1513,10 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
       stackStart[READ_BYTE()] = PEEK();
       DISPATCH();
 
+    CASE_CODE(STORE_LOCAL_POP):
+      stackStart[READ_BYTE()] = POP();
+      DISPATCH();
+
     CASE_CODE(CONSTANT):
       PUSH(fn->constants.data[READ_SHORT()]);
       DISPATCH();
@@ -998,6 +1557,8 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
     CASE_CODE(CALL_16):
       // Add one for the implicit receiver argument.
       numArgs = instruction - CODE_CALL_0 + 1;
+
+    callMethod:
       symbol = READ_SHORT();
 
       // The receiver is the first argument.
@@ -1005,6 +1566,115 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
       classObj = wrenGetClassInline(vm, args[0]);
       goto completeCall;
 
+      // The operators on two numbers are computed here. Anything else, including
+      // the errors for a right operand that isn't a number, is left to the
+      // operator method.
+      #define NUM_OPERATOR(type, expression)                                   \
+          do                                                                   \
+          {                                                                    \
+            if (IS_NUM(PEEK2()) && IS_NUM(PEEK()))                             \
+            {                                                                  \
+              double b = AS_NUM(POP());                                        \
+              double a = AS_NUM(PEEK());                                       \
+              fiber->stackTop[-1] = type(expression);                          \
+              ip += 2;                                                         \
+              DISPATCH();                                                      \
+            }                                                                  \
+                                                                               \
+            numArgs = 2;                                                       \
+            goto callMethod;                                                   \
+          } while (false)
+
+    CASE_CODE(ADD): NUM_OPERATOR(NUM_VAL, a + b);
+    CASE_CODE(SUB): NUM_OPERATOR(NUM_VAL, a - b);
+    CASE_CODE(MUL): NUM_OPERATOR(NUM_VAL, a * b);
+    CASE_CODE(DIV): NUM_OPERATOR(NUM_VAL, a / b);
+    CASE_CODE(MOD): NUM_OPERATOR(NUM_VAL, fmod(a, b));
+    CASE_CODE(LT):  NUM_OPERATOR(BOOL_VAL, a < b);
+    CASE_CODE(GT):  NUM_OPERATOR(BOOL_VAL, a > b);
+    CASE_CODE(LTE): NUM_OPERATOR(BOOL_VAL, a <= b);
+    CASE_CODE(GTE): NUM_OPERATOR(BOOL_VAL, a >= b);
+    CASE_CODE(EQ):  NUM_OPERATOR(BOOL_VAL, a == b);
+    CASE_CODE(NEQ): NUM_OPERATOR(BOOL_VAL, a != b);
+
+      #undef NUM_OPERATOR
+
+      // A comparison followed by a JUMP_IF. On two numbers, both are done here
+      // and the JUMP_IF is skipped. Otherwise the JUMP_IF runs after the
+      // operator method returns.
+      #define NUM_COMPARE_JUMP(expression)                                     \
+          do                                                                   \
+          {                                                                    \
+            if (IS_NUM(PEEK2()) && IS_NUM(PEEK()))                             \
+            {                                                                  \
+              double b = AS_NUM(POP());                                        \
+              double a = AS_NUM(POP());                                        \
+              ip += 5;                                                         \
+              if (!(expression)) ip += (ip[-2] << 8) | ip[-1];                 \
+              DISPATCH();                                                      \
+            }                                                                  \
+                                                                               \
+            numArgs = 2;                                                       \
+            goto callMethod;                                                   \
+          } while (false)
+
+    CASE_CODE(LT_JUMP_IF):  NUM_COMPARE_JUMP(a < b);
+    CASE_CODE(GT_JUMP_IF):  NUM_COMPARE_JUMP(a > b);
+    CASE_CODE(LTE_JUMP_IF): NUM_COMPARE_JUMP(a <= b);
+    CASE_CODE(GTE_JUMP_IF): NUM_COMPARE_JUMP(a >= b);
+    CASE_CODE(EQ_JUMP_IF):  NUM_COMPARE_JUMP(a == b);
+    CASE_CODE(NEQ_JUMP_IF): NUM_COMPARE_JUMP(a != b);
+
+      #undef NUM_COMPARE_JUMP
+
+    CASE_CODE(LOAD_LOCAL_CALL_0):
+    CASE_CODE(LOAD_LOCAL_CALL_1):
+      PUSH(stackStart[READ_BYTE()]);
+      numArgs = instruction - CODE_LOAD_LOCAL_CALL_0 + 1;
+      goto callMethod;
+
+    CASE_CODE(FOR_ITERATE):
+    {
+      Value* sequence = &stackStart[READ_BYTE()];
+      Value* iterator = &stackStart[READ_BYTE()];
+
+      double next;
+      if (IS_RANGE(*sequence) && (IS_NULL(*iterator) || IS_NUM(*iterator)))
+      {
+        ObjRange* range = AS_RANGE(*sequence);
+
+        // Skip the call arguments and the STORE_LOCAL, and take the JUMP_IF
+        // after it when the range is done.
+        ip += 2 + 2 + 3;
+        if (!iterateRange(range->from, range->to, range->isInclusive,
+                          *iterator, &next))
+        {
+          ip += (ip[-2] << 8) | ip[-1];
+          DISPATCH();
+        }
+
+        // A range's values are its iterators, so skip FOR_ITERATOR_VALUE too.
+        *iterator = NUM_VAL(next);
+        PUSH(*iterator);
+        ip += 5;
+        DISPATCH();
+      }
+
+      PUSH(*sequence);
+      PUSH(*iterator);
+      numArgs = 2;
+      goto callMethod;
+    }
+
+    CASE_CODE(FOR_ITERATOR_VALUE):
+    {
+      Value sequence = stackStart[READ_BYTE()];
+      PUSH(sequence);
+      PUSH(stackStart[READ_BYTE()]);
+      numArgs = 2;
+      goto callMethod;
+    }
+
     CASE_CODE(SUPER_0):
     CASE_CODE(SUPER_1):
     CASE_CODE(SUPER_2):
@@ -1034,9 +1704,22 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
       goto completeCall;
 
     completeCall:
+      // The last collection left more than the heap may hold. The fiber that
+      // allocated it is the most likely culprit, so abort it to free it up.
+      if (vm->heapExceeded)
+      {
+        vm->heapExceeded = false;
+        fiber->error = CONST_STRING(vm, "Out of memory.");
+        RUNTIME_ERROR();
+      }
+
+      // The method is looked up on every call instead of being cached at the
+      // call site. With the shared method table, the lookup is already just a
+      // bounds check and one comparison, and per-call-site caches measured
+      // 10-20% slower than it.
+      //
       // If the class's method table doesn't include the symbol, bail.
-      if (symbol >= classObj->methods.count ||
-          (method = &classObj->methods.data[symbol])->type == METHOD_NONE)
+      if ((method = wrenFindMethod(vm, classObj, symbol)) == NULL)
       {
         methodNotFound(vm, classObj, symbol);
         RUNTIME_ERROR();
@@ -1058,6 +1741,7 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
             fiber = vm->fiber;
             if (fiber == NULL) return WREN_RESULT_SUCCESS;
             if (wrenHasError(fiber)) RUNTIME_ERROR();
+            wrenRememberFiber(vm, fiber);
             LOAD_FRAME();
           }
           break;
@@ -1071,6 +1755,7 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
           STORE_FRAME();
           method->as.primitive(vm, args);
           LOAD_FRAME();
+          COUNT_JIT();
           break;
 
         case METHOD_FOREIGN:
@@ -1082,12 +1767,14 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
           STORE_FRAME();
           wrenCallFunction(vm, fiber, (ObjClosure*)method->as.closure, numArgs);
           LOAD_FRAME();
+          COUNT_JIT();
           break;
 
         case METHOD_NONE:
           UNREACHABLE();
           break;
       }
+      RUN_JIT();
       DISPATCH();
     }
 
@@ -1100,8 +1787,9 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
 
     CASE_CODE(STORE_UPVALUE):
     {
-      ObjUpvalue** upvalues = frame->closure->upvalues;
-      *upvalues[READ_BYTE()]->value = PEEK();
+      ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+      *upvalue->value = PEEK();
+      wrenWriteBarrier(vm, &upvalue->obj, PEEK());
       DISPATCH();
     }
 
@@ -1111,6 +1799,7 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
 
     CASE_CODE(STORE_MODULE_VAR):
       fn->module->variables.data[READ_SHORT()] = PEEK();
+      wrenWriteBarrier(vm, &fn->module->obj, PEEK());
       DISPATCH();
 
     CASE_CODE(STORE_FIELD_THIS):
@@ -1121,6 +1810,19 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
       ObjInstance* instance = AS_INSTANCE(receiver);
       ASSERT(field < instance->obj.classObj->numFields, "Out of bounds field.");
       instance->fields[field] = PEEK();
+      wrenWriteBarrier(vm, &instance->obj, PEEK());
+      DISPATCH();
+    }
+
+    CASE_CODE(STORE_FIELD_THIS_POP):
+    {
+      uint8_t field = READ_BYTE();
+      Value receiver = stackStart[0];
+      ASSERT(IS_INSTANCE(receiver), "Receiver should be instance.");
+      ObjInstance* instance = AS_INSTANCE(receiver);
+      ASSERT(field < instance->obj.classObj->numFields, "Out of bounds field.");
+      instance->fields[field] = POP();
+      wrenWriteBarrier(vm, &instance->obj, instance->fields[field]);
       DISPATCH();
     }
 
@@ -1143,6 +1845,7 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
       ObjInstance* instance = AS_INSTANCE(receiver);
       ASSERT(field < instance->obj.classObj->numFields, "Out of bounds field.");
       instance->fields[field] = PEEK();
+      wrenWriteBarrier(vm, &instance->obj, PEEK());
       DISPATCH();
     }
 
@@ -1158,6 +1861,37 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
       // Jump back to the top of the loop.
       uint16_t offset = READ_SHORT();
       ip -= offset;
+      COUNT_JIT();
+      RUN_JIT();
+      DISPATCH();
+    }
+
+    CASE_CODE(FOR_RANGE):
+    {
+      // The start, end, and last number counted.
+      Value* range = &stackStart[READ_BYTE()];
+      bool isInclusive = READ_BYTE();
+      uint16_t offset = READ_SHORT();
+
+      // The start is a number literal, but the end is only checked here.
+      if (IS_NULL(range[2]) && !IS_NUM(range[1]))
+      {
+        fiber->error = CONST_STRING(vm,
+            "Right hand side of range must be a number.");
+        RUNTIME_ERROR();
+      }
+
+      double next;
+      if (iterateRange(AS_NUM(range[0]), AS_NUM(range[1]), isInclusive,
+                       range[2], &next))
+      {
+        range[2] = NUM_VAL(next);
+        PUSH(range[2]);
+      }
+      else
+      {
+        ip += offset;
+      }
       DISPATCH();
     }
 
@@ -1208,7 +1942,7 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
 
     CASE_CODE(CLOSE_UPVALUE):
       // Close the upvalue for the local if we have one.
-      closeUpvalues(fiber, fiber->stackTop - 1);
+      closeUpvalues(vm, fiber, fiber->stackTop - 1);
       DROP();
       DISPATCH();
 
@@ -1218,7 +1952,7 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
       fiber->numFrames--;
 
       // Close any upvalues still in scope.
-      closeUpvalues(fiber, stackStart);
+      closeUpvalues(vm, fiber, stackStart);
 
       // If the fiber is complete, end it.
       if (fiber->numFrames == 0)
@@ -1237,6 +1971,7 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
         fiber->caller = NULL;
         fiber = resumingFiber;
         vm->fiber = resumingFiber;
+        wrenRememberFiber(vm, fiber);
         
         // Store the result in the resuming fiber.
         fiber->stackTop[-1] = result;
@@ -1253,6 +1988,7 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
       }
       
       LOAD_FRAME();
+      RUN_JIT();
       DISPATCH();
     }
 
@@ -1291,6 +2027,9 @@ static WrenInterpretResult runInterpreter(WrenVM* vm, register ObjFiber* fiber)
           // Use the same upvalue as the current call frame.
           closure->upvalues[i] = frame->closure->upvalues[index];
         }
+
+        // Capturing may have collected and promoted the closure.
+        wrenWriteBarrier(vm, &closure->obj, OBJ_VAL(closure->upvalues[i]));
       }
       DISPATCH();
     }
@@ -1549,6 +2288,21 @@ WrenInterpretResult wrenInterpret(WrenVM* vm, const char* module,
   return runInterpreter(vm, fiber);
 }
 
+WrenInterpretResult wrenInterpretImage(WrenVM* vm, WrenCodeImage* image)
+{
+  ObjClosure* closure = wrenLoadImage(vm, image);
+
+  // The image doesn't line up with this VM's symbols, so compile as usual.
+  if (closure == NULL) return wrenInterpret(vm, image->module, image->source);
+
+  wrenPushRoot(vm, (Obj*)closure);
+  ObjFiber* fiber = wrenNewFiber(vm, closure);
+  wrenPopRoot(vm); // closure.
+  vm->apiStack = NULL;
+
+  return runInterpreter(vm, fiber);
+}
+
 ObjClosure* wrenCompileSource(WrenVM* vm, const char* module, const char* source,
                             bool isExpression, bool printErrors)
 {
@@ -1594,7 +2348,10 @@ int wrenDeclareVariable(WrenVM* vm, ObjModule* module, const char* name,
   // variable is first used. We'll use that later to report an error on the
   // right line.
   wrenValueBufferWrite(vm, &module->variables, NUM_VAL(line));
-  return wrenSymbolTableAdd(vm, &module->variableNames, name, length);
+  int symbol = wrenSymbolTableAdd(vm, &module->variableNames, name, length);
+  wrenWriteBarrier(vm, &module->obj,
+                   OBJ_VAL(module->variableNames.data[symbol]));
+  return symbol;
 }
 
 int wrenDefineVariable(WrenVM* vm, ObjModule* module, const char* name,
@@ -1611,7 +2368,10 @@ int wrenDefineVariable(WrenVM* vm, ObjModule* module, const char* name,
   {
     // Brand new variable.
     symbol = wrenSymbolTableAdd(vm, &module->variableNames, name, length);
+    wrenWriteBarrier(vm, &module->obj,
+                     OBJ_VAL(module->variableNames.data[symbol]));
     wrenValueBufferWrite(vm, &module->variables, value);
+    wrenWriteBarrier(vm, &module->obj, value);
   }
   else if (IS_NUM(module->variables.data[symbol]))
   {
@@ -1619,6 +2379,7 @@ int wrenDefineVariable(WrenVM* vm, ObjModule* module, const char* name,
     // Now we have a real definition.
     if(line) *line = (int)AS_NUM(module->variables.data[symbol]);
     module->variables.data[symbol] = value;
+    wrenWriteBarrier(vm, &module->obj, value);
 
 	// If this was a localname we want to error if it was 
 	// referenced before this definition.
@@ -1858,6 +2619,7 @@ void wrenSetListElement(WrenVM* vm, int listSlot, int index, int elementSlot)
   ASSERT(usedIndex != UINT32_MAX, "Index out of bounds.");
   
   list->elements.data[usedIndex] = vm->apiStack[elementSlot];
+  wrenWriteBarrier(vm, &list->obj, vm->apiStack[elementSlot]);
 }
 
 void wrenInsertInList(WrenVM* vm, int listSlot, int index, int elementSlot)
@@ -2068,6 +2830,20 @@ bool wrenHasModule(WrenVM* vm, const char* module)
   return moduleObj != NULL;
 }
 
+bool wrenHasMethod(WrenVM* vm, int slot, const char* signature)
+{
+  ASSERT(signature != NULL, "Signature cannot be NULL.");
+  validateApiSlot(vm, slot);
+
+  // A method nobody has ever named can't be defined anywhere.
+  int symbol = wrenSymbolTableFind(&vm->methodNames, signature,
+                                   strlen(signature));
+  if (symbol == -1) return false;
+
+  ObjClass* classObj = wrenGetClassInline(vm, vm->apiStack[slot]);
+  return wrenFindMethod(vm, classObj, symbol) != NULL;
+}
+
 void wrenAbortFiber(WrenVM* vm, int slot)
 {
   validateApiSlot(vm, slot);
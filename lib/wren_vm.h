@@ -3,6 +3,7 @@
 
 #include "wren_common.h"
 #include "wren_compiler.h"
+#include "wren_jit.h"
 #include "wren_value.h"
 #include "wren_utils.h"
 
@@ -67,9 +68,52 @@ struct WrenVM
   // The number of total allocated bytes that will trigger the next GC.
   size_t nextGC;
 
+  // The number of bytes the last full collection found live.
+  size_t liveBytes;
+
+  // The collector's counters, see [wrenGetHeapStats].
+  WrenHeapStats heapStats;
+
+  // Set when a GC could not bring the heap under [WrenConfiguration.maxHeapSize].
+  // The interpreter checks it before each call and aborts the running fiber.
+  bool heapExceeded;
+
   // The first object in the linked list of all currently allocated objects.
   Obj* first;
 
+  // Generation data:
+
+  // The number of regions begun and not yet ended. While it is not zero, new
+  // objects are allocated young even without a nursery.
+  int regionDepth;
+
+  // The first object in the linked list of young objects. They are kept apart
+  // from [first] so that a minor collection only has to walk them.
+  Obj* young;
+
+  // The number of bytes allocated since the last collection while objects
+  // were allocated young. A minor collection is triggered when it passes
+  // [WrenConfiguration.nurserySize].
+  size_t youngBytes;
+
+  // The old objects that may refer to young ones, and so must be traced by a
+  // minor collection. See [wrenWriteBarrier].
+  Obj** remembered;
+  int rememberedCount;
+  int rememberedCapacity;
+
+  // Whether the collection in progress is a minor one.
+  bool collectingYoung;
+
+  // The old objects the last full collection has not swept yet. Those it
+  // reached are still marked.
+  Obj* unswept;
+
+  // The old objects swept and kept, in order, and where the next one goes.
+  // They are put back in [first] once the sweep is done.
+  Obj* swept;
+  Obj** sweptTail;
+
   // The "gray" set for the garbage collector. This is the stack of unprocessed
   // objects while a garbage collection pass is in process.
   Obj** gray;
@@ -111,6 +155,16 @@ struct WrenVM
   // There is a single global symbol table for all method names on all classes.
   // Method calls are dispatched directly by index in this table.
   SymbolTable methodNames;
+
+  // The methods of all classes. See [ObjClass.methodBase].
+  MethodEntryBuffer methods;
+
+  // No entry of [methods] before this one is empty.
+  int methodsFree;
+
+  // The executable memory of the functions compiled to machine code, or `NULL`
+  // before the first one is. See wren_jit.h.
+  JitArena* jit;
 };
 
 // Simple iterator struct for maps and lists, in this impementation
@@ -213,6 +267,43 @@ static inline void wrenCallFunction(WrenVM* vm, ObjFiber* fiber,
 // Marks [obj] as a GC root so that it doesn't get collected.
 void wrenPushRoot(WrenVM* vm, Obj* obj);
 
+// Frees the rest of the objects the last full collection found unreachable.
+void wrenFinishSweep(WrenVM* vm);
+
+// Adds [obj] to the remembered set.
+void wrenRemember(WrenVM* vm, Obj* obj);
+
+// Records a store of [value] into [obj]. It must follow every store into an
+// object that may be older than the value stored, except into the stack of
+// the running fiber, or a minor collection may free a young object that is
+// only referenced from an old one.
+static inline void wrenWriteBarrier(WrenVM* vm, Obj* obj, Value value)
+{
+  if (vm->young != NULL && IS_OBJ(value) && AS_OBJ(value)->isYoung &&
+      !obj->isYoung && !obj->isRemembered)
+  {
+    wrenRemember(vm, obj);
+  }
+}
+
+// Whether new objects are allocated young.
+static inline bool wrenAllocatesYoung(WrenVM* vm)
+{
+  return vm->config.nurserySize > 0 || vm->regionDepth > 0;
+}
+
+// Remembers [fiber] when it starts running. Stores into the stack of the
+// running fiber have no write barrier, so a fiber that has run is traced
+// whole by the next minor collection.
+static inline void wrenRememberFiber(WrenVM* vm, ObjFiber* fiber)
+{
+  if (wrenAllocatesYoung(vm) && !fiber->obj.isYoung &&
+      !fiber->obj.isRemembered)
+  {
+    wrenRemember(vm, &fiber->obj);
+  }
+}
+
 // Removes the most recently pushed temporary root.
 void wrenPopRoot(WrenVM* vm);
 
@@ -251,6 +342,19 @@ static inline ObjClass* wrenGetClassInline(WrenVM* vm, Value value)
   return NULL;
 }
 
+// Returns the method [classObj] has for [symbol], or `NULL` if it has none.
+static inline Method* wrenFindMethod(WrenVM* vm, ObjClass* classObj,
+                                     int symbol)
+{
+  // Rows may be shifted left of the table, so a negative index wraps around
+  // and fails the bounds check.
+  unsigned int index = (unsigned int)(classObj->methodBase + symbol);
+  if (index >= (unsigned int)vm->methods.count) return NULL;
+
+  MethodEntry* entry = &vm->methods.data[index];
+  return entry->owner == classObj ? &entry->method : NULL;
+}
+
 // Returns `true` if [name] is a local variable name (starts with a lowercase
 // letter).
 static inline bool wrenIsLocalName(const char* name)
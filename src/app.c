@@ -0,0 +1,846 @@
+#include "server.h"
+#include <ctype.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+
+HttpApplication *applications = NULL;
+static unsigned int app_workers = 0;
+
+/** the idle collection budget of an app that does not set one, 2ms */
+#define APP_IDLE_GC_BUDGET 2000000ULL
+/** the heap bytes per nanosecond a replica starts estimating idle collections with */
+#define APP_IDLE_GC_RATE 0.25
+
+/** the core module compiled once, so creating a replica VM skips compiling it */
+static WrenCodeImage *core_image = NULL;
+/** the route helper below, compiled once and loaded first into every replica VM */
+static WrenCodeImage *routes_image = NULL;
+
+/**
+ * reads a whole file into a NUL terminated, heap allocated buffer and stores
+ * its length in [length] if that is not `NULL`.
+ * returns `NULL` if the file can not be read.
+ */
+static char *read_file(const char *path, size_t *length)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+
+    char *source = malloc(size + 1);
+    if (source == NULL || fread(source, 1, size, fp) != (size_t)size)
+    {
+        free(source);
+        fclose(fp);
+        return NULL;
+    }
+    source[size] = '\0';
+    fclose(fp);
+    if (length != NULL)
+    {
+        *length = (size_t)size;
+    }
+    return source;
+}
+
+static char *read_source(const char *path)
+{
+    return read_file(path, NULL);
+}
+
+/**
+ * compiled modules are cached next to their script, as <script>.img, so that
+ * a restart only has to compile what changed.
+ */
+static struct Bstring *cache_path(const char *path)
+{
+    struct Bstring *cache = bstring_init(0, path);
+    if (cache != NULL)
+    {
+        bstring_append(cache, ".img");
+    }
+    return cache;
+}
+
+/**
+ * returns the cached image of [module] if there is one and it was compiled
+ * from exactly [source] by this build, `NULL` otherwise.
+ */
+static WrenCodeImage *cache_read(const char *module, const char *path, const char *source)
+{
+    struct Bstring *cache = cache_path(path);
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    size_t size;
+    char *bytes = read_file(cache->data, &size);
+    bstring_free(cache);
+    if (bytes == NULL)
+    {
+        return NULL;
+    }
+
+    WrenCodeImage *image = wrenDeserializeImage(module, source, bytes, size);
+    free(bytes);
+    return image;
+}
+
+static void cache_write_bytes(void *fp, const void *bytes, size_t length)
+{
+    fwrite(bytes, 1, length, (FILE *)fp);
+}
+
+/**
+ * writes [image] to the cache of the script at [path]. the file is written
+ * under a temporary name and renamed into place, so a concurrent reader sees
+ * either the old cache or the new one. failing to write is not an error, the
+ * module is simply compiled again next time.
+ */
+static void cache_write(WrenCodeImage *image, const char *path)
+{
+    struct Bstring *cache = cache_path(path);
+    if (cache == NULL)
+    {
+        return;
+    }
+
+    struct Bstring *tmp = bstring_init(0, cache->data);
+    bstring_append(tmp, ".XXXXXX");
+    int fd = mkstemp(tmp->data);
+    FILE *fp = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (fp != NULL)
+    {
+        wrenSerializeImage(image, cache_write_bytes, fp);
+        if (fclose(fp) != 0 || rename(tmp->data, cache->data) != 0)
+        {
+            remove(tmp->data);
+        }
+    }
+    else if (fd >= 0)
+    {
+        close(fd);
+        remove(tmp->data);
+    }
+
+    bstring_free(tmp);
+    bstring_free(cache);
+}
+
+/**
+ * finds the image of the module [name] imported by [app], loading it from the
+ * cache or compiling it in [vm] the first time any replica imports it.
+ * returns false if the module does not compile.
+ *
+ * an image compiled here matches the symbols of the replica that compiled it.
+ * the other replicas use it when their symbols line up, and otherwise compile
+ * the source themselves.
+ */
+static bool app_import_image(WrenVM *vm, HttpApplication *app, const char *name, const char *path,
+                             const char *source, WrenCodeImage **image)
+{
+    HttpImport *import = NULL;
+    bool ok = true;
+
+    pthread_mutex_lock(&app->imports_lock);
+    HASH_FIND_STR(app->imports, name, import);
+    if (import == NULL)
+    {
+        WrenCodeImage *compiled = cache_read(name, path, source);
+        if (compiled == NULL)
+        {
+            compiled = wrenCompileImage(vm, name, source);
+            if (compiled != NULL)
+                cache_write(compiled, path);
+        }
+
+        if (compiled != NULL)
+        {
+            import = calloc(1, sizeof(HttpImport));
+            import->name = strdup(name);
+            import->source = strdup(source);
+            import->image = compiled;
+            HASH_ADD_KEYPTR(hh, app->imports, import->name, strlen(import->name), import);
+        }
+        else
+        {
+            ok = false;
+        }
+    }
+    pthread_mutex_unlock(&app->imports_lock);
+
+    // images are kept for the lifetime of the app, so one compiled from an
+    // older version of the file is never handed out for the new source
+    *image = NULL;
+    if (import != NULL && strcmp(import->source, source) == 0)
+    {
+        *image = import->image;
+    }
+    return ok;
+}
+
+/**
+ * the reallocateFn of every VM, [user_data] is the replica the VM belongs to.
+ * each replica only ever runs on its own worker, so its heap needs no locks.
+ */
+static void *app_reallocate(void *memory, size_t size, void *user_data)
+{
+    return slab_reallocate(&((HttpAppReplica *)user_data)->heap, memory, size);
+}
+
+static void app_write(WrenVM *vm, const char *text)
+{
+    fputs(text, stdout);
+}
+
+static void app_error(WrenVM *vm, WrenErrorType type, const char *module, int line, const char *message)
+{
+    HttpAppReplica *replica = wrenGetUserData(vm);
+
+    switch (type)
+    {
+    case WREN_ERROR_COMPILE:
+        fprintf(stderr, "[%s#%d] %s:%d: %s\n", replica->app->name, replica->worker, module, line, message);
+        break;
+    case WREN_ERROR_RUNTIME:
+        fprintf(stderr, "[%s#%d] runtime error: %s\n", replica->app->name, replica->worker, message);
+        break;
+    case WREN_ERROR_STACK_TRACE:
+        fprintf(stderr, "[%s#%d]   %s:%d in %s\n", replica->app->name, replica->worker, module, line, message);
+        break;
+    }
+}
+
+static void app_load_module_complete(WrenVM *vm, const char *name, WrenLoadModuleResult result)
+{
+    free((char *)result.source);
+}
+
+/**
+ * imports are resolved relative to the directory of the app's main script,
+ * except for the built in wrensong module.
+ */
+static WrenLoadModuleResult app_load_module(WrenVM *vm, const char *name)
+{
+    HttpAppReplica *replica = wrenGetUserData(vm);
+    WrenLoadModuleResult result = {0};
+
+    if (strcmp(name, "wrensong") == 0)
+    {
+        result.source = http_module_source;
+        return result;
+    }
+
+    struct Bstring *path = bstring_init(0, replica->app->dir->data);
+    if (path == NULL)
+    {
+        return result;
+    }
+    bstring_append(path, name);
+    bstring_append(path, ".wren");
+
+    result.source = read_source(path->data);
+    result.onComplete = app_load_module_complete;
+    if (result.source != NULL &&
+        !app_import_image(vm, replica->app, name, path->data, result.source, &result.image))
+    {
+        // the errors have been reported, don't compile it a second time
+        free((char *)result.source);
+        result.source = NULL;
+    }
+    bstring_free(path);
+    return result;
+}
+
+HttpApplication *http_app_add(const char *name, const char *path)
+{
+    HttpApplication *app = NULL;
+    HASH_FIND_STR(applications, name, app);
+    if (app != NULL)
+    {
+        fprintf(stderr, "Application %s is defined twice\n", name);
+        return NULL;
+    }
+
+    app = calloc(1, sizeof(HttpApplication));
+    if (app == NULL)
+    {
+        return NULL;
+    }
+    snprintf(app->name, sizeof(app->name), "%s", name);
+    pthread_mutex_init(&app->imports_lock, NULL);
+    app->path = bstring_init(0, path);
+
+    // everything up to and including the last '/' of the script path
+    const char *slash = strrchr(path, '/');
+    unsigned int dir_len = slash == NULL ? 0 : (unsigned int)(slash - path + 1);
+    app->dir = bstring_init(dir_len + 1, NULL);
+    memcpy(app->dir->data, path, dir_len);
+    app->dir->data[dir_len] = '\0';
+    app->dir->length = dir_len;
+    app->idle_gc_budget_ns = APP_IDLE_GC_BUDGET;
+
+    wrenInitConfiguration(&app->vm_config);
+    app->vm_config.reallocateFn = app_reallocate;
+    app->vm_config.writeFn = app_write;
+    app->vm_config.errorFn = app_error;
+    app->vm_config.loadModuleFn = app_load_module;
+    app->vm_config.bindForeignMethodFn = http_module_bind_method;
+    app->vm_config.bindForeignClassFn = http_module_bind_class;
+
+    HASH_ADD_STR(applications, name, app);
+    return app;
+}
+
+HttpApplication *http_app_find(const char *host)
+{
+    HttpApplication *app = NULL;
+    char name[128];
+
+    if (host == NULL)
+    {
+        return NULL;
+    }
+
+    // drop the port from the Host header
+    size_t len = strcspn(host, ":");
+    if (len >= sizeof(name))
+    {
+        return NULL;
+    }
+    memcpy(name, host, len);
+    name[len] = '\0';
+
+    HASH_FIND_STR(applications, name, app);
+    return app;
+}
+
+/**
+ * flattens the `#!route` attributes on the methods of a class into a list of
+ * `[method, path, signature]` triples, so they can be read through the slot
+ * API. the method is the attribute key and the path its value, as in
+ * `#!route(get = "/users/:id")`.
+ */
+static const char *routes_source =
+    "class Routes {\n"
+    "  static of(app) {\n"
+    "    var routes = []\n"
+    "    var attributes = app.attributes\n"
+    "    if (attributes == null || attributes.methods == null) return routes\n"
+    "    for (method in attributes.methods) {\n"
+    "      var group = method.value[\"route\"]\n"
+    "      if (group != null) {\n"
+    "        for (verb in group) {\n"
+    "          for (path in verb.value) routes.addAll([verb.key, path, method.key])\n"
+    "        }\n"
+    "      }\n"
+    "    }\n"
+    "    return routes\n"
+    "  }\n"
+    "}\n";
+
+/**
+ * compiles the route helper in a fresh VM. images only load into VMs that know
+ * no method the compiling VM didn't, so it is loaded before anything else,
+ * including into the VM that compiles the main scripts.
+ */
+static WrenCodeImage *app_compile_routes(void)
+{
+    WrenConfiguration config;
+    wrenInitConfiguration(&config);
+    config.coreImage = core_image;
+    WrenVM *vm = wrenNewVM(&config);
+    WrenCodeImage *image = wrenCompileImage(vm, "wrensong/routes", routes_source);
+    wrenFreeVM(vm);
+    return image;
+}
+
+/**
+ * compiles the main script of [app] once, in a throwaway VM. every replica then
+ * runs the resulting image, sharing its bytecode instead of compiling again.
+ * a valid cache skips the compiler, and the VM, entirely.
+ */
+static void app_compile(HttpApplication *app)
+{
+    char *source = read_source(app->path->data);
+    if (source == NULL)
+    {
+        fprintf(stderr, "[%s] Failed to read %s\n", app->name, app->path->data);
+        return;
+    }
+
+    app->image = cache_read(app->name, app->path->data, source);
+    if (app->image != NULL)
+    {
+        free(source);
+        return;
+    }
+
+    HttpAppReplica compiler = {.app = app, .worker = -1, .vm = NULL};
+    WrenConfiguration config = app->vm_config;
+    config.userData = &compiler;
+    compiler.vm = wrenNewVM(&config);
+    if (wrenInterpretImage(compiler.vm, routes_image) == WREN_RESULT_SUCCESS)
+    {
+        app->image = wrenCompileImage(compiler.vm, app->name, source);
+    }
+    wrenFreeVM(compiler.vm);
+    slab_release(&compiler.heap);
+    if (app->image != NULL)
+    {
+        cache_write(app->image, app->path->data);
+    }
+    free(source);
+}
+
+void http_apps_start(unsigned int workers)
+{
+    HttpApplication *app, *tmp;
+
+    app_workers = workers;
+    core_image = wrenCompileCoreImage(NULL);
+    routes_image = app_compile_routes();
+    HASH_ITER(hh, applications, app, tmp)
+    {
+        app->vm_config.coreImage = core_image;
+        app_compile(app);
+        app->replicas = calloc(workers, sizeof(HttpAppReplica));
+        for (unsigned int i = 0; i < workers; i++)
+        {
+            app->replicas[i].app = app;
+            app->replicas[i].worker = (int)i;
+            app->replicas[i].idle_gc_rate = APP_IDLE_GC_RATE;
+        }
+    }
+}
+
+static enum HttpMethodTyp app_method(const char *name)
+{
+    for (int i = 0; KNOWN_HTTP_METHODS[i].str != NULL; i++)
+    {
+        if (strcasecmp(name, KNOWN_HTTP_METHODS[i].str) == 0)
+        {
+            return KNOWN_HTTP_METHODS[i].typ;
+        }
+    }
+    return HTTP_UNKNOWN;
+}
+
+/**
+ * builds the router of a freshly loaded replica from the `#!route` attributes
+ * on App, with a call handle for every route. route handlers are static
+ * methods taking one argument per path parameter, optionally followed by the
+ * Request and the Response.
+ */
+static bool app_resolve_routes(HttpAppReplica *replica)
+{
+    HttpApplication *app = replica->app;
+    WrenVM *vm = replica->vm;
+
+    wrenEnsureSlots(vm, 4);
+    wrenGetVariable(vm, "wrensong/routes", "Routes", 0);
+    wrenSetSlotHandle(vm, 1, replica->receiver);
+    WrenHandle *of = wrenMakeCallHandle(vm, "of(_)");
+    WrenInterpretResult result = wrenCall(vm, of);
+    wrenReleaseHandle(vm, of);
+    if (result != WREN_RESULT_SUCCESS)
+    {
+        return false;
+    }
+
+    int count = wrenGetListCount(vm, 0) / 3;
+    if (count == 0)
+    {
+        return true;
+    }
+
+    replica->router = router_new();
+    replica->routes = calloc(count, sizeof(HttpHandler));
+    if (replica->router == NULL || replica->routes == NULL)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        wrenGetListElement(vm, 0, i * 3, 1);
+        wrenGetListElement(vm, 0, i * 3 + 1, 2);
+        wrenGetListElement(vm, 0, i * 3 + 2, 3);
+        const char *signature = wrenGetSlotString(vm, 3);
+
+        enum HttpMethodTyp method = app_method(wrenGetSlotString(vm, 1));
+        if (method == HTTP_UNKNOWN)
+        {
+            fprintf(stderr, "[%s#%d] unknown method '%s' in route of %s\n", app->name, replica->worker,
+                    wrenGetSlotString(vm, 1), signature);
+            return false;
+        }
+        if (wrenGetSlotType(vm, 2) != WREN_TYPE_STRING)
+        {
+            fprintf(stderr, "[%s#%d] route of %s needs a path\n", app->name, replica->worker, signature);
+            return false;
+        }
+        if (strncmp(signature, "static ", 7) != 0)
+        {
+            fprintf(stderr, "[%s#%d] route handler %s must be static\n", app->name, replica->worker, signature);
+            return false;
+        }
+        signature += 7;
+
+        const char *path = wrenGetSlotString(vm, 2);
+        int params = router_add(replica->router, method, path, i);
+        if (params < 0)
+        {
+            fprintf(stderr, "[%s#%d] invalid or duplicate route %s %s\n", app->name, replica->worker,
+                    wrenGetSlotString(vm, 1), path);
+            return false;
+        }
+
+        int arity = 0;
+        const char *args = strchr(signature, '(');
+        for (; args != NULL && *args != '\0'; args++)
+        {
+            arity += (*args == '_');
+        }
+        if (arity < params || arity > params + 2)
+        {
+            fprintf(stderr, "[%s#%d] route %s has %d parameters but %s takes %d\n", app->name, replica->worker,
+                    path, params, signature, arity);
+            return false;
+        }
+
+        replica->routes[i].method = wrenMakeCallHandle(vm, signature);
+        replica->routes[i].context = arity - params;
+        replica->route_count = i + 1;
+    }
+    return true;
+}
+
+/**
+ * looks for a static method [name] on the App in slot 0 that takes the
+ * Request and the Response, or just the Request.
+ */
+static bool app_find_handler(WrenVM *vm, const char *name, HttpHandler *handler)
+{
+    char signature[32];
+
+    for (int context = 2; context >= 1; context--)
+    {
+        snprintf(signature, sizeof(signature), "%s(%s)", name, context == 2 ? "_,_" : "_");
+        if (wrenHasMethod(vm, 0, signature))
+        {
+            handler->method = wrenMakeCallHandle(vm, signature);
+            handler->context = context;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * looks up the App class of a freshly loaded replica and a call handle for the
+ * handler of each HTTP method: a static method named after the lowercase
+ * method, such as `get(_)`, or `handle(_)` for any method without one.
+ */
+static bool app_resolve_handlers(HttpAppReplica *replica)
+{
+    HttpApplication *app = replica->app;
+    WrenVM *vm = replica->vm;
+
+    if (!wrenHasVariable(vm, app->name, "App"))
+    {
+        fprintf(stderr, "[%s#%d] %s does not define App\n", app->name, replica->worker, app->path->data);
+        return false;
+    }
+
+    wrenEnsureSlots(vm, 1);
+    wrenGetVariable(vm, app->name, "App", 0);
+    replica->receiver = wrenGetSlotHandle(vm, 0);
+
+    for (int i = 0; KNOWN_HTTP_METHODS[i].str != NULL; i++)
+    {
+        char name[16];
+        size_t len = strlen(KNOWN_HTTP_METHODS[i].str);
+        for (size_t j = 0; j <= len; j++)
+        {
+            name[j] = (char)tolower((unsigned char)KNOWN_HTTP_METHODS[i].str[j]);
+        }
+
+        HttpHandler *handler = &replica->handlers[KNOWN_HTTP_METHODS[i].typ];
+        if (!app_find_handler(vm, name, handler))
+        {
+            app_find_handler(vm, "handle", handler);
+        }
+    }
+    return app_resolve_routes(replica);
+}
+
+static void app_release_handlers(HttpAppReplica *replica)
+{
+    if (replica->receiver != NULL)
+    {
+        wrenReleaseHandle(replica->vm, replica->receiver);
+        replica->receiver = NULL;
+    }
+    for (int i = 0; i < HTTP_METHOD_COUNT; i++)
+    {
+        if (replica->handlers[i].method != NULL)
+        {
+            wrenReleaseHandle(replica->vm, replica->handlers[i].method);
+            replica->handlers[i].method = NULL;
+        }
+    }
+    for (int i = 0; i < replica->route_count; i++)
+    {
+        wrenReleaseHandle(replica->vm, replica->routes[i].method);
+    }
+    free(replica->routes);
+    replica->routes = NULL;
+    replica->route_count = 0;
+    router_free(replica->router);
+    replica->router = NULL;
+    http_module_free(replica);
+}
+
+HttpAppReplica *http_app_replica(HttpApplication *app)
+{
+    int worker = pool_worker_id();
+    assert(worker >= 0 && (unsigned int)worker < app_workers);
+
+    HttpAppReplica *replica = &app->replicas[worker];
+    if (replica->vm != NULL)
+    {
+        return replica;
+    }
+
+    // the script did not compile, errors were reported at startup
+    if (app->image == NULL)
+    {
+        return NULL;
+    }
+
+    // first request for this app on this worker, so bring up its VM. only the
+    // owning worker ever touches a replica, so no locking is needed here.
+    WrenConfiguration config = app->vm_config;
+    config.userData = replica;
+    replica->vm = wrenNewVM(&config);
+
+    WrenInterpretResult result = wrenInterpretImage(replica->vm, routes_image);
+    if (result == WREN_RESULT_SUCCESS)
+    {
+        result = wrenInterpretImage(replica->vm, app->image);
+    }
+    if (result != WREN_RESULT_SUCCESS || !http_module_init(replica) || !app_resolve_handlers(replica))
+    {
+        app_release_handlers(replica);
+        wrenFreeVM(replica->vm);
+        slab_release(&replica->heap);
+        replica->vm = NULL;
+        return NULL;
+    }
+    return replica;
+}
+
+static unsigned long long app_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+int http_apps_idle(unsigned int worker, void *arg)
+{
+    HttpApplication *app, *tmp;
+    int more = 0;
+
+    (void)arg;
+    HASH_ITER(hh, applications, app, tmp)
+    {
+        HttpAppReplica *replica = &app->replicas[worker];
+        if (replica->vm == NULL || replica->idle_gc_left_ns == 0)
+        {
+            continue;
+        }
+
+        // the time left, in the bytes the VM got through in that time so far
+        size_t budget = (size_t)((double)replica->idle_gc_left_ns * replica->idle_gc_rate);
+        unsigned long long start = app_now_ns();
+        size_t visited = wrenCollectGarbageIdle(replica->vm, budget);
+        unsigned long long elapsed = app_now_ns() - start;
+        if (visited == 0)
+        {
+            replica->idle_gc_left_ns = 0;
+            continue;
+        }
+
+        replica->idle_gc_slices++;
+        replica->idle_gc_ns += elapsed;
+        if (elapsed > replica->idle_gc_left_ns)
+        {
+            // only a full collection goes past the budget
+            replica->idle_gc_overrun_ns += elapsed - replica->idle_gc_left_ns;
+            replica->idle_gc_left_ns = 0;
+        }
+        else
+        {
+            replica->idle_gc_left_ns -= elapsed;
+        }
+        if (elapsed > 0)
+        {
+            replica->idle_gc_rate = replica->idle_gc_rate * 0.75 + ((double)visited / (double)elapsed) * 0.25;
+        }
+        more |= replica->idle_gc_left_ns > 0;
+    }
+    return more;
+}
+
+typedef struct
+{
+    FILE *out;
+    const char *app;
+    unsigned int worker;
+} AppReport;
+
+static void app_report_class(const char *class_name, size_t instances, size_t bytes, void *user_data)
+{
+    AppReport *report = user_data;
+    fprintf(report->out, "heap app=%s worker=%u class=%s count=%zu bytes=%zu\n", report->app, report->worker,
+            class_name, instances, bytes);
+}
+
+void http_apps_report(unsigned int worker, FILE *out)
+{
+    HttpApplication *app, *tmp;
+
+    HASH_ITER(hh, applications, app, tmp)
+    {
+        HttpAppReplica *replica = &app->replicas[worker];
+        if (replica->vm == NULL)
+        {
+            continue;
+        }
+
+        WrenHeapStats stats;
+        wrenGetHeapStats(replica->vm, &stats);
+        fprintf(out,
+                "heap app=%s worker=%u full_gcs=%zu minor_gcs=%zu pause_ms=%.3f max_pause_ms=%.3f "
+                "allocated=%zu freed=%zu size=%zu live=%zu next_gc=%zu idle_gc_slices=%llu idle_gc_ms=%.3f\n",
+                app->name, worker, stats.fullCollections, stats.minorCollections, stats.pauseTime * 1000.0,
+                stats.maxPauseTime * 1000.0, stats.bytesAllocated, stats.bytesFreed, stats.heapSize,
+                stats.liveBytes, stats.nextGC, replica->idle_gc_slices, (double)replica->idle_gc_ns / 1e6);
+
+        const struct
+        {
+            const char *name;
+            const WrenObjectStats *objects;
+        } types[] = {
+            {"class", &stats.classes},   {"closure", &stats.closures}, {"fiber", &stats.fibers},
+            {"fn", &stats.fns},          {"foreign", &stats.foreigns}, {"instance", &stats.instances},
+            {"list", &stats.lists},      {"map", &stats.maps},         {"module", &stats.modules},
+            {"range", &stats.ranges},    {"string", &stats.strings},   {"upvalue", &stats.upvalues},
+        };
+        for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+        {
+            fprintf(out, "heap app=%s worker=%u type=%s count=%zu bytes=%zu\n", app->name, worker, types[i].name,
+                    types[i].objects->count, types[i].objects->bytes);
+        }
+
+        AppReport report = {out, app->name, worker};
+        wrenGetClassStats(replica->vm, app_report_class, &report);
+    }
+}
+
+static void app_write_dump(void *user_data, const void *bytes, size_t length)
+{
+    fwrite(bytes, 1, length, user_data);
+}
+
+void http_apps_dump(unsigned int worker, const char *dir)
+{
+    HttpApplication *app, *tmp;
+
+    HASH_ITER(hh, applications, app, tmp)
+    {
+        HttpAppReplica *replica = &app->replicas[worker];
+        if (replica->vm == NULL)
+        {
+            continue;
+        }
+
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s.%u.%ld.heap", dir, app->name, worker, (long)time(NULL));
+        FILE *file = fopen(path, "wb");
+        if (file == NULL)
+        {
+            fprintf(stderr, "Failed to write heap dump %s: %s\n", path, strerror(errno));
+            continue;
+        }
+
+        unsigned long long start = app_now_ns();
+        bool complete = wrenDumpHeap(replica->vm, app_write_dump, file);
+        if (fclose(file) != 0 || !complete)
+        {
+            fprintf(stderr, "Heap dump %s is incomplete\n", path);
+            continue;
+        }
+        fprintf(stderr, "Wrote heap dump %s in %.1fms\n", path, (double)(app_now_ns() - start) / 1e6);
+    }
+}
+
+void http_apps_free(void)
+{
+    HttpApplication *app, *tmp;
+
+    HASH_ITER(hh, applications, app, tmp)
+    {
+        HASH_DEL(applications, app);
+        if (app->replicas != NULL)
+        {
+            for (unsigned int i = 0; i < app_workers; i++)
+            {
+                if (app->replicas[i].vm != NULL)
+                {
+                    app_release_handlers(&app->replicas[i]);
+                    wrenFreeVM(app->replicas[i].vm);
+                    slab_release(&app->replicas[i].heap);
+                }
+            }
+            free(app->replicas);
+        }
+        // only once every replica that ran it is gone
+        if (app->image != NULL)
+            wrenFreeCodeImage(app->image);
+        HttpImport *import, *next;
+        HASH_ITER(hh, app->imports, import, next)
+        {
+            HASH_DEL(app->imports, import);
+            wrenFreeCodeImage(import->image);
+            free(import->name);
+            free(import->source);
+            free(import);
+        }
+        pthread_mutex_destroy(&app->imports_lock);
+        bstring_free(app->path);
+        bstring_free(app->dir);
+        free(app);
+    }
+
+    if (routes_image != NULL)
+    {
+        wrenFreeCodeImage(routes_image);
+        routes_image = NULL;
+    }
+    if (core_image != NULL)
+    {
+        wrenFreeCodeImage(core_image);
+        core_image = NULL;
+    }
+}
@@ -1,6 +1,7 @@
 
 #include "bstring.h"
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
 /**
@@ -1,111 +1,544 @@
 #include "http.h"
 #include <event2/event.h>
 #include <event2/thread.h>
+#include <strings.h>
+
+const char HTTP_VERSION[] = "HTTP/1.1";
+
+const struct HttpMethod KNOWN_HTTP_METHODS[] = {
+    {.str = "GET", .typ = HTTP_GET},
+    {.str = "POST", .typ = HTTP_POST},
+    {.str = "PUT", .typ = HTTP_PUT},
+    {.str = "PATCH", .typ = HTTP_PATCH},
+    {.str = "DELETE", .typ = HTTP_DELETE},
+    {.str = NULL, .typ = HTTP_UNKNOWN},
+};
 
 struct Bstring *filename = NULL;
 void *thread_pool = NULL;
 HttpConnection *connections = NULL;
 struct event_base *http = NULL;
 pthread_t http_thread;
+static unsigned int http_workers = 0;
 
-void *_handle_connection(void *conn_fd_ptr)
+static void http_respond(struct bufferevent *bev, const char *status, const char *body, size_t body_len)
 {
-    assert(conn_fd_ptr != NULL);
-    HttpConnection *conn = conn_fd_ptr;
-    HttpRequest req = conn->request;
-    int closing = 0;
+    struct evbuffer *output = bufferevent_get_output(bev);
+    evbuffer_add_printf(output,
+                        "%s %s\r\n"
+                        "Content-Type: text/plain\r\n"
+                        "Content-Length: %zu\r\n\r\n",
+                        HTTP_VERSION, status, body_len);
+    evbuffer_add(output, body, body_len);
+}
 
-    char *parse_buffer = req._buffer;
+static void http_connection_free(struct bufferevent *bev, void *ptr)
+{
+    bufferevent_free(bev);
+    free(ptr);
+}
+
+static void http_connection_failed(struct bufferevent *bev, short events, void *ptr)
+{
+    http_connection_free(bev, ptr);
+}
 
-    // parse method & store it to req
-    char *method = strsep(&parse_buffer, " ");
-    int i = 0;
-    while (KNOWN_HTTP_METHODS[i].str != NULL)
+/**
+ * is done with the request read into [buffer] and closes [conn] if
+ * [closing] is set, once the response has been written. otherwise the next
+ * request is read if it has already arrived.
+ */
+static void http_connection_done(HttpConnection *conn, char *buffer, bool closing)
+{
+    free(buffer);
+    if (!closing)
     {
-        if (strcmp(method, KNOWN_HTTP_METHODS[i].str) == 0)
+        // the read callback runs on the event thread, which owns the input
+        struct bufferevent *bev = conn->bev;
+        bufferevent_lock(bev);
+        conn->busy = false;
+        if (evbuffer_get_length(bufferevent_get_input(bev)) > 0)
         {
-            req.method = KNOWN_HTTP_METHODS[i].typ;
-            break;
+            bufferevent_trigger(bev, EV_READ, BEV_TRIG_IGNORE_WATERMARKS | BEV_TRIG_DEFER_CALLBACKS);
+        }
+        bufferevent_unlock(bev);
+    }
+    else
+    {
+        // remove the connection from the hash table
+        HASH_DEL(connections, conn);
+
+        // freeing the bufferevent would drop the part of the response that
+        // is still queued, so that waits until the output is drained
+        struct bufferevent *bev = conn->bev;
+        bufferevent_lock(bev);
+        bufferevent_disable(bev, EV_READ);
+        if (evbuffer_get_length(bufferevent_get_output(bev)) == 0)
+        {
+            bufferevent_unlock(bev);
+            http_connection_free(bev, conn);
+            return;
+        }
+        // a client that stops reading must not keep the connection forever
+        struct timeval timeout = {30, 0};
+        bufferevent_set_timeouts(bev, NULL, &timeout);
+        bufferevent_setcb(bev, NULL, http_connection_free, http_connection_failed, conn);
+        bufferevent_unlock(bev);
+    }
+}
+
+/**
+ * completes [exchange] once its handler's fiber has stopped with [result],
+ * unless the handler only suspended itself to wait for something. a returned
+ * string becomes the response body, `null` means 404 unless the handler wrote
+ * a response itself. a handler that suspended without waiting for anything
+ * would never be resumed, so it fails like one that aborted.
+ */
+static void http_exchange_step(HttpExchange *exchange, WrenInterpretResult result)
+{
+    HttpAppReplica *replica = exchange->replica;
+    WrenVM *vm = replica->vm;
+
+    // the handler ran and left garbage behind, which can be collected while
+    // the worker has nothing else to do. a full collection that ran past an
+    // earlier budget is paid back first.
+    unsigned long long budget = replica->app->idle_gc_budget_ns;
+    unsigned long long repaid = replica->idle_gc_overrun_ns < budget ? replica->idle_gc_overrun_ns : budget;
+    replica->idle_gc_overrun_ns -= repaid;
+    replica->idle_gc_left_ns = budget - repaid;
+
+    // a suspended fiber leaves no slots behind, a wait resumes it later
+    bool suspended = result == WREN_RESULT_SUCCESS && wrenGetSlotCount(vm) == 0;
+    if (suspended && exchange->waiting)
+    {
+        return;
+    }
+
+    struct bufferevent *bev = exchange->conn->bev;
+    HttpResponseObject *response = exchange->response_object;
+    if (exchange->request_object != NULL)
+    {
+        http_request_release(replica, exchange->request_object);
+    }
+
+    // nothing resumes a handler that suspended for nothing, it fails and its
+    // connection is closed
+    bool closing = exchange->closing || suspended;
+    if (result != WREN_RESULT_SUCCESS || suspended)
+    {
+        // once the head is out there is no way to report the error but to
+        // end the connection before the body is complete
+        if (response != NULL && response->head_sent)
+        {
+            closing = true;
+        }
+        else
+        {
+            http_respond(bev, "500 Internal Server Error", "", 0);
+        }
+    }
+    else
+    {
+        int len = 0;
+        const char *body = NULL;
+        if (wrenGetSlotType(vm, 0) == WREN_TYPE_STRING)
+        {
+            body = wrenGetSlotBytes(vm, 0, &len);
+        }
+
+        if (response != NULL)
+        {
+            http_response_end(response, body, (size_t)len);
+        }
+        else if (body != NULL)
+        {
+            http_respond(bev, "200 OK", body, (size_t)len);
+        }
+        else
+        {
+            http_respond(bev, "404 Not Found", "", 0);
         }
-        i++;
     }
-    // unknowm method
-    if (req.method == HTTP_UNKNOWN)
+
+    if (response != NULL)
+    {
+        http_response_release(replica, response);
+    }
+
+    // the result is left in the API slot, where it would survive the region
+    if (wrenGetSlotCount(vm) > 0)
+    {
+        wrenSetSlotNull(vm, 0);
+    }
+    wrenEndRegion(vm);
+    http_connection_done(exchange->conn, exchange->request._buffer, closing);
+
+    // a wait the handler started but never suspended for still points here
+    if (exchange->waiting)
+    {
+        exchange->finished = true;
+        return;
+    }
+    free(exchange);
+}
+
+/**
+ * runs the request on the calling worker's replica of [app] in a fiber of
+ * its own. a path matching one of the app's routes calls the route's handler
+ * with the captured path parameters, any other path calls the App handler
+ * resolved for the method. either gets a Request for [req] and a Response if
+ * it takes them.
+ */
+static void http_dispatch(HttpApplication *app, HttpRequest *req, HttpConnection *conn, bool closing)
+{
+    HttpAppReplica *replica = http_app_replica(app);
+    if (replica == NULL)
+    {
+        http_respond(conn->bev, "500 Internal Server Error", "", 0);
+        http_connection_done(conn, req->_buffer, closing);
+        return;
+    }
+
+    WrenVM *vm = replica->vm;
+    RouteMatch match;
+    enum RouteResult route = ROUTE_NOT_FOUND;
+    if (replica->router != NULL)
+    {
+        route = router_match(replica->router, req->method, req->path, strcspn(req->path, "?"), &match);
+    }
+
+    HttpHandler *handler;
+    int params = 0;
+    if (route == ROUTE_FOUND)
+    {
+        handler = &replica->routes[match.route];
+        params = match.param_count;
+    }
+    else if (route == ROUTE_METHOD_NOT_ALLOWED)
+    {
+        http_respond(conn->bev, "405 Method Not Allowed", "", 0);
+        http_connection_done(conn, req->_buffer, closing);
+        return;
+    }
+    else if (replica->handlers[req->method].method != NULL)
+    {
+        handler = &replica->handlers[req->method];
+    }
+    else
+    {
+        // with routes declared, a path none of them claims simply isn't there
+        http_respond(conn->bev, replica->router != NULL ? "404 Not Found" : "405 Method Not Allowed", "", 0);
+        http_connection_done(conn, req->_buffer, closing);
+        return;
+    }
+
+    // the request outlives this task if the handler waits for something
+    HttpExchange *exchange = calloc(1, sizeof(HttpExchange));
+    if (exchange == NULL)
+    {
+        http_respond(conn->bev, "500 Internal Server Error", "", 0);
+        http_connection_done(conn, req->_buffer, closing);
+        return;
+    }
+    exchange->conn = conn;
+    exchange->request = *req;
+    exchange->replica = replica;
+    exchange->closing = closing;
+
+    // what the handler allocates is young until the exchange is over, and
+    // freed then unless it was kept somewhere
+    wrenBeginRegion(vm);
+
+    int slot = 1;
+    wrenEnsureSlots(vm, 3 + params);
+    wrenSetSlotHandle(vm, 0, replica->receiver);
+    for (int i = 0; i < params; i++)
+    {
+        wrenSetSlotBytes(vm, slot++, match.params[i].start, match.params[i].len);
+    }
+    if (handler->context >= 1)
+    {
+        exchange->request_object = http_request_acquire(replica, &exchange->request, slot++);
+    }
+    if (handler->context >= 2)
+    {
+        exchange->response_object = http_response_acquire(replica, conn->bev, slot++);
+    }
+
+    replica->current = exchange;
+    WrenInterpretResult result = wrenCall(vm, handler->method);
+    replica->current = NULL;
+    http_exchange_step(exchange, result);
+}
+
+typedef struct _HttpResume
+{
+    HttpExchange *exchange;
+    WrenHandle *fiber;
+} HttpResume;
+
+/**
+ * runs on the worker owning the exchange's replica, the only thread allowed
+ * to touch its VM.
+ */
+static void *http_resume(void *arg)
+{
+    HttpResume *resume = arg;
+    HttpExchange *exchange = resume->exchange;
+    HttpAppReplica *replica = exchange->replica;
+    WrenVM *vm = replica->vm;
+
+    exchange->waiting = false;
+    if (exchange->finished)
     {
+        wrenReleaseHandle(vm, resume->fiber);
+        free(exchange);
         return NULL;
     }
-    // parse path & store it to req
-    req.path = strsep(&parse_buffer, " ");
-    // parse http version
-    strsep(&parse_buffer, "\r");
-    // the \r was consumed but the \n is still remaining so consume it
-    parse_buffer++;
 
-    for (size_t i = 0; i < MAX_HEADERS; ++i)
+    wrenEnsureSlots(vm, 2);
+    wrenSetSlotHandle(vm, 0, resume->fiber);
+    wrenSetSlotNull(vm, 1);
+    wrenReleaseHandle(vm, resume->fiber);
+
+    replica->current = exchange;
+    WrenInterpretResult result = wrenCall(vm, replica->transfer);
+    replica->current = NULL;
+    http_exchange_step(exchange, result);
+    return NULL;
+}
+
+void http_exchange_resume(HttpExchange *exchange, WrenHandle *fiber)
+{
+    HttpResume *resume = malloc(sizeof(HttpResume));
+    resume->exchange = exchange;
+    resume->fiber = fiber;
+    pool_enqueue_to(thread_pool, (unsigned int)exchange->replica->worker, http_resume, resume, 1);
+}
+
+/**
+ * parses the head of the request in [req]'s buffer, filling in [req] and
+ * setting [closing] if the client asked for the connection to be closed.
+ * returns the status to answer with if the request can't be served, or NULL.
+ */
+static const char *http_request_parse(HttpRequest *req, bool *closing)
+{
+    req->method = HTTP_UNKNOWN;
+    req->path = NULL;
+    req->host = NULL;
+    req->command = NULL;
+    req->content_length = 0;
+    req->header_count = 0;
+
+    // the request line is the method, the path and the version
+    char *line = req->_buffer;
+    char *end = strstr(line, "\r\n");
+    if (end == NULL)
     {
-        char *header_line = strsep(&parse_buffer, "\r");
+        return "400 Bad Request";
+    }
+    *end = '\0';
+    char *next = end + 2;
 
-        parse_buffer++; // consume \n
+    char *method = strsep(&line, " ");
+    char *path = strsep(&line, " ");
+    if (path == NULL || line == NULL || method[0] == '\0' || path[0] != '/' ||
+        strncmp(line, "HTTP/1.", 7) != 0 || strchr(line, ' ') != NULL)
+    {
+        return "400 Bad Request";
+    }
+    for (int i = 0; KNOWN_HTTP_METHODS[i].str != NULL; i++)
+    {
+        if (strcmp(method, KNOWN_HTTP_METHODS[i].str) == 0)
+        {
+            req->method = KNOWN_HTTP_METHODS[i].typ;
+            break;
+        }
+    }
+    if (req->method == HTTP_UNKNOWN)
+    {
+        return "501 Not Implemented";
+    }
+    req->path = path;
 
-        // if the line was just "\r\n" i.e the end of headers section
-        if (header_line[0] == '\0')
+    // header lines follow up to an empty one
+    while (true)
+    {
+        line = next;
+        end = strstr(line, "\r\n");
+        if (end == NULL)
+        {
+            return "400 Bad Request";
+        }
+        *end = '\0';
+        next = end + 2;
+        if (line[0] == '\0')
         {
             break;
         }
+        if (req->header_count == MAX_HEADERS)
+        {
+            return "431 Request Header Fields Too Large";
+        }
 
-        char *key = strsep(&header_line, ":");
-        header_line++; // consume the space
-        char *value = strsep(&header_line, "\0");
+        char *name = strsep(&line, ":");
+        if (line == NULL || name[0] == '\0' || name[strcspn(name, " \t")] != '\0')
+        {
+            return "400 Bad Request";
+        }
+        // the value goes without the whitespace around it
+        char *value = line + strspn(line, " \t");
+        char *value_end = value + strlen(value);
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+        {
+            value_end--;
+        }
+        *value_end = '\0';
 
-        if (strncmp(key, "Content-Length", 14) == 0)
+        req->headers[req->header_count].name = name;
+        req->headers[req->header_count].value = value;
+        req->header_count++;
+
+        // header names are case-insensitive
+        if (strcasecmp(name, "Content-Length") == 0)
         {
-            req.content_length = atoi(value);
+            char *digits_end;
+            long length = strtol(value, &digits_end, 10);
+            if (value[0] < '0' || value[0] > '9' || *digits_end != '\0')
+            {
+                return "400 Bad Request";
+            }
+            if (length > MAX_BODY_LENGTH)
+            {
+                return "413 Payload Too Large";
+            }
+            req->content_length = (int)length;
+        }
+        else if (strcasecmp(name, "Transfer-Encoding") == 0)
+        {
+            // only bodies with a Content-Length are understood
+            return "501 Not Implemented";
         }
-        else if (strncmp(key, "Host", 4) == 0)
+        else if (strcasecmp(name, "Host") == 0)
         {
-            req.host = value;
+            req->host = value;
         }
-        else if (strncmp(key, "Command", 12) == 0)
+        else if (strcasecmp(name, "Command") == 0)
         {
-            req.command = value;
+            req->command = value;
         }
-        else if (strncmp(key, "Connection", 10) == 0)
+        else if (strcasecmp(name, "Connection") == 0)
         {
-            if (strncmp(value, "close", 5) == 0)
+            if (strcasecmp(value, "close") == 0)
             {
-                closing = 1;
+                *closing = true;
             }
         }
     }
+    return NULL;
+}
 
-    
+void *_handle_connection(void *conn_fd_ptr)
+{
+    assert(conn_fd_ptr != NULL);
+    HttpConnection *conn = conn_fd_ptr;
+    HttpRequest req = conn->request;
+    bool closing = conn->closing;
 
-    free(conn->request._buffer);
-    if (closing)
+    HttpApplication *app = http_app_find(req.host);
+    if (app == NULL)
     {
-        // remove the connection from the hash table
-        HASH_DEL(connections, conn);
-        bufferevent_free(conn->bev);
-        free(conn);
+        http_respond(conn->bev, "404 Not Found", "", 0);
+        http_connection_done(conn, req._buffer, closing);
+    }
+    else
+    {
+        http_dispatch(app, &req, conn, closing);
     }
     return NULL;
 }
 
-void _http_read(struct bufferevent *bev, short events, void *ptr)
+/**
+ * copies the first [len] bytes of [input] into a new buffer for [req] and
+ * parses the head at its start, see http_request_parse.
+ */
+static const char *http_request_read(HttpRequest *req, struct evbuffer *input, size_t len, bool *closing)
 {
-    HttpConnection *conn = ptr;
-    struct evbuffer *input = bufferevent_get_input(bev);
-    size_t len = evbuffer_get_length(input);
-    if (len == 0)
+    req->_buffer = malloc(len + 1);
+    if (req->_buffer == NULL)
+    {
+        return "500 Internal Server Error";
+    }
+    req->_buffer_len = len;
+    evbuffer_copyout(input, req->_buffer, len);
+    req->_buffer[len] = '\0';
+    *closing = false;
+    return http_request_parse(req, closing);
+}
+
+/**
+ * hands the next request in [conn]'s input to a worker once all of it has
+ * arrived, unless the one before it is still being handled. only the bytes
+ * of that request are taken, the rest waits for the next read. runs on the
+ * event thread with the bufferevent locked.
+ */
+static void http_connection_read(HttpConnection *conn)
+{
+    if (conn->busy)
+    {
+        return;
+    }
+
+    struct evbuffer *input = bufferevent_get_input(conn->bev);
+    struct evbuffer_ptr head_end = evbuffer_search(input, "\r\n\r\n", 4, NULL);
+    if (head_end.pos < 0 ? evbuffer_get_length(input) > MAX_HEAD_LENGTH
+                         : (size_t)head_end.pos + 4 > MAX_HEAD_LENGTH)
+    {
+        http_respond(conn->bev, "431 Request Header Fields Too Large", "", 0);
+        http_connection_done(conn, NULL, true);
         return;
-    conn->request._buffer = malloc(len + 1);
-    conn->request._buffer_len = len;
-    evbuffer_copyout(input, conn->request._buffer, len);
-    conn->request._buffer[len] = '\0';
-    conn->bev = bev;
+    }
+    if (head_end.pos < 0)
+    {
+        return;
+    }
+
+    HttpRequest *req = &conn->request;
+    size_t head_len = (size_t)head_end.pos + 4;
+    bool closing;
+    const char *error = http_request_read(req, input, head_len, &closing);
+    if (error == NULL && req->content_length > 0)
+    {
+        // the body is only known to be there once the head is parsed, then
+        // both are read again into a buffer that holds them
+        size_t len = head_len + (size_t)req->content_length;
+        free(req->_buffer);
+        req->_buffer = NULL;
+        if (evbuffer_get_length(input) < len)
+        {
+            return;
+        }
+        error = http_request_read(req, input, len, &closing);
+    }
+    if (error != NULL)
+    {
+        // nothing after a request that can't be parsed can be trusted
+        http_respond(conn->bev, error, "", 0);
+        http_connection_done(conn, req->_buffer, true);
+        return;
+    }
+
+    evbuffer_drain(input, req->_buffer_len);
+    conn->busy = true;
+    conn->closing = closing;
     pool_enqueue(thread_pool, conn, 0);
 }
 
+void _http_read(struct bufferevent *bev, void *ptr)
+{
+    http_connection_read(ptr);
+}
+
 void _http_event(struct bufferevent *bev, short events, void *ptr)
 {
 }
@@ -120,28 +553,90 @@ void http_handle_connection(int conn_fd, void *arg, int arg_len)
     HASH_ADD_INT(connections, fd, conn);
     // create a bufferevent for the connection
     struct bufferevent *b = NULL;
-    b = bufferevent_socket_new(http, -1, BEV_OPT_CLOSE_ON_FREE);
+    // responses are written from pool workers, so the bufferevent needs locking
+    b = bufferevent_socket_new(http, conn_fd, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE);
+    conn->bev = b;
     bufferevent_setcb(b, _http_read, NULL, _http_event, conn);
+    // stop reading from a client that sends more than one request can hold
+    bufferevent_setwatermark(b, EV_READ, 0, MAX_HEAD_LENGTH + MAX_BODY_LENGTH);
     bufferevent_enable(b, EV_READ);
 }
 
 void *http_thread_func(void *arg)
 {
     struct event_base *base = arg;
-    event_base_dispatch(base);
+    // keep running while there is nothing to wait for, handlers add timers
+    event_base_loop(base, EVLOOP_NO_EXIT_ON_EMPTY);
+    return NULL;
 }
 
 void http_start(int thread_count)
 {
     http = event_base_new();
+    http_workers = (unsigned int)thread_count;
+    http_apps_start(thread_count);
     thread_pool = pool_start(_handle_connection, thread_count);
+    pool_set_idle(thread_pool, http_apps_idle, NULL);
     pthread_create(&http_thread, NULL, http_thread_func, http);
 }
 
+void http_pool_stats(struct pool_stats *stats)
+{
+    pool_stats(thread_pool, stats);
+}
+
+/** the [q]th quantile of [hist] in microseconds */
+static double http_quantile_us(const struct pool_histogram *hist, double q)
+{
+    return (double)pool_histogram_quantile(hist, q) / 1000.0;
+}
+
+static void *http_report_worker(void *arg)
+{
+    unsigned int worker = (unsigned int)pool_worker_id();
+    struct pool_worker_stats stats;
+    pool_worker_stats(thread_pool, worker, &stats);
+
+    // keep the lines of one worker together
+    flockfile(stdout);
+    printf("pool worker=%u tasks=%llu idle_ms=%.3f idle_work_ms=%.3f wait_p50_us=%.1f wait_p99_us=%.1f "
+           "service_p50_us=%.1f service_p99_us=%.1f\n",
+           worker, stats.tasks, (double)stats.idle_ns / 1e6, (double)stats.idle_work.sum_ns / 1e6,
+           http_quantile_us(&stats.wait, 0.5), http_quantile_us(&stats.wait, 0.99),
+           http_quantile_us(&stats.service, 0.5), http_quantile_us(&stats.service, 0.99));
+    http_apps_report(worker, stdout);
+    fflush(stdout);
+    funlockfile(stdout);
+    return NULL;
+}
+
+void http_report_stats(void)
+{
+    for (unsigned int i = 0; i < http_workers; i++)
+    {
+        pool_enqueue_to(thread_pool, i, http_report_worker, NULL, 0);
+    }
+}
+
+static void *http_dump_worker(void *arg)
+{
+    http_apps_dump((unsigned int)pool_worker_id(), arg);
+    return NULL;
+}
+
+void http_dump_heaps(const char *dir)
+{
+    for (unsigned int i = 0; i < http_workers; i++)
+    {
+        pool_enqueue_to(thread_pool, i, http_dump_worker, strdup(dir), 1);
+    }
+}
+
 void http_end()
 {
     event_base_loopbreak(http);
     pthread_join(http_thread, NULL);
     event_base_free(http);
     pool_end(thread_pool);
+    http_apps_free();
 }
@@ -0,0 +1,344 @@
+#include "server.h"
+
+/**
+ * a node of the compressed radix tree. a node matches the bytes of [prefix]
+ * and then continues in one of its children: a static child, picked by the
+ * next byte of the path, a `:name` child that matches one path segment, or a
+ * `*name` child that matches everything left.
+ */
+struct _RouteNode
+{
+    char *prefix;
+    size_t prefix_len;
+    /** static children, no two of them start with the same byte */
+    struct _RouteNode **children;
+    size_t child_count;
+    struct _RouteNode *param;
+    struct _RouteNode *wildcard;
+    /** the route for each HttpMethodTyp ending at this node, -1 if none */
+    int routes[HTTP_METHOD_COUNT];
+};
+
+struct _Router
+{
+    struct _RouteNode *root;
+};
+
+static struct _RouteNode *route_node_new(const char *prefix, size_t prefix_len)
+{
+    struct _RouteNode *node = calloc(1, sizeof(struct _RouteNode));
+    if (node == NULL)
+    {
+        return NULL;
+    }
+
+    node->prefix = malloc(prefix_len + 1);
+    if (node->prefix == NULL)
+    {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->prefix, prefix, prefix_len);
+    node->prefix[prefix_len] = '\0';
+    node->prefix_len = prefix_len;
+
+    for (int i = 0; i < HTTP_METHOD_COUNT; i++)
+    {
+        node->routes[i] = -1;
+    }
+    return node;
+}
+
+static void route_node_free(struct _RouteNode *node)
+{
+    if (node == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < node->child_count; i++)
+    {
+        route_node_free(node->children[i]);
+    }
+    route_node_free(node->param);
+    route_node_free(node->wildcard);
+    free(node->children);
+    free(node->prefix);
+    free(node);
+}
+
+/**
+ * whether a route for [method] ends at [node], or a route for any method if
+ * [method] is HTTP_UNKNOWN.
+ */
+static bool route_node_has_route(const struct _RouteNode *node, enum HttpMethodTyp method)
+{
+    if (method != HTTP_UNKNOWN)
+    {
+        return node->routes[method] != -1;
+    }
+
+    for (int i = 0; i < HTTP_METHOD_COUNT; i++)
+    {
+        if (node->routes[i] != -1)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static struct _RouteNode *route_node_child(const struct _RouteNode *node, char c)
+{
+    for (size_t i = 0; i < node->child_count; i++)
+    {
+        if (node->children[i]->prefix[0] == c)
+        {
+            return node->children[i];
+        }
+    }
+    return NULL;
+}
+
+static bool route_node_add_child(struct _RouteNode *node, struct _RouteNode *child)
+{
+    struct _RouteNode **children = realloc(node->children, (node->child_count + 1) * sizeof(struct _RouteNode *));
+    if (children == NULL)
+    {
+        return false;
+    }
+    children[node->child_count++] = child;
+    node->children = children;
+    return true;
+}
+
+/**
+ * splits [node] after the first [at] bytes of its prefix, moving the rest of
+ * the prefix, the children and the routes of [node] to a new child.
+ */
+static bool route_node_split(struct _RouteNode *node, size_t at)
+{
+    struct _RouteNode *rest = route_node_new(node->prefix + at, node->prefix_len - at);
+    if (rest == NULL)
+    {
+        return false;
+    }
+
+    rest->children = node->children;
+    rest->child_count = node->child_count;
+    rest->param = node->param;
+    rest->wildcard = node->wildcard;
+    memcpy(rest->routes, node->routes, sizeof(node->routes));
+
+    node->children = NULL;
+    node->child_count = 0;
+    node->param = NULL;
+    node->wildcard = NULL;
+    for (int i = 0; i < HTTP_METHOD_COUNT; i++)
+    {
+        node->routes[i] = -1;
+    }
+    node->prefix[at] = '\0';
+    node->prefix_len = at;
+
+    if (!route_node_add_child(node, rest))
+    {
+        route_node_free(rest);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * returns the node the remaining [path] of a pattern ends at below [node],
+ * creating the missing nodes. [params] is incremented for every parameter.
+ * returns `NULL` if the pattern is malformed or memory runs out.
+ */
+static struct _RouteNode *route_insert(struct _RouteNode *node, const char *path, int *params)
+{
+    while (*path != '\0')
+    {
+        if (*path == ':' || *path == '*')
+        {
+            // parameters take a whole segment and need a name
+            if (path[-1] != '/')
+            {
+                return NULL;
+            }
+            size_t name_len = strcspn(path + 1, "/");
+            if (name_len == 0 || ++*params > ROUTER_MAX_PARAMS)
+            {
+                return NULL;
+            }
+
+            struct _RouteNode **slot = (*path == ':') ? &node->param : &node->wildcard;
+            if (*path == '*' && path[1 + name_len] != '\0')
+            {
+                return NULL;
+            }
+            if (*slot == NULL && (*slot = route_node_new("", 0)) == NULL)
+            {
+                return NULL;
+            }
+            node = *slot;
+            path += 1 + name_len;
+            continue;
+        }
+
+        // the static run up to the next parameter
+        size_t len = strcspn(path, ":*");
+        struct _RouteNode *child = route_node_child(node, *path);
+        if (child == NULL)
+        {
+            child = route_node_new(path, len);
+            if (child == NULL || !route_node_add_child(node, child))
+            {
+                route_node_free(child);
+                return NULL;
+            }
+            node = child;
+            path += len;
+            continue;
+        }
+
+        size_t common = 0;
+        while (common < len && common < child->prefix_len && child->prefix[common] == path[common])
+        {
+            common++;
+        }
+        if (common < child->prefix_len && !route_node_split(child, common))
+        {
+            return NULL;
+        }
+        node = child;
+        path += common;
+    }
+    return node;
+}
+
+Router *router_new(void)
+{
+    Router *router = malloc(sizeof(Router));
+    if (router == NULL)
+    {
+        return NULL;
+    }
+
+    router->root = route_node_new("", 0);
+    if (router->root == NULL)
+    {
+        free(router);
+        return NULL;
+    }
+    return router;
+}
+
+int router_add(Router *router, enum HttpMethodTyp method, const char *path, int route)
+{
+    assert(method > HTTP_UNKNOWN && method < HTTP_METHOD_COUNT);
+
+    if (path[0] != '/')
+    {
+        return -1;
+    }
+
+    int params = 0;
+    struct _RouteNode *node = route_insert(router->root, path, &params);
+    if (node == NULL || node->routes[method] != -1)
+    {
+        return -1;
+    }
+    node->routes[method] = route;
+    return params;
+}
+
+/**
+ * matches the remaining [path] below [node], whose own prefix has already been
+ * matched, ending at a node with a route for [method]. static children are
+ * tried before parameters and parameters before wildcards, backtracking if a
+ * more specific branch leads nowhere.
+ */
+static const struct _RouteNode *route_find(const struct _RouteNode *node, enum HttpMethodTyp method, const char *path, size_t len, RouteMatch *match)
+{
+    if (len == 0 && route_node_has_route(node, method))
+    {
+        return node;
+    }
+
+    if (len > 0)
+    {
+        const struct _RouteNode *child = route_node_child(node, path[0]);
+        if (child != NULL && child->prefix_len <= len && memcmp(child->prefix, path, child->prefix_len) == 0)
+        {
+            const struct _RouteNode *found = route_find(child, method, path + child->prefix_len, len - child->prefix_len, match);
+            if (found != NULL)
+            {
+                return found;
+            }
+        }
+    }
+
+    if (node->param != NULL && len > 0 && path[0] != '/')
+    {
+        size_t segment = 0;
+        while (segment < len && path[segment] != '/')
+        {
+            segment++;
+        }
+
+        int param = match->param_count++;
+        match->params[param].start = path;
+        match->params[param].len = segment;
+        const struct _RouteNode *found = route_find(node->param, method, path + segment, len - segment, match);
+        if (found != NULL)
+        {
+            return found;
+        }
+        match->param_count--;
+    }
+
+    if (node->wildcard != NULL && route_node_has_route(node->wildcard, method))
+    {
+        int param = match->param_count++;
+        match->params[param].start = path;
+        match->params[param].len = len;
+        return node->wildcard;
+    }
+    return NULL;
+}
+
+enum RouteResult router_match(const Router *router, enum HttpMethodTyp method, const char *path, size_t len, RouteMatch *match)
+{
+    match->route = -1;
+    match->param_count = 0;
+
+    if (method != HTTP_UNKNOWN)
+    {
+        const struct _RouteNode *node = route_find(router->root, method, path, len, match);
+        if (node != NULL)
+        {
+            match->route = node->routes[method];
+            return ROUTE_FOUND;
+        }
+        match->param_count = 0;
+    }
+
+    // a path only routed for other methods is not allowed rather than missing
+    if (route_find(router->root, HTTP_UNKNOWN, path, len, match) != NULL)
+    {
+        match->param_count = 0;
+        return ROUTE_METHOD_NOT_ALLOWED;
+    }
+    return ROUTE_NOT_FOUND;
+}
+
+void router_free(Router *router)
+{
+    if (router == NULL)
+    {
+        return;
+    }
+
+    route_node_free(router->root);
+    free(router);
+}
@@ -2,6 +2,8 @@
 #include "pthread_pool.h"
 #include "tconfig.h"
 #include <sys/stat.h>
+#include <ctype.h>
+#include <signal.h>
 
 // our static variables
 static evutil_socket_t listener;
@@ -11,13 +13,16 @@ static struct event_base *server;
 static struct event *listener4_event;
 static struct event *listener6_event;
 static struct event *update_event;
+static struct event *dump_event;
 static struct timeval tv;
-static struct TConfig *config = NULL;
+static ini_table_s *config = NULL;
 static int port = 40000;
 static int threads = 16;
-static int ipv6 = 0;
+static bool ipv6 = false;
+static int stats_interval = 0;
+static const char *dump_dir = ".";
 static time_t last_config_mod_time = 0;
-static struct stat fstat;
+static struct stat config_stat;
 static const char *the_config_path = "";
 
 void cleanup_and_exit()
@@ -36,7 +41,6 @@ void cleanup_and_exit()
 
 void do_accept(evutil_socket_t listener, short event, void *arg)
 {
-  struct event_base *base = arg;
   struct sockaddr_storage ss;
   socklen_t slen = sizeof(ss);
   int fd = accept(listener, (struct sockaddr *)&ss, &slen);
@@ -45,26 +49,145 @@ void do_accept(evutil_socket_t listener, short event, void *arg)
   else if (fd > FD_SETSIZE)
     close(fd);
   else
-    handle_connection(fd, &ss, slen);
+    http_handle_connection(fd, &ss, slen);
 }
 
 void do_update(evutil_socket_t fd, short events, void *arg)
 {
-  stat(the_config_path, &fstat);
-  if (last_config_mod_time != fstat.st_mtime)
+  static int seconds = 0;
+  if (stats_interval > 0 && ++seconds >= stats_interval)
+  {
+    seconds = 0;
+    http_report_stats();
+  }
+
+  stat(the_config_path, &config_stat);
+  if (last_config_mod_time != config_stat.st_mtime)
   {
     // reload the configuration
     // TODO
   }
 }
 
+/** SIGUSR1 asks for a dump of every app heap on every worker */
+void do_dump(evutil_socket_t sig, short events, void *arg)
+{
+  http_dump_heaps(dump_dir);
+}
+
+/**
+ * reads [key] of [section] as a number of bytes, optionally followed by a
+ * k, m or g suffix for kilobytes, megabytes or gigabytes. returns false and
+ * leaves [size] alone if the key is missing or not a valid size.
+ */
+static bool read_size(const char *section, const char *key, size_t *size)
+{
+  const char *value = ini_table_get_entry(config, section, key);
+  if (value == NULL)
+    return false;
+
+  char *end;
+  errno = 0;
+  unsigned long long bytes = strtoull(value, &end, 10);
+  unsigned long long unit = 1;
+  switch (tolower((unsigned char)*end))
+  {
+  case 'k':
+    unit = 1024ULL;
+    end++;
+    break;
+  case 'm':
+    unit = 1024ULL * 1024;
+    end++;
+    break;
+  case 'g':
+    unit = 1024ULL * 1024 * 1024;
+    end++;
+    break;
+  }
+  if (end == value || *end != '\0' || errno != 0 || value[0] == '-' || bytes == 0 || bytes > SIZE_MAX / unit)
+  {
+    fprintf(stderr, "Invalid %s for application %s: %s\n", key, section + 4, value);
+    return false;
+  }
+  *size = (size_t)(bytes * unit);
+  return true;
+}
+
+/**
+ * applies the heap settings of the [section] of [app] to the configuration
+ * its VMs are created with.
+ */
+static void read_app_heap(const char *section, HttpApplication *app)
+{
+  WrenConfiguration *vm_config = &app->vm_config;
+  read_size(section, "initialHeapSize", &vm_config->initialHeapSize);
+  read_size(section, "minHeapSize", &vm_config->minHeapSize);
+  read_size(section, "maxHeapSize", &vm_config->maxHeapSize);
+  read_size(section, "nurserySize", &vm_config->nurserySize);
+
+  int growth;
+  if (ini_table_get_entry_as_int(config, section, "heapGrowthPercent", &growth))
+  {
+    if (growth > 0)
+      vm_config->heapGrowthPercent = growth;
+    else
+      fprintf(stderr, "Invalid heapGrowthPercent for application %s: %d\n", section + 4, growth);
+  }
+
+  int idle_gc_budget;
+  if (ini_table_get_entry_as_int(config, section, "idleGcBudget", &idle_gc_budget))
+  {
+    if (idle_gc_budget >= 0)
+      app->idle_gc_budget_ns = (unsigned long long)idle_gc_budget * 1000;
+    else
+      fprintf(stderr, "Invalid idleGcBudget for application %s: %d\n", section + 4, idle_gc_budget);
+  }
+
+  int mark_threads;
+  if (ini_table_get_entry_as_int(config, section, "markThreads", &mark_threads))
+  {
+    if (mark_threads > 0)
+      vm_config->markThreads = mark_threads;
+    else
+      fprintf(stderr, "Invalid markThreads for application %s: %d\n", section + 4, mark_threads);
+  }
+
+  if (vm_config->maxHeapSize > 0 && vm_config->minHeapSize > vm_config->maxHeapSize)
+  {
+    fprintf(stderr, "Application %s has a minHeapSize above its maxHeapSize\n", section + 4);
+    vm_config->minHeapSize = vm_config->maxHeapSize;
+  }
+}
+
+/**
+ * turns on the JIT for the VMs of [app] if the [section] asks for it, after
+ * `jitThreshold` calls and loop iterations of a function, or 1000 by default.
+ */
+static void read_app_jit(const char *section, HttpApplication *app)
+{
+  bool jit = false;
+  ini_table_get_entry_as_bool(config, section, "jit", &jit);
+  if (!jit)
+    return;
+
+  int threshold = 1000;
+  if (ini_table_get_entry_as_int(config, section, "jitThreshold", &threshold) && threshold <= 0)
+  {
+    fprintf(stderr, "Invalid jitThreshold for application %s: %d\n", section + 4, threshold);
+    threshold = 1000;
+  }
+  app->vm_config.jitThreshold = threshold;
+}
+
 void read_config(const char *config_path)
 {
-  config = tconfig_new();
-  if (tconfig_read_file(config, config_path) != 0)
+  config = ini_table_create();
+  if (!ini_table_read_from_file(config, config_path))
   {
     fprintf(stderr, "Failed to read config file: %s\n", config_path);
-    tconfig_free(config);
+    ini_table_destroy(config);
+    config = NULL;
     return;
   }
 
@@ -72,15 +195,38 @@ void read_config(const char *config_path)
   ini_table_get_entry_as_int(config, "server", "port", &port);
   ini_table_get_entry_as_int(config, "server", "threads", &threads);
   ini_table_get_entry_as_bool(config, "server", "ipv6", &ipv6);
+  ini_table_get_entry_as_int(config, "server", "statsInterval", &stats_interval);
+  const char *dir = ini_table_get_entry(config, "server", "dumpDir");
+  if (dir != NULL)
+    dump_dir = dir;
+
+  // every [app.<host>] section is an application served for that host
+  for (int i = 0; i < config->size; i++)
+  {
+    const char *section = config->section[i].name;
+    if (strncmp(section, "app.", 4) != 0)
+      continue;
+    const char *path = ini_table_get_entry(config, section, "path");
+    if (path == NULL)
+    {
+      fprintf(stderr, "Application %s has no path\n", section + 4);
+      continue;
+    }
+    HttpApplication *app = http_app_add(section + 4, path);
+    if (app != NULL)
+    {
+      read_app_heap(section, app);
+      read_app_jit(section, app);
+    }
+  }
 
-  stat(config_path, &fstat);
-  last_config_mod_time = fstat.st_mtime;
+  stat(config_path, &config_stat);
+  last_config_mod_time = config_stat.st_mtime;
   the_config_path = config_path;
 }
 
 int main(int argc, char **argv)
 {
-  event_init();
   // Initialize winsock2 if needed
 #ifdef _WIN32
   WSADATA WsaData;
@@ -99,7 +245,7 @@ int main(int argc, char **argv)
   // create the server event base
   server = event_base_new();
   if (!server)
-    return; /*XXXerr*/
+    return 1;
 
   // create the listening socket for ipv4
   sin4.sin_family = AF_INET;
@@ -112,12 +258,12 @@ int main(int argc, char **argv)
   if (bind(listener, (struct sockaddr *)&sin4, sizeof(sin4)) < 0)
   {
     perror("bind");
-    return;
+    return 1;
   }
   if (listen(listener, 16) < 0)
   {
     perror("listen");
-    return;
+    return 1;
   }
   // register the listener event
   listener4_event = event_new(server, listener, EV_READ | EV_PERSIST, do_accept, (void *)server);
@@ -135,12 +281,12 @@ int main(int argc, char **argv)
     if (bind(listener6, (struct sockaddr *)&sin6, sizeof(sin6)) < 0)
     {
       perror("bind");
-      return;
+      return 1;
     }
     if (listen(listener6, 16) < 0)
     {
       perror("listen");
-      return;
+      return 1;
     } // register the listener event
     listener6_event = event_new(server, listener6, EV_READ | EV_PERSIST, do_accept, (void *)server);
     event_add(listener6_event, NULL);
@@ -150,6 +296,10 @@ int main(int argc, char **argv)
   tv.tv_usec = 0;
   update_event = event_new(server, -1, EV_TIMEOUT | EV_PERSIST, do_update, NULL);
   event_add(update_event, &tv);
+#ifndef _WIN32
+  dump_event = evsignal_new(server, SIGUSR1, do_dump, NULL);
+  event_add(dump_event, NULL);
+#endif
   http_start(threads);
   // let's start the server
   event_base_dispatch(server);
@@ -20,9 +20,14 @@
 #include <event2/bufferevent.h>
 #include <event2/thread.h>
 #include "wren.h"
+#include "pthread_pool.h"
 
 #define BUFFER_SIZE 1024
 #define MAX_HEADERS 128
+/** the longest request head, a longer one gets 431 */
+#define MAX_HEAD_LENGTH 16384
+/** the longest request body, a longer one gets 413 */
+#define MAX_BODY_LENGTH (1 << 20)
 
 enum HttpMethodTyp
 {
@@ -32,6 +37,7 @@ enum HttpMethodTyp
     HTTP_PUT,
     HTTP_PATCH,
     HTTP_DELETE,
+    HTTP_METHOD_COUNT,
 };
 
 struct HttpMethod
@@ -40,16 +46,17 @@ struct HttpMethod
     enum HttpMethodTyp typ;
 };
 
-const char HTTP_VERSION[] = "HTTP/1.1";
+extern const char HTTP_VERSION[];
 
-struct HttpMethod KNOWN_HTTP_METHODS[] = {
-    {.str = "GET", .typ = HTTP_GET},
-    {.str = "POST", .typ = HTTP_POST},
-    {.str = "PUT", .typ = HTTP_PUT},
-    {.str = "PATCH", .typ = HTTP_PATCH},
-    {.str = "DELETE", .typ = HTTP_DELETE},
-    {.str = NULL, .typ = HTTP_UNKNOWN},
-};
+/** the methods the server knows, ending with one whose `str` is `NULL` */
+extern const struct HttpMethod KNOWN_HTTP_METHODS[];
+
+/** a request header, both strings point into the request's buffer */
+typedef struct _HttpHeader
+{
+    char *name;
+    char *value;
+} HttpHeader;
 
 typedef struct _HttpRequest
 {
@@ -61,14 +68,195 @@ typedef struct _HttpRequest
     char *_buffer;
     size_t _buffer_len;
     struct Bstring *body;
+    HttpHeader headers[MAX_HEADERS];
+    int header_count;
 } HttpRequest;
 
+/**
+ * the data of a `Request` object of the wrensong module. [request] is only
+ * set while a handler runs. every exchange gets a new object, so one a
+ * handler kept never sees a later request.
+ */
+typedef struct _HttpRequestObject
+{
+    WrenHandle *handle;
+    HttpRequest *request;
+} HttpRequestObject;
+
+/**
+ * the data of a `Response` object of the wrensong module, which writes to
+ * the connection of [bev] while a handler runs.
+ */
+typedef struct _HttpResponseObject
+{
+    WrenHandle *handle;
+    struct bufferevent *bev;
+    /** 0 until the handler sets one */
+    int status;
+    /** the serialized headers set by the handler, sent with the head */
+    struct evbuffer *headers;
+    bool has_content_type;
+    /** whether the head went out, after which the body is sent chunked */
+    bool head_sent;
+} HttpResponseObject;
+
+/** the most parameters a single route may capture */
+#define ROUTER_MAX_PARAMS 8
+
+/**
+ * a compressed radix tree mapping path patterns such as `/users/:id` to route
+ * numbers, see router_add.
+ */
+typedef struct _Router Router;
+
+enum RouteResult
+{
+    ROUTE_FOUND,
+    /** the path matches a route, but not one for the request's method */
+    ROUTE_METHOD_NOT_ALLOWED,
+    ROUTE_NOT_FOUND,
+};
+
+/**
+ * the result of router_match. the captured parameters point into the matched
+ * path, in the order they appear in the pattern.
+ */
+typedef struct _RouteMatch
+{
+    int route;
+    int param_count;
+    struct
+    {
+        const char *start;
+        size_t len;
+    } params[ROUTER_MAX_PARAMS];
+} RouteMatch;
+
+/** blocks of up to this many bytes, header included, come from size classes */
+#define SLAB_MAX_BLOCK 256
+#define SLAB_CLASS_COUNT (SLAB_MAX_BLOCK / 16)
+
+typedef struct _SlabStats
+{
+    /** the bytes the VM asked for and has not freed */
+    size_t requested;
+    /** the bytes of the size-class blocks holding them, headers included */
+    size_t in_use;
+    /** the bytes of chunks taken from the system for size-class blocks */
+    size_t reserved;
+    /** the bytes of allocations too big for a size class, headers included */
+    size_t large;
+    size_t large_count;
+} SlabStats;
+
+/**
+ * a heap for the objects of a single VM. blocks of each size class are cut
+ * from chunks with a bump pointer and recycled through per-class free lists,
+ * bigger allocations go to malloc. not thread safe, a VM only ever runs on
+ * one thread at a time.
+ */
+typedef struct _SlabAllocator
+{
+    void *free_lists[SLAB_CLASS_COUNT];
+    struct _SlabChunk *chunks;
+    char *bump;
+    char *bump_end;
+    SlabStats stats;
+} SlabAllocator;
+
+struct _HttpApplication;
+struct _HttpExchange;
+
+/**
+ * a handler method of App. after any path parameters it takes the Request
+ * and then the Response, as many of the two as it has room for.
+ */
+typedef struct _HttpHandler
+{
+    WrenHandle *method;
+    /** 0, 1 or 2, the number of Request and Response arguments */
+    int context;
+} HttpHandler;
+
+/**
+ * a module imported by an application, compiled once for all its replicas.
+ */
+typedef struct _HttpImport
+{
+    char *name;
+    char *source;
+    WrenCodeImage *image;
+    UT_hash_handle hh;
+} HttpImport;
+
+/**
+ * One instance of an application, owned by a single pool worker.
+ *
+ * WrenVM is not thread-safe, so every worker runs its own copy of each app and
+ * only ever touches its own replica. Module-level variables in app code are
+ * therefore per-replica: two requests served by different workers will not
+ * see each other's writes, and nothing should rely on them being shared.
+ */
+typedef struct _HttpAppReplica
+{
+    struct _HttpApplication *app;
+    int worker;
+    WrenVM *vm;
+    /** the App class, the receiver of every handler call */
+    WrenHandle *receiver;
+    /**
+     * the handler for each HttpMethodTyp, resolved once when the replica is
+     * created, so dispatching a request is a lookup followed by wrenCall.
+     * the method is `NULL` if the app has no handler for that method.
+     */
+    HttpHandler handlers[HTTP_METHOD_COUNT];
+    /** the routes declared by `#!route` attributes on the methods of App */
+    Router *router;
+    /** the handler of each route, indexed by the route numbers in [router] */
+    HttpHandler *routes;
+    int route_count;
+    /** the Request and Response classes of the wrensong module */
+    WrenHandle *request_class;
+    WrenHandle *response_class;
+    /**
+     * the header buffers of released Responses, kept for later ones. the
+     * objects themselves are new for every exchange.
+     */
+    struct evbuffer **header_buffers;
+    int header_buffer_count;
+    int header_buffer_capacity;
+    /** the exchange whose handler is running, for waits to resume later */
+    struct _HttpExchange *current;
+    /** `Fiber.transfer(_)`, to resume a suspended handler */
+    WrenHandle *transfer;
+    /** the name of each HttpMethodTyp, for comparing with Wren strings */
+    WrenReference *method_names[HTTP_METHOD_COUNT];
+    /** the heap of [vm], see app_reallocate */
+    SlabAllocator heap;
+    /** what is left of the idle collection budget until [vm] runs again */
+    unsigned long long idle_gc_left_ns;
+    /** idle collection time past the budget, taken off the next budgets */
+    unsigned long long idle_gc_overrun_ns;
+    /** the bytes of heap an idle collection gets through per nanosecond */
+    double idle_gc_rate;
+    /** idle collection slices run and the time they took */
+    unsigned long long idle_gc_slices;
+    unsigned long long idle_gc_ns;
+} HttpAppReplica;
+
 typedef struct _HttpApplication 
 {
     char name[128];
     struct Bstring *path;
+    struct Bstring *dir;
     WrenConfiguration vm_config;
-    WrenVM *vm;
+    /** the compiled main script, shared read-only by every replica */
+    WrenCodeImage *image;
+    HttpImport *imports;
+    pthread_mutex_t imports_lock;
+    HttpAppReplica *replicas;
+    /** the time a replica may spend collecting garbage while its worker is idle */
+    unsigned long long idle_gc_budget_ns;
     UT_hash_handle hh;
 } HttpApplication;
 
@@ -78,14 +266,156 @@ typedef struct _HttpConnection
     struct sockaddr_storage addr;
     int addr_len;
     char addr_str[64];
+    /** the request handed to a worker, the next one is read once it is done */
     HttpRequest request;
+    bool busy;
+    /** whether [request] asked for the connection to be closed after it */
+    bool closing;
     struct bufferevent *bev;
     HttpApplication *apps;
     HttpApplication *slot[8];
     UT_hash_handle hh;
 } HttpConnection;
 
+/**
+ * a request being handled by a Wren handler.
+ *
+ * each handler runs on a fiber of its own. a handler that waits for something
+ * suspends its fiber, which frees the worker for other requests, and the
+ * exchange lives on until the fiber is resumed and returns, see
+ * http_exchange_resume.
+ */
+typedef struct _HttpExchange
+{
+    HttpConnection *conn;
+    /** owns the request's buffer */
+    HttpRequest request;
+    HttpAppReplica *replica;
+    HttpRequestObject *request_object;
+    HttpResponseObject *response_object;
+    bool closing;
+    /** a resume is pending, see http_exchange_resume */
+    bool waiting;
+    /** the handler returned while [waiting], the resume frees the exchange */
+    bool finished;
+} HttpExchange;
+
 extern struct Bstring *filename;
+extern struct event_base *http;
 extern void http_handle_connection(int conn_fd, void *arg, int arg_len);
 extern void http_start(int thread_count);
 extern void http_end();
+extern void http_pool_stats(struct pool_stats *stats);
+/**
+ * has every worker write its pool counters and the heap statistics of its
+ * replicas to stdout, one `key=value` line each, once it gets to it.
+ */
+extern void http_report_stats(void);
+/**
+ * has every worker write a heap dump of each of its replicas to a file in
+ * [dir], once it gets to it. see tools/heapstat.c for reading them.
+ */
+extern void http_dump_heaps(const char *dir);
+/**
+ * resumes the handler of [exchange] by transferring to [fiber], which the
+ * handler suspended after handing it over, with `null`. the handle is
+ * released. may be called from any thread, the fiber is resumed on the worker
+ * owning the exchange's replica.
+ */
+extern void http_exchange_resume(HttpExchange *exchange, WrenHandle *fiber);
+
+extern HttpApplication *applications;
+/**
+ * registers the application served for requests with the Host [name], whose
+ * main script lives at [path]. must be called before http_start.
+ */
+extern HttpApplication *http_app_add(const char *name, const char *path);
+extern HttpApplication *http_app_find(const char *host);
+extern void http_apps_start(unsigned int workers);
+/**
+ * returns the calling worker's replica of [app], creating its VM and running
+ * the main script on first use. returns `NULL` if the app failed to load.
+ */
+extern HttpAppReplica *http_app_replica(HttpApplication *app);
+/**
+ * the idle function of the thread pool. runs a slice of garbage collection in
+ * each of [worker]'s replicas that has run Wren code since it last used up its
+ * budget, and returns nonzero while any of them has more to do.
+ */
+extern int http_apps_idle(unsigned int worker, void *arg);
+/**
+ * writes the heap statistics of [worker]'s replicas to [out]. must be called
+ * on that worker.
+ */
+extern void http_apps_report(unsigned int worker, FILE *out);
+/**
+ * writes a heap dump of each of [worker]'s replicas to a file in [dir]. must
+ * be called on that worker.
+ */
+extern void http_apps_dump(unsigned int worker, const char *dir);
+extern void http_apps_free(void);
+
+extern const char *http_module_source;
+extern WrenForeignClassMethods http_module_bind_class(WrenVM *vm, const char *module, const char *class_name);
+extern WrenForeignMethodFn http_module_bind_method(WrenVM *vm, const char *module, const char *class_name,
+                                                   bool is_static, const char *signature);
+/**
+ * loads the wrensong module into a replica's VM, unless the app already
+ * imported it, and looks up what the server needs from it.
+ */
+extern bool http_module_init(HttpAppReplica *replica);
+extern void http_module_free(HttpAppReplica *replica);
+/**
+ * stores a new Request for [request] in [slot]. it must be given back with
+ * http_request_release once the handler has returned, which makes it
+ * unusable from Wren and leaves it to the GC.
+ */
+extern HttpRequestObject *http_request_acquire(HttpAppReplica *replica, HttpRequest *request, int slot);
+extern void http_request_release(HttpAppReplica *replica, HttpRequestObject *object);
+/**
+ * stores a new Response writing to [bev] in [slot], like http_request_acquire.
+ * releasing it keeps its header buffer for the next one.
+ */
+extern HttpResponseObject *http_response_acquire(HttpAppReplica *replica, struct bufferevent *bev, int slot);
+/**
+ * completes the response once its handler has returned [body], which may be
+ * `NULL`. a response nothing was written to yet is sent whole, with a 404
+ * status if there is no body and no status was set.
+ */
+extern void http_response_end(HttpResponseObject *response, const char *body, size_t len);
+extern void http_response_release(HttpAppReplica *replica, HttpResponseObject *object);
+
+extern Router *router_new(void);
+/**
+ * adds the [route] number for [method] requests to paths matching the pattern
+ * [path]. a segment of the pattern written `:name` matches any single path
+ * segment and a last segment written `*name` matches the rest of the path,
+ * both are captured as parameters.
+ * returns the number of parameters of the pattern, or -1 if the pattern is
+ * malformed or already has a route for [method].
+ */
+extern int router_add(Router *router, enum HttpMethodTyp method, const char *path, int route);
+/**
+ * looks up the route for a [method] request to the first [len] bytes of
+ * [path]. takes time linear in [len] unless static and parameter segments of
+ * different patterns overlap, in which case the static ones are tried first.
+ */
+extern enum RouteResult router_match(const Router *router, enum HttpMethodTyp method, const char *path, size_t len, RouteMatch *match);
+extern void router_free(Router *router);
+
+/**
+ * allocates, resizes or frees like `realloc`, for a `reallocateFn`. freeing
+ * passes a [size] of 0.
+ */
+extern void *slab_reallocate(SlabAllocator *slab, void *memory, size_t size);
+/**
+ * fills [stats], with the free bytes of the chunks as the difference between
+ * the reserved and in use sizes and the padding of blocks as the difference
+ * between the in use and requested ones.
+ */
+extern void slab_stats(const SlabAllocator *slab, SlabStats *stats);
+/**
+ * gives every chunk back to the system. any block still allocated from
+ * [slab] becomes invalid, large ones are not freed.
+ */
+extern void slab_release(SlabAllocator *slab);
@@ -0,0 +1,181 @@
+#include "server.h"
+
+/** every block starts with the size that was asked for */
+#define SLAB_HEADER sizeof(size_t)
+#define SLAB_CHUNK_SIZE (64 * 1024)
+
+struct _SlabChunk
+{
+    struct _SlabChunk *next;
+    /** keeps the blocks that follow aligned to 16 bytes */
+    size_t padding;
+};
+
+/** the size of the block holding an allocation of [size] bytes */
+static size_t slab_block_size(size_t size)
+{
+    return (size + SLAB_HEADER + 15) & ~(size_t)15;
+}
+
+static void slab_push(SlabAllocator *slab, char *block, size_t block_size)
+{
+    void **head = &slab->free_lists[block_size / 16 - 1];
+    *(void **)block = *head;
+    *head = block;
+}
+
+/**
+ * takes a block of [block_size] bytes from the free list of its class, or
+ * cuts it from the current chunk, starting a new one if it is used up.
+ */
+static char *slab_take(SlabAllocator *slab, size_t block_size)
+{
+    void **head = &slab->free_lists[block_size / 16 - 1];
+    if (*head != NULL)
+    {
+        char *block = *head;
+        *head = *(void **)block;
+        return block;
+    }
+
+    if ((size_t)(slab->bump_end - slab->bump) < block_size)
+    {
+        struct _SlabChunk *chunk = malloc(SLAB_CHUNK_SIZE);
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+
+        // the end of the old chunk is always smaller than the biggest class
+        size_t rest = (size_t)(slab->bump_end - slab->bump);
+        if (rest > 0)
+        {
+            slab_push(slab, slab->bump, rest);
+        }
+
+        chunk->next = slab->chunks;
+        slab->chunks = chunk;
+        slab->bump = (char *)(chunk + 1);
+        slab->bump_end = (char *)chunk + SLAB_CHUNK_SIZE;
+        slab->stats.reserved += SLAB_CHUNK_SIZE - sizeof(struct _SlabChunk);
+    }
+
+    char *block = slab->bump;
+    slab->bump += block_size;
+    return block;
+}
+
+/** returns the payload of a new block for [size] bytes, or `NULL` */
+static void *slab_alloc(SlabAllocator *slab, size_t size)
+{
+    size_t block_size = slab_block_size(size);
+    char *block;
+    if (block_size <= SLAB_MAX_BLOCK)
+    {
+        block = slab_take(slab, block_size);
+        if (block == NULL)
+        {
+            return NULL;
+        }
+        slab->stats.in_use += block_size;
+    }
+    else
+    {
+        block = malloc(SLAB_HEADER + size);
+        if (block == NULL)
+        {
+            return NULL;
+        }
+        slab->stats.large += SLAB_HEADER + size;
+        slab->stats.large_count++;
+    }
+
+    *(size_t *)block = size;
+    slab->stats.requested += size;
+    return block + SLAB_HEADER;
+}
+
+static void slab_free(SlabAllocator *slab, char *block)
+{
+    size_t size = *(size_t *)block;
+    size_t block_size = slab_block_size(size);
+    slab->stats.requested -= size;
+    if (block_size <= SLAB_MAX_BLOCK)
+    {
+        slab->stats.in_use -= block_size;
+        slab_push(slab, block, block_size);
+    }
+    else
+    {
+        slab->stats.large -= SLAB_HEADER + size;
+        slab->stats.large_count--;
+        free(block);
+    }
+}
+
+void *slab_reallocate(SlabAllocator *slab, void *memory, size_t size)
+{
+    if (memory == NULL)
+    {
+        return size == 0 ? NULL : slab_alloc(slab, size);
+    }
+
+    char *block = (char *)memory - SLAB_HEADER;
+    if (size == 0)
+    {
+        slab_free(slab, block);
+        return NULL;
+    }
+
+    size_t old_size = *(size_t *)block;
+    size_t old_block_size = slab_block_size(old_size);
+    size_t block_size = slab_block_size(size);
+
+    // still fits the same block
+    if (block_size == old_block_size && block_size <= SLAB_MAX_BLOCK)
+    {
+        *(size_t *)block = size;
+        slab->stats.requested = slab->stats.requested - old_size + size;
+        return memory;
+    }
+
+    // large blocks are left to realloc, which can often grow them in place
+    if (old_block_size > SLAB_MAX_BLOCK && block_size > SLAB_MAX_BLOCK)
+    {
+        block = realloc(block, SLAB_HEADER + size);
+        if (block == NULL)
+        {
+            return NULL;
+        }
+        *(size_t *)block = size;
+        slab->stats.requested = slab->stats.requested - old_size + size;
+        slab->stats.large = slab->stats.large - old_size + size;
+        return block + SLAB_HEADER;
+    }
+
+    void *moved = slab_alloc(slab, size);
+    if (moved == NULL)
+    {
+        return NULL;
+    }
+    memcpy(moved, memory, old_size < size ? old_size : size);
+    slab_free(slab, block);
+    return moved;
+}
+
+void slab_stats(const SlabAllocator *slab, SlabStats *stats)
+{
+    *stats = slab->stats;
+}
+
+void slab_release(SlabAllocator *slab)
+{
+    struct _SlabChunk *chunk = slab->chunks;
+    while (chunk != NULL)
+    {
+        struct _SlabChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    memset(slab, 0, sizeof(SlabAllocator));
+}
@@ -0,0 +1,684 @@
+#include "server.h"
+#include <strings.h>
+
+/**
+ * the `wrensong` module app scripts import the classes backed by the server
+ * from. it is built in, so it never goes through the app's directory.
+ */
+const char *http_module_source =
+    "foreign class Request {\n"
+    "  foreign method\n"
+    "  foreign isMethod(name)\n"
+    "  foreign path\n"
+    "  foreign query\n"
+    "  foreign header(name)\n"
+    "  foreign hasHeader(name)\n"
+    "  foreign headerIs(name, value)\n"
+    "  toString { \"%(method) %(path)\" }\n"
+    "}\n"
+    "foreign class Response {\n"
+    "  foreign status\n"
+    "  foreign status=(value)\n"
+    "  foreign header(name, value)\n"
+    "  foreign write(bytes)\n"
+    "}\n"
+    "class Timer {\n"
+    "  static sleep(milliseconds) {\n"
+    "    sleep_(milliseconds, Fiber.current)\n"
+    "    return Fiber.suspend()\n"
+    "  }\n"
+    "  foreign static sleep_(milliseconds, fiber)\n"
+    "}\n";
+
+typedef struct _HttpTimer
+{
+    HttpExchange *exchange;
+    WrenHandle *fiber;
+    struct event *event;
+} HttpTimer;
+
+/**
+ * returns the native request behind the Request in slot 0, or aborts the
+ * fiber and returns `NULL` if the handler it was made for has returned.
+ */
+static HttpRequest *request_get(WrenVM *vm)
+{
+    HttpRequest *request = ((HttpRequestObject *)wrenGetSlotForeign(vm, 0))->request;
+    if (request == NULL)
+    {
+        wrenSetSlotString(vm, 0, "Request is no longer valid.");
+        wrenAbortFiber(vm, 0);
+    }
+    return request;
+}
+
+/**
+ * returns the value of the header named by the string in [slot], compared
+ * case insensitively, or `NULL` if the request doesn't have it.
+ */
+static const char *request_header(WrenVM *vm, HttpRequest *request, int slot)
+{
+    if (wrenGetSlotType(vm, slot) != WREN_TYPE_STRING)
+    {
+        return NULL;
+    }
+
+    int len;
+    const char *name = wrenGetSlotBytes(vm, slot, &len);
+    for (int i = 0; i < request->header_count; i++)
+    {
+        const char *header = request->headers[i].name;
+        if (strncasecmp(header, name, (size_t)len) == 0 && header[len] == '\0')
+        {
+            return request->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+static void request_method(WrenVM *vm)
+{
+    HttpRequest *request = request_get(vm);
+    if (request == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; KNOWN_HTTP_METHODS[i].str != NULL; i++)
+    {
+        if (KNOWN_HTTP_METHODS[i].typ == request->method)
+        {
+            wrenSetSlotString(vm, 0, KNOWN_HTTP_METHODS[i].str);
+            return;
+        }
+    }
+    wrenSetSlotNull(vm, 0);
+}
+
+static void request_is_method(WrenVM *vm)
+{
+    HttpRequest *request = request_get(vm);
+    if (request == NULL)
+    {
+        return;
+    }
+
+    HttpAppReplica *replica = wrenGetUserData(vm);
+    WrenReference *method = replica->method_names[request->method];
+    wrenSetSlotBool(vm, 0, method != NULL && wrenGetSlotType(vm, 1) == WREN_TYPE_STRING &&
+                               wrenGetSlotBytesEqual(vm, 1, method));
+}
+
+static void request_path(WrenVM *vm)
+{
+    HttpRequest *request = request_get(vm);
+    if (request == NULL)
+    {
+        return;
+    }
+
+    wrenSetSlotBytes(vm, 0, request->path, strcspn(request->path, "?"));
+}
+
+static void request_query(WrenVM *vm)
+{
+    HttpRequest *request = request_get(vm);
+    if (request == NULL)
+    {
+        return;
+    }
+
+    const char *query = strchr(request->path, '?');
+    if (query == NULL)
+    {
+        wrenSetSlotNull(vm, 0);
+        return;
+    }
+    wrenSetSlotString(vm, 0, query + 1);
+}
+
+static void request_header_value(WrenVM *vm)
+{
+    HttpRequest *request = request_get(vm);
+    if (request == NULL)
+    {
+        return;
+    }
+
+    const char *value = request_header(vm, request, 1);
+    if (value == NULL)
+    {
+        wrenSetSlotNull(vm, 0);
+        return;
+    }
+    wrenSetSlotString(vm, 0, value);
+}
+
+static void request_has_header(WrenVM *vm)
+{
+    HttpRequest *request = request_get(vm);
+    if (request == NULL)
+    {
+        return;
+    }
+
+    wrenSetSlotBool(vm, 0, request_header(vm, request, 1) != NULL);
+}
+
+/** compares a header with a string without creating a string for the header */
+static void request_header_is(WrenVM *vm)
+{
+    HttpRequest *request = request_get(vm);
+    if (request == NULL)
+    {
+        return;
+    }
+
+    const char *value = request_header(vm, request, 1);
+    if (value == NULL || wrenGetSlotType(vm, 2) != WREN_TYPE_STRING)
+    {
+        wrenSetSlotBool(vm, 0, false);
+        return;
+    }
+
+    int len;
+    const char *expected = wrenGetSlotBytes(vm, 2, &len);
+    wrenSetSlotBool(vm, 0, strncmp(value, expected, (size_t)len) == 0 && value[len] == '\0');
+}
+
+/**
+ * returns the reason phrase sent with [status].
+ */
+static const char *response_reason(int status)
+{
+    switch (status)
+    {
+    case 100: return "Continue";
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 409: return "Conflict";
+    case 410: return "Gone";
+    case 413: return "Payload Too Large";
+    case 415: return "Unsupported Media Type";
+    case 422: return "Unprocessable Entity";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default: return "Unknown";
+    }
+}
+
+/**
+ * writes the status line and headers of [response] to the connection. a
+ * negative [content_length] sends the body chunked, as it is written.
+ */
+static void response_send_head(HttpResponseObject *response, long content_length)
+{
+    struct evbuffer *output = bufferevent_get_output(response->bev);
+
+    evbuffer_add_printf(output, "%s %d %s\r\n", HTTP_VERSION, response->status, response_reason(response->status));
+    if (!response->has_content_type)
+    {
+        evbuffer_add_printf(output, "Content-Type: text/plain\r\n");
+    }
+    evbuffer_add_buffer(output, response->headers);
+    if (content_length < 0)
+    {
+        evbuffer_add_printf(output, "Transfer-Encoding: chunked\r\n\r\n");
+    }
+    else
+    {
+        evbuffer_add_printf(output, "Content-Length: %ld\r\n\r\n", content_length);
+    }
+    response->head_sent = true;
+}
+
+static void response_send_chunk(HttpResponseObject *response, const char *bytes, size_t len)
+{
+    struct evbuffer *output = bufferevent_get_output(response->bev);
+    evbuffer_add_printf(output, "%zx\r\n", len);
+    evbuffer_add(output, bytes, len);
+    evbuffer_add(output, "\r\n", 2);
+}
+
+/**
+ * returns the Response in slot 0, or aborts the fiber and returns `NULL` if
+ * the handler it was made for has returned.
+ */
+static HttpResponseObject *response_get(WrenVM *vm)
+{
+    HttpResponseObject *response = wrenGetSlotForeign(vm, 0);
+    if (response->bev == NULL)
+    {
+        wrenSetSlotString(vm, 0, "Response is no longer valid.");
+        wrenAbortFiber(vm, 0);
+        return NULL;
+    }
+    return response;
+}
+
+/**
+ * aborts the fiber if the head of [response] has already been sent, so it
+ * can no longer be changed.
+ */
+static bool response_check_head(WrenVM *vm, HttpResponseObject *response)
+{
+    if (response->head_sent)
+    {
+        wrenSetSlotString(vm, 0, "Headers have already been sent.");
+        wrenAbortFiber(vm, 0);
+        return false;
+    }
+    return true;
+}
+
+static void response_status(WrenVM *vm)
+{
+    HttpResponseObject *response = response_get(vm);
+    if (response == NULL)
+    {
+        return;
+    }
+
+    wrenSetSlotDouble(vm, 0, response->status == 0 ? 200 : response->status);
+}
+
+static void response_set_status(WrenVM *vm)
+{
+    HttpResponseObject *response = response_get(vm);
+    if (response == NULL || !response_check_head(vm, response))
+    {
+        return;
+    }
+
+    double status = wrenGetSlotType(vm, 1) == WREN_TYPE_NUM ? wrenGetSlotDouble(vm, 1) : 0;
+    if (status < 100 || status > 999 || status != (int)status)
+    {
+        wrenSetSlotString(vm, 0, "Status must be an integer from 100 to 999.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    response->status = (int)status;
+}
+
+static void response_header(WrenVM *vm)
+{
+    HttpResponseObject *response = response_get(vm);
+    if (response == NULL || !response_check_head(vm, response))
+    {
+        return;
+    }
+
+    if (wrenGetSlotType(vm, 1) != WREN_TYPE_STRING || wrenGetSlotType(vm, 2) != WREN_TYPE_STRING)
+    {
+        wrenSetSlotString(vm, 0, "Header name and value must be strings.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+
+    int name_len, value_len;
+    const char *name = wrenGetSlotBytes(vm, 1, &name_len);
+    const char *value = wrenGetSlotBytes(vm, 2, &value_len);
+    // a line break would let the value start headers of its own
+    if (name_len == 0 || strcspn(name, ":\r\n") != (size_t)name_len || strcspn(value, "\r\n") != (size_t)value_len)
+    {
+        wrenSetSlotString(vm, 0, "Invalid header.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    if ((name_len == 14 && strncasecmp(name, "Content-Length", 14) == 0) ||
+        (name_len == 17 && strncasecmp(name, "Transfer-Encoding", 17) == 0))
+    {
+        wrenSetSlotString(vm, 0, "The body framing headers are set by the server.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    if (name_len == 12 && strncasecmp(name, "Content-Type", 12) == 0)
+    {
+        response->has_content_type = true;
+    }
+
+    evbuffer_add(response->headers, name, (size_t)name_len);
+    evbuffer_add(response->headers, ": ", 2);
+    evbuffer_add(response->headers, value, (size_t)value_len);
+    evbuffer_add(response->headers, "\r\n", 2);
+    wrenSetSlotNull(vm, 0);
+}
+
+/**
+ * sends the bytes of a string to the client right away. the first write
+ * sends the head, so the status and headers are fixed from then on.
+ */
+static void response_write(WrenVM *vm)
+{
+    HttpResponseObject *response = response_get(vm);
+    if (response == NULL)
+    {
+        return;
+    }
+
+    if (wrenGetSlotType(vm, 1) != WREN_TYPE_STRING)
+    {
+        wrenSetSlotString(vm, 0, "Can only write strings.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+
+    int len;
+    const char *bytes = wrenGetSlotBytes(vm, 1, &len);
+    // an empty chunk would end the body
+    if (len > 0)
+    {
+        if (!response->head_sent)
+        {
+            if (response->status == 0)
+            {
+                response->status = 200;
+            }
+            response_send_head(response, -1);
+        }
+        response_send_chunk(response, bytes, (size_t)len);
+    }
+    wrenSetSlotNull(vm, 0);
+}
+
+/** runs on the event loop thread */
+static void timer_fire(evutil_socket_t fd, short events, void *arg)
+{
+    HttpTimer *timer = arg;
+    event_free(timer->event);
+    http_exchange_resume(timer->exchange, timer->fiber);
+    free(timer);
+}
+
+/**
+ * resumes the fiber in slot 2 after the number of milliseconds in slot 1.
+ * the fiber must suspend itself right after this returns.
+ */
+static void timer_sleep(WrenVM *vm)
+{
+    HttpAppReplica *replica = wrenGetUserData(vm);
+    HttpExchange *exchange = replica->current;
+    if (exchange == NULL)
+    {
+        wrenSetSlotString(vm, 0, "Can only wait while handling a request.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    if (exchange->waiting)
+    {
+        wrenSetSlotString(vm, 0, "The request is already waiting.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+
+    double milliseconds = wrenGetSlotType(vm, 1) == WREN_TYPE_NUM ? wrenGetSlotDouble(vm, 1) : -1;
+    if (!(milliseconds >= 0 && milliseconds <= 86400000))
+    {
+        wrenSetSlotString(vm, 0, "Milliseconds must be a number from 0 to 86400000.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+
+    HttpTimer *timer = malloc(sizeof(HttpTimer));
+    if (timer == NULL || (timer->event = evtimer_new(http, timer_fire, timer)) == NULL)
+    {
+        free(timer);
+        wrenSetSlotString(vm, 0, "Could not create timer.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    timer->exchange = exchange;
+    timer->fiber = wrenGetSlotHandle(vm, 2);
+    exchange->waiting = true;
+
+    long usec = (long)(milliseconds * 1000);
+    struct timeval delay = {usec / 1000000, usec % 1000000};
+    evtimer_add(timer->event, &delay);
+    wrenSetSlotNull(vm, 0);
+}
+
+static void response_finalize(void *data)
+{
+    HttpResponseObject *response = data;
+    if (response->headers != NULL)
+    {
+        evbuffer_free(response->headers);
+    }
+}
+
+WrenForeignClassMethods http_module_bind_class(WrenVM *vm, const char *module, const char *class_name)
+{
+    WrenForeignClassMethods methods = {NULL, NULL};
+    if (strcmp(module, "wrensong") == 0 && strcmp(class_name, "Response") == 0)
+    {
+        methods.finalize = response_finalize;
+    }
+    return methods;
+}
+
+WrenForeignMethodFn http_module_bind_method(WrenVM *vm, const char *module, const char *class_name, bool is_static,
+                                            const char *signature)
+{
+    if (strcmp(module, "wrensong") != 0)
+    {
+        return NULL;
+    }
+
+    if (is_static)
+    {
+        if (strcmp(class_name, "Timer") == 0 && strcmp(signature, "sleep_(_,_)") == 0)
+            return timer_sleep;
+        return NULL;
+    }
+
+    if (strcmp(class_name, "Request") == 0)
+    {
+        if (strcmp(signature, "method") == 0)
+            return request_method;
+        if (strcmp(signature, "isMethod(_)") == 0)
+            return request_is_method;
+        if (strcmp(signature, "path") == 0)
+            return request_path;
+        if (strcmp(signature, "query") == 0)
+            return request_query;
+        if (strcmp(signature, "header(_)") == 0)
+            return request_header_value;
+        if (strcmp(signature, "hasHeader(_)") == 0)
+            return request_has_header;
+        if (strcmp(signature, "headerIs(_,_)") == 0)
+            return request_header_is;
+    }
+    else if (strcmp(class_name, "Response") == 0)
+    {
+        if (strcmp(signature, "status") == 0)
+            return response_status;
+        if (strcmp(signature, "status=(_)") == 0)
+            return response_set_status;
+        if (strcmp(signature, "header(_,_)") == 0)
+            return response_header;
+        if (strcmp(signature, "write(_)") == 0)
+            return response_write;
+    }
+    return NULL;
+}
+
+/**
+ * stores a new instance of [cls] in [slot]. the object's data must start
+ * with the WrenHandle that keeps it alive until the exchange is over.
+ */
+static void *object_new(WrenVM *vm, WrenHandle *cls, size_t size, int slot)
+{
+    wrenSetSlotHandle(vm, slot, cls);
+    void *object = wrenSetSlotNewForeign(vm, slot, slot, size);
+    *(WrenHandle **)object = wrenGetSlotHandle(vm, slot);
+    return object;
+}
+
+static WrenHandle *class_get(WrenVM *vm, const char *class_name)
+{
+    wrenEnsureSlots(vm, 1);
+    wrenGetVariable(vm, "wrensong", class_name, 0);
+    return wrenGetSlotHandle(vm, 0);
+}
+
+static void class_free(WrenVM *vm, WrenHandle **cls)
+{
+    if (*cls != NULL)
+    {
+        wrenReleaseHandle(vm, *cls);
+        *cls = NULL;
+    }
+}
+
+bool http_module_init(HttpAppReplica *replica)
+{
+    WrenVM *vm = replica->vm;
+
+    // the app may not have imported the module itself
+    if (!wrenHasModule(vm, "wrensong") && wrenInterpret(vm, "wrensong", http_module_source) != WREN_RESULT_SUCCESS)
+    {
+        return false;
+    }
+
+    replica->request_class = class_get(vm, "Request");
+    replica->response_class = class_get(vm, "Response");
+    replica->transfer = wrenMakeCallHandle(vm, "transfer(_)");
+
+    for (int i = 0; KNOWN_HTTP_METHODS[i].str != NULL; i++)
+    {
+        const char *name = KNOWN_HTTP_METHODS[i].str;
+        replica->method_names[KNOWN_HTTP_METHODS[i].typ] = wrenMakeReference(vm, name, (int)strlen(name));
+    }
+    return true;
+}
+
+void http_module_free(HttpAppReplica *replica)
+{
+    WrenVM *vm = replica->vm;
+
+    class_free(vm, &replica->request_class);
+    class_free(vm, &replica->response_class);
+    for (int i = 0; i < replica->header_buffer_count; i++)
+    {
+        evbuffer_free(replica->header_buffers[i]);
+    }
+    free(replica->header_buffers);
+    replica->header_buffers = NULL;
+    replica->header_buffer_count = 0;
+    replica->header_buffer_capacity = 0;
+    if (replica->transfer != NULL)
+    {
+        wrenReleaseHandle(vm, replica->transfer);
+        replica->transfer = NULL;
+    }
+
+    for (int i = 0; i < HTTP_METHOD_COUNT; i++)
+    {
+        if (replica->method_names[i] != NULL)
+        {
+            wrenReleaseReference(vm, replica->method_names[i]);
+            replica->method_names[i] = NULL;
+        }
+    }
+}
+
+HttpRequestObject *http_request_acquire(HttpAppReplica *replica, HttpRequest *request, int slot)
+{
+    HttpRequestObject *object = object_new(replica->vm, replica->request_class, sizeof(HttpRequestObject), slot);
+    object->request = request;
+    return object;
+}
+
+void http_request_release(HttpAppReplica *replica, HttpRequestObject *object)
+{
+    // a handler may have kept the object, which must not outlive the request
+    object->request = NULL;
+    wrenReleaseHandle(replica->vm, object->handle);
+    object->handle = NULL;
+}
+
+HttpResponseObject *http_response_acquire(HttpAppReplica *replica, struct bufferevent *bev, int slot)
+{
+    HttpResponseObject *object = object_new(replica->vm, replica->response_class, sizeof(HttpResponseObject), slot);
+    if (replica->header_buffer_count > 0)
+    {
+        object->headers = replica->header_buffers[--replica->header_buffer_count];
+    }
+    else
+    {
+        object->headers = evbuffer_new();
+    }
+    object->bev = bev;
+    object->status = 0;
+    object->has_content_type = false;
+    object->head_sent = false;
+    return object;
+}
+
+void http_response_end(HttpResponseObject *response, const char *body, size_t len)
+{
+    if (!response->head_sent)
+    {
+        if (response->status == 0)
+        {
+            response->status = body != NULL ? 200 : 404;
+        }
+        response_send_head(response, (long)len);
+        if (len > 0)
+        {
+            evbuffer_add(bufferevent_get_output(response->bev), body, len);
+        }
+        return;
+    }
+
+    if (len > 0)
+    {
+        response_send_chunk(response, body, len);
+    }
+    evbuffer_add(bufferevent_get_output(response->bev), "0\r\n\r\n", 5);
+}
+
+void http_response_release(HttpAppReplica *replica, HttpResponseObject *object)
+{
+    // a handler may have kept the object, which must not write to the
+    // connection once it serves another request
+    object->bev = NULL;
+    wrenReleaseHandle(replica->vm, object->handle);
+    object->handle = NULL;
+
+    struct evbuffer *headers = object->headers;
+    object->headers = NULL;
+    evbuffer_drain(headers, evbuffer_get_length(headers));
+    if (replica->header_buffer_count == replica->header_buffer_capacity)
+    {
+        int capacity = replica->header_buffer_capacity == 0 ? 4 : replica->header_buffer_capacity * 2;
+        struct evbuffer **buffers = realloc(replica->header_buffers, capacity * sizeof(struct evbuffer *));
+        if (buffers == NULL)
+        {
+            evbuffer_free(headers);
+            return;
+        }
+        replica->header_buffers = buffers;
+        replica->header_buffer_capacity = capacity;
+    }
+    replica->header_buffers[replica->header_buffer_count++] = headers;
+}
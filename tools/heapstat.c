@@ -0,0 +1,664 @@
+/**
+ * heapstat reads a heap dump written by wrenDumpHeap and prints where the
+ * memory goes: the bytes each class retains, the bytes each module variable
+ * retains and the objects that dominate the most memory.
+ *
+ * an object X dominates Y if every path from the roots to Y goes through X,
+ * so freeing X would free Y too. the bytes X retains are its own and those of
+ * every object it dominates.
+ *
+ * usage: heapstat [-n count] dump
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** the record tags and version of the format, see lib/wren_debug.c */
+enum HeapTag
+{
+    HEAP_TAG_OBJECT = 1,
+    HEAP_TAG_NAME,
+    HEAP_TAG_ROOT,
+    HEAP_TAG_VARIABLE,
+    HEAP_TAG_END
+};
+#define HEAP_DUMP_VERSION 1
+
+/** the names of Wren's ObjType, in order */
+static const char *type_names[] = {"class", "closure", "fiber", "fn", "foreign", "instance",
+                                   "list",  "map",     "module", "range", "string", "upvalue"};
+#define TYPE_COUNT (sizeof(type_names) / sizeof(type_names[0]))
+
+/** node 0 stands for the roots, the objects are numbered from 1 in dump order */
+#define ROOT 0
+#define NONE UINT32_MAX
+
+typedef struct
+{
+    uint64_t id;
+    uint64_t class_id;
+    uint64_t size;
+    uint32_t type;
+    /** the references, ids at first, see resolve_edges */
+    size_t edges;
+    size_t edge_count;
+    /** the index of the object's label in [labels] */
+    uint32_t label;
+} Node;
+
+typedef struct
+{
+    uint64_t id;
+    char *name;
+} Name;
+
+typedef struct
+{
+    uint64_t module;
+    char *name;
+    uint64_t target;
+} Variable;
+
+typedef struct
+{
+    const char *name;
+    uint64_t count;
+    uint64_t size;
+    uint64_t retained;
+    /** the label's objects on the dominator tree path being walked */
+    uint32_t active;
+} Label;
+
+typedef struct
+{
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+    int error;
+} Reader;
+
+static Node *nodes;
+static uint32_t node_count = 1;
+static uint64_t *edges;
+static size_t edge_count;
+static Name *names;
+static size_t name_count;
+static Variable *variables;
+static size_t variable_count;
+static Label *labels;
+static uint32_t label_count;
+
+static void *grow(void *array, size_t count, size_t *capacity, size_t item_size)
+{
+    if (count < *capacity)
+    {
+        return array;
+    }
+    *capacity = *capacity == 0 ? 1024 : *capacity * 2;
+    array = realloc(array, *capacity * item_size);
+    if (array == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return array;
+}
+
+static uint64_t read_number(Reader *reader)
+{
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (reader->pos >= reader->size)
+        {
+            reader->error = 1;
+            return 0;
+        }
+        uint8_t byte = reader->data[reader->pos++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return value;
+        }
+    }
+    reader->error = 1;
+    return 0;
+}
+
+static char *read_name(Reader *reader)
+{
+    uint64_t length = read_number(reader);
+    if (reader->error || length > reader->size - reader->pos)
+    {
+        reader->error = 1;
+        return NULL;
+    }
+    char *name = malloc(length + 1);
+    memcpy(name, reader->data + reader->pos, length);
+    name[length] = '\0';
+    reader->pos += length;
+    return name;
+}
+
+/** reads the records of a dump, returns 0 if it is malformed */
+static int read_dump(Reader *reader)
+{
+    size_t node_capacity = 0, edge_capacity = 0, name_capacity = 0, variable_capacity = 0;
+
+    if (reader->size < 4 || memcmp(reader->data, "WRNH", 4) != 0)
+    {
+        return 0;
+    }
+    reader->pos = 4;
+    if (read_number(reader) != HEAP_DUMP_VERSION)
+    {
+        return 0;
+    }
+
+    // the roots become the references of node 0
+    nodes = grow(nodes, 0, &node_capacity, sizeof(Node));
+    memset(&nodes[ROOT], 0, sizeof(Node));
+
+    while (!reader->error && reader->pos < reader->size)
+    {
+        uint8_t tag = reader->data[reader->pos++];
+        switch (tag)
+        {
+        case HEAP_TAG_OBJECT:
+        {
+            nodes = grow(nodes, node_count, &node_capacity, sizeof(Node));
+            Node *node = &nodes[node_count++];
+            node->id = read_number(reader);
+            node->type = (uint32_t)read_number(reader);
+            node->class_id = read_number(reader);
+            node->size = read_number(reader);
+            node->edge_count = read_number(reader);
+            node->edges = edge_count;
+            for (size_t i = 0; i < node->edge_count && !reader->error; i++)
+            {
+                edges = grow(edges, edge_count, &edge_capacity, sizeof(uint64_t));
+                edges[edge_count++] = read_number(reader);
+            }
+            break;
+        }
+
+        case HEAP_TAG_NAME:
+            names = grow(names, name_count, &name_capacity, sizeof(Name));
+            names[name_count].id = read_number(reader);
+            names[name_count].name = read_name(reader);
+            name_count++;
+            break;
+
+        case HEAP_TAG_ROOT:
+            // roots come first, so they are still contiguous
+            read_number(reader);
+            edges = grow(edges, edge_count, &edge_capacity, sizeof(uint64_t));
+            edges[edge_count++] = read_number(reader);
+            nodes[ROOT].edge_count++;
+            break;
+
+        case HEAP_TAG_VARIABLE:
+            variables = grow(variables, variable_count, &variable_capacity, sizeof(Variable));
+            variables[variable_count].module = read_number(reader);
+            variables[variable_count].name = read_name(reader);
+            variables[variable_count].target = read_number(reader);
+            variable_count++;
+            break;
+
+        case HEAP_TAG_END:
+            return !reader->error;
+
+        default:
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/** the nodes sorted by id, to find a node by the id of an object */
+static uint32_t *by_id;
+
+static int compare_by_id(const void *a, const void *b)
+{
+    uint64_t x = nodes[*(const uint32_t *)a].id;
+    uint64_t y = nodes[*(const uint32_t *)b].id;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t find_node(uint64_t id)
+{
+    size_t low = 0, high = node_count - 1;
+    while (low < high)
+    {
+        size_t mid = (low + high) / 2;
+        if (nodes[by_id[mid]].id < id)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low < node_count - 1 && nodes[by_id[low]].id == id ? by_id[low] : NONE;
+}
+
+/** replaces the ids in [edges] by node numbers, NONE for unknown objects */
+static void resolve_edges(void)
+{
+    by_id = malloc((node_count - 1) * sizeof(uint32_t));
+    for (uint32_t i = 1; i < node_count; i++)
+    {
+        by_id[i - 1] = i;
+    }
+    qsort(by_id, node_count - 1, sizeof(uint32_t), compare_by_id);
+
+    for (size_t i = 0; i < edge_count; i++)
+    {
+        edges[i] = find_node(edges[i]);
+    }
+}
+
+static const char *find_name(uint64_t id)
+{
+    for (size_t i = 0; i < name_count; i++)
+    {
+        if (names[i].id == id)
+        {
+            return names[i].name;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * labels every object with the name of its class, or its type if the class
+ * has no name. instances of the same class share their label.
+ */
+static void label_nodes(void)
+{
+    // names are few, so a linear search of the labels is fine
+    labels = calloc(name_count + TYPE_COUNT + 1, sizeof(Label));
+    for (uint32_t i = 1; i < node_count; i++)
+    {
+        Node *node = &nodes[i];
+        const char *name = find_name(node->class_id);
+        if (name == NULL || *name == '\0')
+        {
+            name = node->type < TYPE_COUNT ? type_names[node->type] : "?";
+        }
+
+        uint32_t label = 0;
+        while (label < label_count && strcmp(labels[label].name, name) != 0)
+        {
+            label++;
+        }
+        if (label == label_count)
+        {
+            labels[label_count++].name = name;
+        }
+        node->label = label;
+        labels[label].count++;
+        labels[label].size += node->size;
+    }
+}
+
+static uint32_t *rpo;
+static uint32_t *rpo_index;
+static uint32_t reachable;
+
+/** numbers the objects reachable from the roots in reverse postorder */
+static void number_nodes(void)
+{
+    rpo = malloc(node_count * sizeof(uint32_t));
+    rpo_index = malloc(node_count * sizeof(uint32_t));
+    uint32_t *stack = malloc(node_count * sizeof(uint32_t));
+    size_t *next = calloc(node_count, sizeof(size_t));
+    char *seen = calloc(node_count, 1);
+    uint32_t post = node_count;
+    size_t depth = 0;
+
+    for (uint32_t i = 0; i < node_count; i++)
+    {
+        rpo_index[i] = NONE;
+    }
+
+    stack[depth++] = ROOT;
+    seen[ROOT] = 1;
+    while (depth > 0)
+    {
+        uint32_t v = stack[depth - 1];
+        if (next[v] < nodes[v].edge_count)
+        {
+            uint64_t w = edges[nodes[v].edges + next[v]++];
+            if (w != NONE && !seen[w])
+            {
+                seen[w] = 1;
+                stack[depth++] = (uint32_t)w;
+            }
+            continue;
+        }
+        depth--;
+        rpo[--post] = v;
+    }
+
+    // the unreachable ones were never numbered, shift the rest down
+    reachable = node_count - post;
+    memmove(rpo, rpo + post, reachable * sizeof(uint32_t));
+    for (uint32_t i = 0; i < reachable; i++)
+    {
+        rpo_index[rpo[i]] = i;
+    }
+    free(stack);
+    free(next);
+    free(seen);
+}
+
+static uint32_t *idom;
+static uint64_t *retained;
+
+static uint32_t intersect(uint32_t a, uint32_t b)
+{
+    while (a != b)
+    {
+        while (rpo_index[a] > rpo_index[b])
+            a = idom[a];
+        while (rpo_index[b] > rpo_index[a])
+            b = idom[b];
+    }
+    return a;
+}
+
+/**
+ * finds the immediate dominator of every reachable object with the iterative
+ * algorithm of Cooper, Harvey and Kennedy, then adds up the retained sizes.
+ */
+static void find_dominators(void)
+{
+    // predecessors of each node, in one array
+    size_t *pred_start = calloc(node_count + 1, sizeof(size_t));
+    for (uint32_t v = 0; v < node_count; v++)
+    {
+        for (size_t i = 0; i < nodes[v].edge_count; i++)
+        {
+            uint64_t w = edges[nodes[v].edges + i];
+            if (w != NONE && rpo_index[v] != NONE)
+                pred_start[w + 1]++;
+        }
+    }
+    for (uint32_t v = 0; v < node_count; v++)
+    {
+        pred_start[v + 1] += pred_start[v];
+    }
+    uint32_t *preds = malloc((pred_start[node_count] + 1) * sizeof(uint32_t));
+    size_t *fill = malloc(node_count * sizeof(size_t));
+    memcpy(fill, pred_start, node_count * sizeof(size_t));
+    for (uint32_t v = 0; v < node_count; v++)
+    {
+        for (size_t i = 0; i < nodes[v].edge_count; i++)
+        {
+            uint64_t w = edges[nodes[v].edges + i];
+            if (w != NONE && rpo_index[v] != NONE)
+                preds[fill[w]++] = v;
+        }
+    }
+
+    idom = malloc(node_count * sizeof(uint32_t));
+    for (uint32_t v = 0; v < node_count; v++)
+    {
+        idom[v] = NONE;
+    }
+    idom[ROOT] = ROOT;
+
+    int changed = 1;
+    while (changed)
+    {
+        changed = 0;
+        for (uint32_t i = 1; i < reachable; i++)
+        {
+            uint32_t v = rpo[i];
+            uint32_t dom = NONE;
+            for (size_t p = pred_start[v]; p < pred_start[v + 1]; p++)
+            {
+                uint32_t u = preds[p];
+                if (idom[u] == NONE)
+                    continue;
+                dom = dom == NONE ? u : intersect(u, dom);
+            }
+            if (dom != idom[v])
+            {
+                idom[v] = dom;
+                changed = 1;
+            }
+        }
+    }
+
+    // a dominator comes before everything it dominates in reverse postorder
+    retained = calloc(node_count, sizeof(uint64_t));
+    for (uint32_t i = reachable; i-- > 1;)
+    {
+        uint32_t v = rpo[i];
+        retained[v] += nodes[v].size;
+        retained[idom[v]] += retained[v];
+    }
+
+    free(pred_start);
+    free(preds);
+    free(fill);
+}
+
+/**
+ * adds up the bytes each label retains, counting an object only if no object
+ * of the same label dominates it, or they would be counted twice.
+ */
+static void retain_labels(void)
+{
+    size_t *child_start = calloc(node_count + 1, sizeof(size_t));
+    for (uint32_t i = 1; i < reachable; i++)
+    {
+        child_start[idom[rpo[i]] + 1]++;
+    }
+    for (uint32_t v = 0; v < node_count; v++)
+    {
+        child_start[v + 1] += child_start[v];
+    }
+    uint32_t *children = malloc((child_start[node_count] + 1) * sizeof(uint32_t));
+    size_t *fill = malloc(node_count * sizeof(size_t));
+    memcpy(fill, child_start, node_count * sizeof(size_t));
+    for (uint32_t i = 1; i < reachable; i++)
+    {
+        uint32_t v = rpo[i];
+        children[fill[idom[v]]++] = v;
+    }
+
+    // a depth first walk of the dominator tree, leaving each node once its
+    // children are done
+    uint32_t *stack = malloc(node_count * sizeof(uint32_t));
+    size_t *next = calloc(node_count, sizeof(size_t));
+    size_t depth = 0;
+    stack[depth++] = ROOT;
+    while (depth > 0)
+    {
+        uint32_t v = stack[depth - 1];
+        Label *label = v == ROOT ? NULL : &labels[nodes[v].label];
+        if (next[v] == 0 && label != NULL)
+        {
+            if (label->active++ == 0)
+                label->retained += retained[v];
+        }
+        if (child_start[v] + next[v] < child_start[v + 1])
+        {
+            stack[depth++] = children[child_start[v] + next[v]++];
+            continue;
+        }
+        if (label != NULL)
+            label->active--;
+        depth--;
+    }
+
+    free(child_start);
+    free(children);
+    free(fill);
+    free(stack);
+    free(next);
+}
+
+static int compare_labels(const void *a, const void *b)
+{
+    uint64_t x = ((const Label *)a)->retained, y = ((const Label *)b)->retained;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int compare_retained(const void *a, const void *b)
+{
+    uint64_t x = retained[*(const uint32_t *)a], y = retained[*(const uint32_t *)b];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+typedef struct
+{
+    const char *module;
+    const char *name;
+    uint32_t target;
+    uint64_t retained;
+    int shared;
+} Held;
+
+static int compare_held(const void *a, const void *b)
+{
+    uint64_t x = ((const Held *)a)->retained, y = ((const Held *)b)->retained;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/** the module variable holding node [v], or NULL */
+static const Held *held_by(const Held *held, size_t count, uint32_t v)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (held[i].target == v && !held[i].shared)
+            return &held[i];
+    }
+    return NULL;
+}
+
+static void print_report(size_t top)
+{
+    uint64_t total = 0, live = 0;
+    for (uint32_t i = 1; i < node_count; i++)
+    {
+        total += nodes[i].size;
+    }
+    live = retained[ROOT];
+    printf("%u objects, %llu bytes. %u reachable, %llu bytes. %llu bytes of garbage not yet collected.\n\n",
+           node_count - 1, (unsigned long long)total, reachable - 1, (unsigned long long)live,
+           (unsigned long long)(total - live));
+
+    // sorted apart, the objects still refer to [labels] by index
+    Label *sorted = malloc((label_count + 1) * sizeof(Label));
+    memcpy(sorted, labels, label_count * sizeof(Label));
+    qsort(sorted, label_count, sizeof(Label), compare_labels);
+    printf("%-32s %10s %14s %14s\n", "class", "count", "bytes", "retained");
+    for (uint32_t i = 0; i < label_count && i < top; i++)
+    {
+        printf("%-32s %10llu %14llu %14llu\n", sorted[i].name, (unsigned long long)sorted[i].count,
+               (unsigned long long)sorted[i].size, (unsigned long long)sorted[i].retained);
+    }
+    free(sorted);
+
+    // a variable retains its object only if nothing else leads there
+    Held *held = calloc(variable_count + 1, sizeof(Held));
+    size_t held_count = 0;
+    for (size_t i = 0; i < variable_count; i++)
+    {
+        uint32_t module = find_node(variables[i].module);
+        uint32_t target = find_node(variables[i].target);
+        if (module == NONE || target == NONE || rpo_index[target] == NONE)
+            continue;
+        const char *module_name = find_name(variables[i].module);
+        Held *h = &held[held_count++];
+        h->module = module_name == NULL || *module_name == '\0' ? "core" : module_name;
+        h->name = variables[i].name;
+        h->target = target;
+        h->shared = idom[target] != module;
+        h->retained = h->shared ? 0 : retained[target];
+    }
+    qsort(held, held_count, sizeof(Held), compare_held);
+    printf("\n%-48s %14s\n", "module variable", "retained");
+    for (size_t i = 0; i < held_count && i < top && held[i].retained > 0; i++)
+    {
+        char name[256];
+        snprintf(name, sizeof(name), "%s.%s", held[i].module, held[i].name);
+        printf("%-48s %14llu\n", name, (unsigned long long)held[i].retained);
+    }
+
+    // the objects retaining the most, each with what dominates it
+    uint32_t *order = malloc(reachable * sizeof(uint32_t));
+    memcpy(order, rpo, reachable * sizeof(uint32_t));
+    qsort(order + 1, reachable - 1, sizeof(uint32_t), compare_retained);
+    printf("\n%14s  %-32s %s\n", "retained", "object", "dominated by");
+    for (uint32_t i = 1; i < reachable && i <= top; i++)
+    {
+        uint32_t v = order[i];
+        const Held *var = held_by(held, held_count, v);
+        char owner[256];
+        if (var != NULL)
+            snprintf(owner, sizeof(owner), "variable %s.%s", var->module, var->name);
+        else if (idom[v] == ROOT)
+            snprintf(owner, sizeof(owner), "the roots");
+        else
+            snprintf(owner, sizeof(owner), "%s %llx", labels[nodes[idom[v]].label].name,
+                     (unsigned long long)nodes[idom[v]].id << 3);
+        char object[256];
+        snprintf(object, sizeof(object), "%s %llx", type_names[nodes[v].type < TYPE_COUNT ? nodes[v].type : 0],
+                 (unsigned long long)nodes[v].id << 3);
+        printf("%14llu  %-32s %s\n", (unsigned long long)retained[v], object, owner);
+    }
+    free(order);
+    free(held);
+}
+
+int main(int argc, char **argv)
+{
+    size_t top = 20;
+    int arg = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0)
+    {
+        top = (size_t)strtoul(argv[2], NULL, 10);
+        arg = 3;
+    }
+    if (arg != argc - 1)
+    {
+        fprintf(stderr, "Usage: %s [-n count] dump\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[arg], "rb");
+    if (file == NULL)
+    {
+        perror(argv[arg]);
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *data = malloc(size > 0 ? (size_t)size : 1);
+    if (size < 0 || fread(data, 1, (size_t)size, file) != (size_t)size)
+    {
+        fprintf(stderr, "Failed to read %s\n", argv[arg]);
+        return 1;
+    }
+    fclose(file);
+
+    Reader reader = {data, (size_t)size, 0, 0};
+    if (!read_dump(&reader))
+    {
+        fprintf(stderr, "%s is not a complete heap dump\n", argv[arg]);
+        return 1;
+    }
+
+    resolve_edges();
+    label_nodes();
+    number_nodes();
+    find_dominators();
+    retain_labels();
+    print_report(top);
+    free(data);
+    return 0;
+}